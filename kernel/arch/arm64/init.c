@@ -14,9 +14,14 @@ void arch_idle(void) {
 
     while (true) {
         unlock();
+        // Write buffered kernel logs into the console. We don't need the lock:
+        // only this CPU writes into its log buffer and IRQs are disabled here.
+        bool drained = klog_drain(KLOG_DRAIN_LEN) > 0;
         // Enable IRQ.
         __asm__ __volatile__("msr daifclr, #2");
-        __asm__ __volatile__("wfi");
+        if (!drained) {
+            __asm__ __volatile__("wfi");
+        }
         // Disable IRQ.
         __asm__ __volatile__("msr daifset, #2");
         lock();
@@ -16,6 +16,22 @@ void arm64_handle_interrupt(void) {
     handle_timer_irq();
 }
 
+/// Converts the ESR of an instruction/data abort into EXP_PF_* flags.
+static unsigned abort_to_fault(uint64_t esr, bool is_data_abort) {
+    unsigned fault = EXP_PF_USER;
+    // The permission fault (DFSC/IFSC = 0b0011xx): the page is present.
+    if ((esr & 0x3c) == 0x0c) {
+        fault |= EXP_PF_PRESENT;
+    }
+
+    // WnR: the abort was caused by a write.
+    if (is_data_abort && (esr & (1 << 6))) {
+        fault |= EXP_PF_WRITE;
+    }
+
+    return fault;
+}
+
 void arm64_handle_exception(void) {
     uint64_t esr = ARM64_MRS(esr_el1);
     uint64_t elr = ARM64_MRS(elr_el1);
@@ -33,8 +49,7 @@ void arm64_handle_exception(void) {
             TRACE("Instruction Abort: task=%s, far=%p, elr=%p, esr=%p",
                   CURRENT->name, far, elr, esr);
 #endif
-            handle_page_fault(far, elr,
-                              EXP_PF_USER | EXP_PF_WRITE /* FIXME: */);
+            handle_page_fault(far, elr, abort_to_fault(esr, false));
             break;
         // Data abort in userspace (page fault).
         case 0x24:
@@ -42,8 +57,7 @@ void arm64_handle_exception(void) {
             TRACE("Data Abort: task=%s, far=%p, elr=%p, esr=%p", CURRENT->name,
                   far, elr, esr);
 #endif
-            handle_page_fault(far, elr,
-                              EXP_PF_USER | EXP_PF_WRITE /* FIXME: */);
+            handle_page_fault(far, elr, abort_to_fault(esr, true));
             break;
         // Data abort in kernel.
         case 0x25:
@@ -56,8 +70,7 @@ void arm64_handle_exception(void) {
                       CURRENT->name, far, elr);
             }
 
-            handle_page_fault(far, elr,
-                              EXP_PF_USER | EXP_PF_WRITE /* FIXME: */);
+            handle_page_fault(far, elr, abort_to_fault(esr, true));
             break;
         default:
             PANIC("unknown exception: ec=%d (0x%x), elr=%p, far=%p", ec, ec,
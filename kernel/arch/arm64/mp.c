@@ -8,7 +8,13 @@ struct cpuvar *arm64_get_cpuvar(void) {
     return &cpuvars[mp_self()];
 }
 
+/// Returns the CPU-local variables of `cpu` or NULL if it does not exist.
+struct cpuvar *mp_cpuvar_of(int cpu) {
+    return (cpu < NUM_CPUS_MAX) ? &cpuvars[cpu] : NULL;
+}
+
 void halt(void) {
+    klog_flush();
     while (true) {
         __asm__ __volatile__("wfi");
     }
@@ -13,14 +13,11 @@ static uint8_t exception_stacks[CONFIG_NUM_TASKS][STACK_SIZE] __aligned(
     STACK_SIZE);
 
 // Prepare the initial stack for arm64_task_switch().
-static void init_stack(struct task *task, vaddr_t pc) {
-    // Initialize the page table.
-    memset(task->arch.page_table, 0, PAGE_SIZE);
-    task->arch.ttbr0 = ptr2paddr(task->arch.page_table);
-
+static void init_stack(struct task *task, vaddr_t pc, vaddr_t user_sp) {
     vaddr_t exception_stack = (vaddr_t) exception_stacks[task->tid];
     uint64_t *sp = (uint64_t *) (exception_stack + STACK_SIZE);
     // Fill the stack values for arm64_start_task().
+    *--sp = user_sp;
     *--sp = pc;
 
     int num_zeroed_regs = 11;  // x19-x29
@@ -32,11 +29,22 @@ static void init_stack(struct task *task, vaddr_t pc) {
     task->arch.stack = (vaddr_t) sp;
 }
 
-error_t arch_task_create(struct task *task, vaddr_t pc) {
+error_t arch_task_create(struct task *task, vaddr_t pc, vaddr_t sp) {
     void *syscall_stack = (void *) kernel_stacks[task->tid];
-    task->arch.page_table = page_tables[task->tid];
     task->arch.syscall_stack = (vaddr_t) syscall_stack + STACK_SIZE;
-    init_stack(task, pc);
+
+    if (task->owner != task) {
+        // A thread: share the page table with the owner task.
+        task->arch.page_table = task->owner->arch.page_table;
+        task->arch.ttbr0 = task->owner->arch.ttbr0;
+    } else {
+        // Initialize the page table.
+        task->arch.page_table = page_tables[task->tid];
+        memset(task->arch.page_table, 0, PAGE_SIZE);
+        task->arch.ttbr0 = ptr2paddr(task->arch.page_table);
+    }
+
+    init_stack(task, pc, sp);
     return OK;
 }
 
@@ -14,7 +14,9 @@ static uint64_t *traverse_page_table(uint64_t *table, vaddr_t vaddr,
     for (int level = 4; level > 1; level--) {
         int index = NTH_LEVEL_INDEX(level, vaddr);
         if (!table[index]) {
-            if (!attrs) {
+            if (!attrs || !kpage) {
+                // Not mapping a page or no page is given for the table: leave
+                // the page table untouched.
                 return NULL;
             }
 
@@ -37,6 +39,12 @@ error_t arch_vm_map(struct task *task, vaddr_t vaddr, paddr_t paddr,
                     paddr_t kpage, unsigned flags) {
     ASSERT(IS_ALIGNED(paddr, PAGE_SIZE));
 
+    // Large pages (level 2 block descriptors) are not supported. vm falls
+    // back to normal pages on ERR_UNAVAILABLE (see task_page_alloc_large()).
+    if (flags & MAP_LARGE) {
+        return ERR_UNAVAILABLE;
+    }
+
     uint64_t attrs;
     switch (MAP_TYPE(flags)) {
         case MAP_TYPE_READONLY:
@@ -82,6 +90,14 @@ error_t arch_vm_unmap(struct task *task, vaddr_t vaddr) {
     return OK;
 }
 
+/// Returns 1 if the page is mapped or ERR_NOT_FOUND if not. The access flag
+/// is set when the page is mapped and we don't handle access flag faults:
+/// mapped pages are always considered as accessed.
+int arch_vm_accessed(struct task *task, vaddr_t vaddr) {
+    uint64_t *entry = traverse_page_table(task->arch.page_table, vaddr, 0, 0);
+    return (entry && *entry) ? 1 : ERR_NOT_FOUND;
+}
+
 paddr_t vm_resolve(struct task *task, vaddr_t vaddr) {
     uint64_t *entry = traverse_page_table(task->arch.page_table, vaddr, 0, 0);
     return (entry) ? ENTRY_PADDR(*entry) : 0;
@@ -13,8 +13,9 @@ void example_init(void) {
 }
 
 void arch_idle(void) {
-    for (;;)
-        ;
+    for (;;) {
+        klog_drain(KLOG_DRAIN_LEN);
+    }
 }
 
 void arch_semihosting_halt(void) {
@@ -2,7 +2,12 @@
 
 struct cpuvar cpuvar;
 
+struct cpuvar *mp_cpuvar_of(int cpu) {
+    return (cpu == 0) ? &cpuvar : NULL;
+}
+
 void halt(void) {
+    klog_flush();
 }
 
 void mp_start(void) {
@@ -3,7 +3,7 @@
 #include <syscall.h>
 #include <task.h>
 
-error_t arch_task_create(struct task *task, vaddr_t pc) {
+error_t arch_task_create(struct task *task, vaddr_t pc, vaddr_t sp) {
     return OK;
 }
 
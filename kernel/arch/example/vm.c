@@ -11,6 +11,10 @@ error_t arch_vm_unmap(struct task *task, vaddr_t vaddr) {
     return OK;
 }
 
+int arch_vm_accessed(struct task *task, vaddr_t vaddr) {
+    return 1;
+}
+
 paddr_t vm_resolve(struct task *task, vaddr_t vaddr) {
     return 0;
 }
@@ -241,7 +241,7 @@ static inline void write_apic(paddr_t addr, uint32_t data) {
 // The maximum number of CPUs. Don't forget to expand the boot stack and
 // CPU-local variables space defined in kernel.ld as well!
 #define CPU_NUM_MAX     16
-#define CPUVAR_SIZE_MAX 0x4000  // Don't forget to update kernel.ld as well!
+#define CPUVAR_SIZE_MAX 0x8000
 
 extern char __mp_boot_trampoine[];      // paddr_t
 extern char __mp_boot_trampoine_end[];  // paddr_t
@@ -300,6 +300,10 @@ static inline void asm_cli(void) {
     __asm__ __volatile__("cli");
 }
 
+static inline void asm_sti(void) {
+    __asm__ __volatile__("sti; nop");
+}
+
 static inline void asm_stihlt(void) {
     __asm__ __volatile__("sti; hlt");
 }
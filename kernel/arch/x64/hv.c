@@ -302,7 +302,7 @@ void handle_cpuid(struct guest_regs *regs) {
 
 void call_pager(struct message *m, int expected_reply) {
     error_t err = ipc(CURRENT->pager, CURRENT->pager->tid,
-                      (__user struct message *) m, IPC_CALL | IPC_KERNEL);
+                      (__user struct message *) m, IPC_CALL | IPC_KERNEL, 0);
     if (IS_ERROR(err)) {
         WARN_DBG("%s: aborted kernel ipc", CURRENT->name);
         task_exit(EXP_ABORTED_KERNEL_IPC);
@@ -603,7 +603,7 @@ static bool inject_event_if_exists(void) {
     // Resumed this guest task. Continue executing...
     struct message m;
     error_t err = ipc(CURRENT->pager, IPC_ANY, (__user struct message *) &m,
-                      IPC_RECV | IPC_NOBLOCK | IPC_KERNEL);
+                      IPC_RECV | IPC_NOBLOCK | IPC_KERNEL, 0);
     if (err == OK && m.type == NOTIFICATIONS_MSG) {
         if (m.notifications.data & NOTIFY_ASYNC) {
             m.type = HV_AWAIT_MSG;
@@ -161,6 +161,11 @@ static void apic_init(void) {
 
 static struct cpuvar x64_cpuvars[CPU_NUM_MAX];
 
+/// Returns the CPU-local variables of `cpu` or NULL if it does not exist.
+struct cpuvar *mp_cpuvar_of(int cpu) {
+    return (cpu < mp_num_cpus()) ? &x64_cpuvars[cpu] : NULL;
+}
+
 static void common_setup(void) {
     STATIC_ASSERT(sizeof(struct cpuvar) <= CPUVAR_SIZE_MAX);
     STATIC_ASSERT(IS_ALIGNED(CPUVAR_SIZE_MAX, PAGE_SIZE));
@@ -245,8 +250,19 @@ __noreturn void arch_idle(void) {
     task_switch();
     while (true) {
         unlock();
-        asm_stihlt();
-        asm_cli();
+
+        // Write buffered kernel logs into the serial port. We don't need the
+        // lock: only this CPU writes into its log buffer and interrupts are
+        // disabled here.
+        if (klog_drain(KLOG_DRAIN_LEN) > 0) {
+            // Handle pending interrupts and continue draining.
+            asm_sti();
+            asm_cli();
+        } else {
+            asm_stihlt();
+            asm_cli();
+        }
+
         lock();
     }
 }
@@ -161,6 +161,7 @@ void panic_unlock(void) {
 
 void halt(void) {
     halt_other_cpus();
+    klog_flush();
     while (true) {
         __asm__ __volatile__("cli; hlt");
     }
@@ -13,12 +13,17 @@ static uint8_t syscall_stacks[CONFIG_NUM_TASKS][STACK_SIZE] __aligned(
     STACK_SIZE);
 static uint8_t xsave_areas[CONFIG_NUM_TASKS][4096] __aligned(4096);
 
-error_t arch_task_create(struct task *task, vaddr_t ip) {
+error_t arch_task_create(struct task *task, vaddr_t ip, vaddr_t sp) {
     if (!is_canonical_addr(ip)) {
         WARN_DBG("ip=%p is not canonical form address!", ip);
         return ERR_INVALID_ARG;
     }
 
+    if (!is_canonical_addr(sp)) {
+        WARN_DBG("sp=%p is not canonical form address!", sp);
+        return ERR_INVALID_ARG;
+    }
+
     void *kstack = (void *) kernel_stacks[task->tid];
     void *syscall_stack_bottom = (void *) syscall_stacks[task->tid];
     void *xsave = (void *) xsave_areas[task->tid];
@@ -33,22 +38,27 @@ error_t arch_task_create(struct task *task, vaddr_t ip) {
     task->arch.vmx.launched = false;
 #endif
 
-    // Initialize the page table.
-    task->arch.pml4 = ptr2paddr(pml4_tables[task->tid]);
-    uint64_t *table = paddr2ptr(task->arch.pml4);
-    memcpy(table, paddr2ptr((paddr_t) __kernel_pml4), PAGE_SIZE);
-
-    // The kernel no longer access a virtual address around 0x0000_0000. Unmap
-    // the area to catch bugs (especially NULL pointer dereferences in the
-    // kernel).
-    table[0] = 0;
+    if (task->owner != task) {
+        // A thread: share the page table with the owner task.
+        task->arch.pml4 = task->owner->arch.pml4;
+    } else {
+        // Initialize the page table.
+        task->arch.pml4 = ptr2paddr(pml4_tables[task->tid]);
+        uint64_t *table = paddr2ptr(task->arch.pml4);
+        memcpy(table, paddr2ptr((paddr_t) __kernel_pml4), PAGE_SIZE);
+
+        // The kernel no longer access a virtual address around 0x0000_0000.
+        // Unmap the area to catch bugs (especially NULL pointer dereferences
+        // in the kernel).
+        table[0] = 0;
+    }
 
     // Set up a temporary kernel stack frame.
     uint64_t *rsp = (uint64_t *) task->arch.interrupt_stack;
 
     // Push a IRET frame.
     *--rsp = USER_DS | USER_RPL;    // SS
-    *--rsp = 0;                     // RSP
+    *--rsp = sp;                    // RSP
     *--rsp = 0x202;                 // RFLAGS (interrupts enabled).
     *--rsp = USER_CS64 | USER_RPL;  // CS
     *--rsp = ip;                    // RIP
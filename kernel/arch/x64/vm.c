@@ -4,17 +4,28 @@
 #include <string.h>
 #include <task.h>
 
+/// Walks the page table down to the entry of `vaddr` in the `level`-th level
+/// table (1 for a page, 2 for a large page). If the walk reaches a large page
+/// mapped above the level, it returns the entry of the large page instead and
+/// sets `*large` (if not NULL).
 static uint64_t *traverse_page_table(uint64_t pml4, vaddr_t vaddr,
-                                     paddr_t kpage, uint64_t attrs) {
+                                     paddr_t kpage, uint64_t attrs, int level,
+                                     bool *large) {
     ASSERT(vaddr < KERNEL_BASE_ADDR);
     ASSERT(IS_ALIGNED(vaddr, PAGE_SIZE));
     ASSERT(IS_ALIGNED(kpage, PAGE_SIZE));
 
+    if (large) {
+        *large = false;
+    }
+
     uint64_t *table = paddr2ptr(pml4);
-    for (int level = 4; level > 1; level--) {
-        int index = NTH_LEVEL_INDEX(level, vaddr);
+    for (int i = 4; i > level; i--) {
+        int index = NTH_LEVEL_INDEX(i, vaddr);
         if (!table[index]) {
-            if (!attrs) {
+            if (!attrs || !kpage) {
+                // Not mapping a page or no page is given for the table: leave
+                // the page table untouched.
                 return NULL;
             }
 
@@ -24,6 +35,14 @@ static uint64_t *traverse_page_table(uint64_t pml4, vaddr_t vaddr,
             return NULL;
         }
 
+        if (table[index] & X64_PAGE_LARGE) {
+            if (large) {
+                *large = true;
+            }
+
+            return &table[index];
+        }
+
         // Update attributes if given.
         table[index] = table[index] | attrs;
 
@@ -31,7 +50,7 @@ static uint64_t *traverse_page_table(uint64_t pml4, vaddr_t vaddr,
         table = (uint64_t *) paddr2ptr(ENTRY_PADDR(table[index]));
     }
 
-    return &table[NTH_LEVEL_INDEX(1, vaddr)];
+    return &table[NTH_LEVEL_INDEX(level, vaddr)];
 }
 
 error_t arch_vm_map(struct task *task, vaddr_t vaddr, paddr_t paddr,
@@ -48,28 +67,94 @@ error_t arch_vm_map(struct task *task, vaddr_t vaddr, paddr_t paddr,
             break;
     }
 
-    uint64_t *entry = traverse_page_table(task->arch.pml4, vaddr, kpage, attrs);
+    bool large;
+    int level = (flags & MAP_LARGE) ? 2 : 1;
+    uint64_t *entry =
+        traverse_page_table(task->arch.pml4, vaddr, kpage, attrs, level, &large);
     if (!entry) {
         return (kpage) ? ERR_TRY_AGAIN : ERR_EMPTY;
     }
 
+    if (flags & MAP_LARGE) {
+        // Don't replace a page table: pages in it would be leaked.
+        if (large || (*entry && !(*entry & X64_PAGE_LARGE))) {
+            return ERR_ALREADY_EXISTS;
+        }
+
+        *entry = paddr | attrs | X64_PAGE_LARGE;
+        for (offset_t off = 0; off < LARGE_PAGE_SIZE; off += PAGE_SIZE) {
+            asm_invlpg(vaddr + off);
+        }
+
+        return OK;
+    }
+
+    if (large) {
+        // The page is in a large page.
+        return ERR_ALREADY_EXISTS;
+    }
+
     *entry = paddr | attrs;
     asm_invlpg(vaddr);
     return OK;
 }
 
 error_t arch_vm_unmap(struct task *task, vaddr_t vaddr) {
-    uint64_t *entry = traverse_page_table(task->arch.pml4, vaddr, 0, 0);
+    bool large;
+    uint64_t *entry =
+        traverse_page_table(task->arch.pml4, vaddr, 0, 0, 1, &large);
     if (!entry) {
         return ERR_NOT_FOUND;
     }
 
+    if (large) {
+        // A large page is unmapped at once from its beginning.
+        if (!IS_ALIGNED(vaddr, LARGE_PAGE_SIZE)) {
+            return ERR_NOT_ACCEPTABLE;
+        }
+
+        *entry = 0;
+        for (offset_t off = 0; off < LARGE_PAGE_SIZE; off += PAGE_SIZE) {
+            asm_invlpg(vaddr + off);
+        }
+
+        return OK;
+    }
+
     *entry = 0;
     asm_invlpg(vaddr);
     return OK;
 }
 
+/// Returns 1 if the page has been accessed since the last call and clears the
+/// accessed bit, 0 if not, or ERR_NOT_FOUND if it's not mapped.
+int arch_vm_accessed(struct task *task, vaddr_t vaddr) {
+    bool large;
+    uint64_t *entry =
+        traverse_page_table(task->arch.pml4, vaddr, 0, 0, 1, &large);
+    if (!entry || !(*entry & X64_PAGE_PRESENT)) {
+        return ERR_NOT_FOUND;
+    }
+
+    bool accessed = (*entry & X64_PAGE_ACCESSED) != 0;
+    *entry &= ~X64_PAGE_ACCESSED;
+    // The CPU sets the bit again only on a TLB miss. The TLB of other tasks
+    // is flushed on the next task switch.
+    asm_invlpg(vaddr);
+    return accessed;
+}
+
 paddr_t vm_resolve(struct task *task, vaddr_t vaddr) {
-    uint64_t *entry = traverse_page_table(task->arch.pml4, vaddr, 0, 0);
-    return (entry) ? ENTRY_PADDR(*entry) : 0;
+    bool large;
+    uint64_t *entry =
+        traverse_page_table(task->arch.pml4, vaddr, 0, 0, 1, &large);
+    if (!entry) {
+        return 0;
+    }
+
+    if (large) {
+        return ENTRY_PADDR(*entry) + (vaddr % LARGE_PAGE_SIZE);
+    }
+
+    return ENTRY_PADDR(*entry);
 }
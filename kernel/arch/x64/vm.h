@@ -14,5 +14,7 @@
 #define X64_PAGE_PRESENT  (1 << 0)
 #define X64_PAGE_WRITABLE (1 << 1)
 #define X64_PAGE_USER     (1 << 2)
+#define X64_PAGE_ACCESSED (1 << 5)
+#define X64_PAGE_LARGE    (1 << 7)
 
 #endif
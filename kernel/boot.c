@@ -141,7 +141,8 @@ __noreturn void kmain(struct bootinfo *bootinfo) {
     // Create the first userland task.
     struct task *task = task_lookup_unchecked(INIT_TASK);
     ASSERT(task);
-    error_t err = task_create(task, name, bootelf->entry, NULL, TASK_ALL_CAPS);
+    error_t err = task_create(task, name, bootelf->entry, 0, NULL,
+                              TASK_ALL_CAPS);
     ASSERT_OK(err);
     map_bootelf(bootinfo, bootelf, task);
 
@@ -153,7 +154,7 @@ __noreturn void mpmain(void) {
 
     // Initialize the idle task for this CPU.
     IDLE_TASK->tid = 0;
-    error_t err = task_create(IDLE_TASK, "(idle)", 0, NULL, 0);
+    error_t err = task_create(IDLE_TASK, "(idle)", 0, 0, NULL, 0);
     ASSERT_OK(err);
     CURRENT = IDLE_TASK;
 
@@ -7,47 +7,195 @@
 #include <types.h>
 
 /// Resumes a sender task for the `receiver` tasks and updates `receiver->src`
-/// properly.
-static void resume_sender(struct task *receiver, task_t src) {
-    LIST_FOR_EACH (sender, &receiver->senders, struct task, sender_next) {
-        if (src == IPC_ANY || src == sender->tid) {
-            DEBUG_ASSERT(sender->state == TASK_BLOCKED);
-            DEBUG_ASSERT(sender->src == IPC_DENY);
-            task_resume(sender);
-            list_remove(&sender->sender_next);
-
-            // If src == IPC_ANY, allow only `sender` to send a message. Let's
-            // consider the following situation to understand why:
-            //
-            //     [Sender A]              [Receiver C]              [Sender B]
-            //         .                        |                        |
-            // in C's sender queue              |                        |
-            //         .                        |                        |
-            //         .        Resume          |                        |
-            //         + <--------------------- |                        |
-            //         .                        .    Try sending (X)     |
-            //         .                        + <--------------------- |
-            //         .                        |                        |
-            //         V                        |                        |
-            //         |                        |                        |
-            //
-            // When (X) occurrs, the receiver should not accept the message
-            // from B since C has already resumed A as the next sender.
-            //
-            receiver->src = sender->tid;
-            return;
+/// properly. Returns true if it has resumed a sender task.
+///
+/// This is O(1) even if many senders are queued: in a closed receive, the
+/// sender is looked up by its task ID instead of walking the sender queue.
+static bool resume_sender(struct task *receiver, task_t src) {
+    struct task *sender;
+    if (src == IPC_ANY) {
+        sender = ipc_queue_pop(&receiver->senders);
+    } else {
+        sender = task_lookup_unchecked(src);
+        if (sender && sender->queued_on == receiver) {
+            ipc_queue_remove(sender);
+        } else {
+            sender = NULL;
         }
     }
 
+    if (sender) {
+        DEBUG_ASSERT(sender->state == TASK_BLOCKED);
+        DEBUG_ASSERT(sender->src == IPC_DENY);
+        task_resume(sender);
+
+        // If src == IPC_ANY, allow only `sender` to send a message. Let's
+        // consider the following situation to understand why:
+        //
+        //     [Sender A]              [Receiver C]              [Sender B]
+        //         .                        |                        |
+        // in C's sender queue              |                        |
+        //         .                        |                        |
+        //         .        Resume          |                        |
+        //         + <--------------------- |                        |
+        //         .                        .    Try sending (X)     |
+        //         .                        + <--------------------- |
+        //         .                        |                        |
+        //         V                        |                        |
+        //         |                        |                        |
+        //
+        // When (X) occurrs, the receiver should not accept the message
+        // from B since C has already resumed A as the next sender.
+        //
+        receiver->src = sender->tid;
+        return true;
+    }
+
     receiver->src = src;
+    return false;
+}
+
+/// Blocks the current task until a peer task resumes it. If `timeout` is not
+/// zero, the timer interrupt handler resumes the current task instead after
+/// `timeout` milliseconds and this function returns ERR_TIMEOUT.
+///
+/// Don't forget to update `CURRENT->src` and the sender queue before calling
+/// this!
+static error_t wait_for_peer(msec_t timeout) {
+    task_block(CURRENT);
+    if (timeout) {
+        CURRENT->ipc_timeout = timeout;
+        CURRENT->ipc_timed_out = false;
+        task_watch_timeout(CURRENT);
+    }
+
+    task_switch();
+
+    CURRENT->ipc_timeout = 0;
+    if (CURRENT->ipc_timed_out) {
+        CURRENT->ipc_timed_out = false;
+        return ERR_TIMEOUT;
+    }
+
+    return OK;
+}
+
+/// Sends a message to one of the tasks receiving from the endpoint `ep`. If no
+/// tasks are receiving, it blocks the current task until a receiver task takes
+/// the message. In IPC_CALL, `*receiver` is set to the task which should reply
+/// the message or NULL if the reply has already been stored in `CURRENT->m`.
+static error_t endpoint_send(struct task *ep, struct message *m,
+                             unsigned flags, msec_t timeout,
+                             struct task **receiver) {
+    *receiver = ipc_queue_pop(&ep->receivers);
+    if (*receiver) {
+        memcpy(&(*receiver)->m, m, sizeof((*receiver)->m));
+        task_resume(*receiver);
+        return OK;
+    }
+
+    if (flags & IPC_NOBLOCK) {
+        return ERR_WOULD_BLOCK;
+    }
+
+    // No receivers are ready. Leave the message in our buffer: the receiver
+    // task copies it from there. If we're going to receive the reply, the
+    // receiver leaves us blocked until it replies.
+    memcpy(&CURRENT->m, m, sizeof(CURRENT->m));
+    CURRENT->src = IPC_DENY;
+    CURRENT->endpoint_call = (flags & IPC_RECV) != 0;
+    ipc_queue_push(ep, &ep->senders, CURRENT);
+    error_t err = wait_for_peer(timeout);
+    CURRENT->endpoint_call = false;
+    if (err != OK) {
+        return err;
+    }
+
+    if (CURRENT->notifications & NOTIFY_ABORTED) {
+        // The endpoint has been destroyed.
+        CURRENT->notifications &= ~NOTIFY_ABORTED;
+        return ERR_ABORTED;
+    }
+
+    return OK;
+}
+
+/// Receives a message sent to the endpoint `ep`.
+static error_t endpoint_recv(struct task *ep, struct message *m,
+                             unsigned flags, msec_t timeout) {
+    struct task *sender = ipc_queue_pop(&ep->senders);
+    if (sender) {
+        // Take the message left in the sender's buffer.
+        memcpy(m, &sender->m, sizeof(*m));
+        if (sender->endpoint_call) {
+            // The sender waits for our reply: keep it blocked.
+            sender->src = CURRENT->tid;
+        } else {
+            task_resume(sender);
+        }
+
+        return OK;
+    }
+
+    if (flags & IPC_NOBLOCK) {
+        return ERR_WOULD_BLOCK;
+    }
+
+    // Wait for a sender. It copies the message into our buffer.
+    CURRENT->src = ep->tid;
+    ipc_queue_push(ep, &ep->receivers, CURRENT);
+    error_t err = wait_for_peer(timeout);
+    if (err != OK) {
+        return err;
+    }
+
+    if (CURRENT->notifications & NOTIFY_ABORTED) {
+        // The endpoint has been destroyed.
+        CURRENT->notifications &= ~NOTIFY_ABORTED;
+        return ERR_ABORTED;
+    }
+
+    memcpy(m, &CURRENT->m, sizeof(*m));
+    return OK;
 }
 
 /// Sends and receives a message. Note that `m` is a user pointer if
 /// IPC_KERNEL is not set!
 static error_t ipc_slowpath(struct task *dst, task_t src,
-                            __user struct message *m, unsigned flags) {
+                            __user struct message *m, unsigned flags,
+                            msec_t timeout) {
+    // Set to true if the reply has already been received while sending a
+    // message to an endpoint.
+    bool replied = false;
+
     // Send a message.
-    if (flags & IPC_SEND) {
+    if ((flags & IPC_SEND) && dst->state == TASK_ENDPOINT) {
+        struct message tmp_m;
+        if (flags & IPC_KERNEL) {
+            memcpy(&tmp_m, (const void *) m, sizeof(struct message));
+        } else {
+            memcpy_from_user(&tmp_m, m, sizeof(struct message));
+        }
+
+        tmp_m.src = (flags & IPC_KERNEL) ? KERNEL_TASK : CURRENT->tid;
+        struct task *receiver;
+        error_t err = endpoint_send(dst, &tmp_m, flags, timeout, &receiver);
+        if (err != OK) {
+            return err;
+        }
+
+        // The reply comes from the receiver task, not the endpoint.
+        if (receiver) {
+            src = receiver->tid;
+        } else {
+            replied = true;
+        }
+
+#ifdef CONFIG_TRACE_IPC
+        TRACE("IPC: %s: %s -> %s (endpoint)", msgtype2str(tmp_m.type),
+              CURRENT->name, dst->name);
+#endif
+    } else if (flags & IPC_SEND) {
         // Copy the message into the receiver's buffer in case the receiver is
         // the current's pager task and accessing `m` cause the page fault. If
         // it happens, it leads to a dead lock.
@@ -70,9 +218,12 @@ static error_t ipc_slowpath(struct task *dst, task_t src,
             // The receiver task is not ready. Sleep until it resumes the
             // current task.
             CURRENT->src = IPC_DENY;
-            task_block(CURRENT);
-            list_push_back(&dst->senders, &CURRENT->sender_next);
-            task_switch();
+            ipc_queue_push(dst, &dst->senders, CURRENT);
+            if (wait_for_peer(timeout) == ERR_TIMEOUT) {
+                // The receiver task didn't get ready in time. The timer
+                // handler has already removed us from its sender queue.
+                return ERR_TIMEOUT;
+            }
 
             if (CURRENT->notifications & NOTIFY_ABORTED) {
                 // The receiver task has exited. Abort the system call.
@@ -101,8 +252,24 @@ static error_t ipc_slowpath(struct task *dst, task_t src,
 
     // Receive a message.
     if (flags & IPC_RECV) {
+        struct task *src_task = task_lookup(src);
         struct message tmp_m;
-        if (src == IPC_ANY && CURRENT->notifications) {
+        if (replied) {
+            // The receiver task has already replied to the message we've sent
+            // to the endpoint.
+            memcpy(&tmp_m, &CURRENT->m, sizeof(struct message));
+        } else if (src_task && src_task->state == TASK_ENDPOINT) {
+            // Only the owner of the endpoint and its threads may take messages
+            // (and reply to callers) on it.
+            if (src_task->owner != CURRENT->owner) {
+                return ERR_NOT_PERMITTED;
+            }
+
+            error_t err = endpoint_recv(src_task, &tmp_m, flags, timeout);
+            if (err != OK) {
+                return err;
+            }
+        } else if (src == IPC_ANY && CURRENT->notifications) {
             // Receive pending notifications as a message.
             bzero(&tmp_m, sizeof(tmp_m));
             tmp_m.type = NOTIFICATIONS_MSG;
@@ -115,10 +282,12 @@ static error_t ipc_slowpath(struct task *dst, task_t src,
             }
 
             // Resume a sender task and sleep until a sender task resumes this
-            // task...
-            resume_sender(CURRENT, src);
-            task_block(CURRENT);
-            task_switch();
+            // task... Once we've resumed a sender, it will send a message to
+            // us for sure: don't let the timeout abort the receive.
+            bool resumed = resume_sender(CURRENT, src);
+            if (wait_for_peer(resumed ? 0 : timeout) == ERR_TIMEOUT) {
+                return ERR_TIMEOUT;
+            }
 
             // Copy into `tmp_m` since memcpy_to_user may cause a page fault and
             // CURRENT->m will be overwritten by page fault mesages.
@@ -140,7 +309,7 @@ static error_t ipc_slowpath(struct task *dst, task_t src,
 ///
 /// Note that `m` is a user pointer if IPC_KERNEL is not set!
 error_t ipc(struct task *dst, task_t src, __user struct message *m,
-            unsigned flags) {
+            unsigned flags, msec_t timeout) {
     if (dst == CURRENT) {
         WARN_DBG("%s: tried to send a message to myself", CURRENT->name);
         return ERR_INVALID_ARG;
@@ -156,10 +325,14 @@ error_t ipc(struct task *dst, task_t src, __user struct message *m,
         && dst->state == TASK_BLOCKED
         && (dst->src == IPC_ANY || dst->src == CURRENT->tid)
         // The fastpath doesn't receive pending notifications.
-        && CURRENT->notifications == 0;
+        && CURRENT->notifications == 0
+        // The fastpath doesn't receive from an endpoint.
+        && (src == IPC_ANY || src == dst->tid)
+        // The fastpath doesn't support timeouts.
+        && !timeout;
 
     if (!fastpath) {
-        return ipc_slowpath(dst, src, m, flags);
+        return ipc_slowpath(dst, src, m, flags, timeout);
     }
 
     // THe send phase: copy the message and resume the receiver task. Note
@@ -184,7 +357,7 @@ error_t ipc(struct task *dst, task_t src, __user struct message *m,
     memcpy_to_user(m, &CURRENT->m, sizeof(struct message));
     return OK;
 #else
-    return ipc_slowpath(dst, src, m, flags);
+    return ipc_slowpath(dst, src, m, flags, timeout);
 #endif  // CONFIG_IPC_FASTPATH
 }
 
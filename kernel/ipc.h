@@ -7,7 +7,7 @@
 struct task;
 struct message;
 __mustuse error_t ipc(struct task *dst, task_t src, __user struct message *m,
-                      unsigned flags);
+                      unsigned flags, msec_t timeout);
 void notify(struct task *dst, notifications_t notifications);
 
 #endif
@@ -18,6 +18,7 @@ error_t kdebug_run(const char *cmdline, char *buf, size_t len) {
         task_dump();
     } else if (strcmp(cmdline, "q") == 0) {
 #ifdef CONFIG_SEMIHOSTING
+        klog_flush();
         arch_semihosting_halt();
 #endif
         PANIC("halted by the kdebug");
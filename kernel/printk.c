@@ -1,44 +1,130 @@
 #include "printk.h"
 #include "ipc.h"
+#include "task.h"
 #include <string.h>
 #include <vprintf.h>
 
-static struct klog klog;
+#define KLOG (&get_cpuvar()->klog)
 
-/// Reads the kernel log buffer.
+/// Moves `*tail` forward to the oldest character still in the buffer. Returns
+/// the number of characters overwritten by the writer.
+static size_t skip_overwritten(struct klog *klog, size_t *tail) {
+    if (klog->head - *tail <= CONFIG_KLOG_BUF_SIZE) {
+        return 0;
+    }
+
+    size_t lost = klog->head - CONFIG_KLOG_BUF_SIZE - *tail;
+    *tail += lost;
+    return lost;
+}
+
+/// Reads the kernel log buffers of all CPUs (one after another).
 size_t klog_read(char *buf, size_t buf_len) {
-    size_t remaining = buf_len;
-    if (klog.tail > klog.head) {
-        int copy_len = MIN(remaining, CONFIG_KLOG_BUF_SIZE - klog.tail);
-        memcpy(buf, &klog.buf[klog.tail], copy_len);
-        buf += copy_len;
-        remaining -= copy_len;
-        klog.tail = 0;
+    size_t read_len = 0;
+    struct cpuvar *cpuvar;
+    for (int cpu = 0; (cpuvar = mp_cpuvar_of(cpu)) != NULL; cpu++) {
+        struct klog *klog = &cpuvar->klog;
+        skip_overwritten(klog, &klog->read_tail);
+        while (read_len < buf_len && klog->read_tail != klog->head) {
+            size_t off = klog->read_tail % CONFIG_KLOG_BUF_SIZE;
+            size_t copy_len = MIN(buf_len - read_len,
+                                  MIN(klog->head - klog->read_tail,
+                                      CONFIG_KLOG_BUF_SIZE - off));
+            memcpy(&buf[read_len], &klog->buf[off], copy_len);
+            read_len += copy_len;
+            klog->read_tail += copy_len;
+        }
     }
 
-    int copy_len = MIN(remaining, klog.head - klog.tail);
-    memcpy(buf, &klog.buf[klog.tail], copy_len);
-    remaining -= copy_len;
-    klog.tail = (klog.tail + copy_len) % CONFIG_KLOG_BUF_SIZE;
-    return buf_len - remaining;
+    return read_len;
 }
 
-/// Writes a character into the kernel log buffer.
+/// Writes a character into the kernel log buffer. If the buffer is full, it
+/// overwrites the oldest character: it never waits for the console.
 void klog_write(char ch) {
-    klog.buf[klog.head] = ch;
-    klog.head = (klog.head + 1) % CONFIG_KLOG_BUF_SIZE;
-    if (klog.head == klog.tail) {
-        // The buffer is full. Discard a character by moving the tail.
-        klog.tail = (klog.tail + 1) % CONFIG_KLOG_BUF_SIZE;
+    struct klog *klog = KLOG;
+    klog->buf[klog->head % CONFIG_KLOG_BUF_SIZE] = ch;
+    klog->head++;
+}
+
+/// Writes a string into the kernel log buffer. Like `klog_write()`, it never
+/// waits for the console: characters not yet written into the console are
+/// overwritten (and counted as dropped) if the buffer is full.
+void klog_write_str(const char *s, size_t len) {
+    struct klog *klog = KLOG;
+    if (len > CONFIG_KLOG_BUF_SIZE) {
+        // Only the last CONFIG_KLOG_BUF_SIZE characters survive.
+        klog->head += len - CONFIG_KLOG_BUF_SIZE;
+        s += len - CONFIG_KLOG_BUF_SIZE;
+        len = CONFIG_KLOG_BUF_SIZE;
+    }
+
+    while (len > 0) {
+        size_t off = klog->head % CONFIG_KLOG_BUF_SIZE;
+        size_t copy_len = MIN(len, CONFIG_KLOG_BUF_SIZE - off);
+        memcpy(&klog->buf[off], s, copy_len);
+        klog->head += copy_len;
+        s += copy_len;
+        len -= copy_len;
+    }
+}
+
+static size_t drain(struct klog *klog, size_t max_len) {
+    size_t lost = skip_overwritten(klog, &klog->console_tail);
+    if (lost > 0) {
+        klog->dropped += lost;
+        char msg[64];
+        snprintf(msg, sizeof(msg), "\n[klog] dropped %d characters\n",
+                 (int) lost);
+        for (char *p = msg; *p; p++) {
+            arch_printchar(*p);
+        }
+    }
+
+    size_t written = 0;
+    while (written < max_len && klog->console_tail != klog->head) {
+        arch_printchar(klog->buf[klog->console_tail % CONFIG_KLOG_BUF_SIZE]);
+        klog->console_tail++;
+        written++;
+    }
+
+    return written;
+}
+
+/// Writes at most `max_len` buffered characters into the arch's console
+/// (typically a serial port). Returns the number of characters written.
+size_t klog_drain(size_t max_len) {
+    return drain(KLOG, max_len);
+}
+
+/// Writes at most `max_len` buffered characters into the console if more than
+/// `KLOG_DRAIN_THRESHOLD` characters are waiting for it. Called from the timer
+/// interrupt handler since a busy CPU may not reach the idle loop soon.
+void klog_drain_if_filled(size_t max_len) {
+    struct klog *klog = KLOG;
+    size_t pending = klog->head - klog->console_tail;
+    if (pending > KLOG_DRAIN_THRESHOLD) {
+        drain(klog, MIN(max_len, pending - KLOG_DRAIN_THRESHOLD / 2));
+    }
+}
+
+/// Writes all buffered characters of all CPUs into the console. Used when we
+/// can't wait for the idle loop (e.g. the kernel is going to halt).
+void klog_flush(void) {
+    struct cpuvar *cpuvar;
+    for (int cpu = 0; (cpuvar = mp_cpuvar_of(cpu)) != NULL; cpu++) {
+        while (drain(&cpuvar->klog, KLOG_DRAIN_LEN) > 0) {
+        }
     }
 }
 
 static void printchar(__unused struct vprintf_context *ctx, char ch) {
-    arch_printchar(ch);
     klog_write(ch);
 }
 
-/// Prints a message. See vprintf() for detailed formatting specifications.
+/// Prints a message into the kernel log buffer. It's written into the console
+/// later in the idle loop (or in the timer interrupt handler if the buffer is
+/// getting full). See vprintf() for detailed formatting specifications.
 void printk(const char *fmt, ...) {
     struct vprintf_context ctx = {.printchar = printchar};
     va_list vargs;
@@ -5,15 +5,34 @@
 #include <print_macros.h>
 #include <types.h>
 
-/// The kernel log (ring) buffer.
+/// The maximum number of characters written into the console at once by
+/// `klog_drain()`.
+#define KLOG_DRAIN_LEN 128
+/// The number of buffered characters above which they're written into the
+/// console without waiting for the idle loop (see `klog_drain_if_filled()`).
+#define KLOG_DRAIN_THRESHOLD (CONFIG_KLOG_BUF_SIZE / 2)
+
+/// The kernel log (ring) buffer. Each CPU has its own buffer: it's written and
+/// drained only by the CPU so we don't need any locks.
 struct klog {
     char buf[CONFIG_KLOG_BUF_SIZE];
+    /// The number of characters written into the buffer.
     size_t head;
-    size_t tail;
+    /// The number of characters consumed by `klog_drain()` (the console).
+    size_t console_tail;
+    /// The number of characters consumed by `klog_read()`.
+    size_t read_tail;
+    /// The number of characters overwritten before being written into the
+    /// console.
+    size_t dropped;
 };
 
 void klog_write(char ch);
+void klog_write_str(const char *s, size_t len);
 size_t klog_read(char *buf, size_t buf_len);
+size_t klog_drain(size_t max_len);
+void klog_drain_if_filled(size_t max_len);
+void klog_flush(void);
 void printk(const char *fmt, ...);
 
 // Implemented in arch.
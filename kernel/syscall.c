@@ -37,9 +37,13 @@ static void strncpy_from_user(char *dst, __user const char *src, size_t len) {
     dst[len] = '\0';
 }
 
-/// Creates a task.
+/// Creates a task. If `TASK_THREAD` is set in `flags`, it creates a thread
+/// which shares the address space and the pager with the current task. In
+/// that case, `pager_or_sp` is the initial stack pointer of the thread. If
+/// `TASK_AS_ENDPOINT` is set, `pager_or_sp` is the task which owns (receives
+/// messages from) the endpoint.
 static error_t sys_task_create(task_t tid, __user const char *name, vaddr_t ip,
-                               task_t pager, unsigned flags) {
+                               vaddr_t pager_or_sp, unsigned flags) {
     if (!CAPABLE(CURRENT, CAP_TASK)) {
         return ERR_NOT_PERMITTED;
     }
@@ -49,15 +53,27 @@ static error_t sys_task_create(task_t tid, __user const char *name, vaddr_t ip,
         return ERR_INVALID_TASK;
     }
 
+    char namebuf[CONFIG_TASK_NAME_LEN];
+    strncpy_from_user(namebuf, name, sizeof(namebuf) - 1);
+
+    if (flags & TASK_THREAD) {
+        // The init task does not have a pager: it can't handle page faults in
+        // its threads.
+        if (!CURRENT->pager) {
+            return ERR_NOT_PERMITTED;
+        }
+
+        return task_create(task, namebuf, ip, pager_or_sp, CURRENT->pager,
+                           flags);
+    }
+
     // Create a task. We handle pager == 0 as an error here.
-    struct task *pager_task = task_lookup(pager);
+    struct task *pager_task = task_lookup((task_t) pager_or_sp);
     if (!pager_task) {
         return ERR_INVALID_ARG;
     }
 
-    char namebuf[CONFIG_TASK_NAME_LEN];
-    strncpy_from_user(namebuf, name, sizeof(namebuf) - 1);
-    return task_create(task, namebuf, ip, pager_task, flags);
+    return task_create(task, namebuf, ip, 0, pager_task, flags);
 }
 
 /// Destroys a task.
@@ -99,13 +115,18 @@ static error_t sys_task_schedule(task_t tid, int priority) {
     return task_schedule(task, priority);
 }
 
-/// Send/receive IPC messages.
+/// Send/receive IPC messages. If `timeout` is not zero, the kernel gives up
+/// waiting for the peer task after `timeout` milliseconds.
 static error_t sys_ipc(task_t dst, task_t src, __user struct message *m,
-                       unsigned flags) {
+                       unsigned flags, msec_t timeout) {
     if (flags & IPC_KERNEL) {
         return ERR_INVALID_ARG;
     }
 
+    if (timeout < 0) {
+        return ERR_INVALID_ARG;
+    }
+
     if (src < 0 || src > CONFIG_NUM_TASKS) {
         return ERR_INVALID_ARG;
     }
@@ -118,7 +139,7 @@ static error_t sys_ipc(task_t dst, task_t src, __user struct message *m,
         }
     }
 
-    return ipc(dst_task, src, m, flags);
+    return ipc(dst_task, src, m, flags, timeout);
 }
 
 /// Sends notifications.
@@ -135,6 +156,10 @@ static error_t sys_notify(task_t dst, notifications_t notifications) {
 /// Sets task's timer.
 static error_t sys_timer_set(msec_t timeout) {
     CURRENT->timeout = timeout;
+    if (timeout) {
+        task_watch_timeout(CURRENT);
+    }
+
     return OK;
 }
 
@@ -165,8 +190,38 @@ static paddr_t resolve_paddr(vaddr_t vaddr) {
     }
 }
 
+/// The number of source addresses copied from the user at once in vm_map.
+#define VM_MAP_CHUNK_LEN 16
+
+/// Maps a page at `src` (a physical address if the caller is the init task)
+/// at `vaddr` in the task.
+static error_t map_src_page(struct task *task, vaddr_t vaddr, vaddr_t src,
+                            paddr_t kpage, unsigned flags) {
+    if (!IS_ALIGNED(src, PAGE_SIZE)) {
+        return ERR_INVALID_ARG;
+    }
+
+    paddr_t paddr = resolve_paddr(src);
+    if (!paddr) {
+        return ERR_NOT_FOUND;
+    }
+
+    // Please note that these paddr checks are added for debugging purpose, not
+    // security: the user is able to access the kernel memory space by modifying
+    // the page table directly.
+    size_t len = (flags & MAP_LARGE) ? LARGE_PAGE_SIZE : PAGE_SIZE;
+    if (is_kernel_paddr(paddr) || is_kernel_paddr(paddr + len - 1)) {
+        WARN_DBG("paddr %p points to a kernel memory area", paddr);
+        return ERR_NOT_ACCEPTABLE;
+    }
+
+    return vm_map(task, vaddr, paddr, kpage, flags);
+}
+
 /// Maps a memory page in the task's virtual memory space. `kpage` is a memory
 /// page which provides a memory page for arch-specific page table structures.
+/// With `MAP_PAGES(n)`, `src` points to an array of the source addresses of
+/// `n` pages from `vaddr` instead.
 ///
 /// Please note that this is the most DANGEROUS operation in system calls. A
 /// user task can map the whole physical memory space including the kernel data
@@ -177,14 +232,26 @@ static error_t sys_vm_map(task_t tid, vaddr_t vaddr, vaddr_t src, vaddr_t kpage,
         return ERR_NOT_PERMITTED;
     }
 
-    if (!IS_ALIGNED(vaddr, PAGE_SIZE) || !IS_ALIGNED(src, PAGE_SIZE)
-        || !IS_ALIGNED(kpage, PAGE_SIZE)) {
+    if (!IS_ALIGNED(vaddr, PAGE_SIZE) || !IS_ALIGNED(kpage, PAGE_SIZE)) {
         return ERR_INVALID_ARG;
     }
 
-    paddr_t paddr = resolve_paddr(src);
-    if (!paddr) {
-        return ERR_NOT_FOUND;
+    size_t num_pages = MAP_NUM_PAGES(flags);
+    if (num_pages > MAP_MAX_PAGES || (num_pages && (flags & MAP_LARGE))) {
+        return ERR_INVALID_ARG;
+    }
+
+    if (flags & MAP_LARGE) {
+        if (!IS_ALIGNED(vaddr, LARGE_PAGE_SIZE)
+            || !IS_ALIGNED(src, LARGE_PAGE_SIZE)) {
+            return ERR_INVALID_ARG;
+        }
+
+        // Only the init task (vm) knows that the physical pages are
+        // continuous: `src` of other tasks is resolved page by page.
+        if (CURRENT->tid != INIT_TASK) {
+            return ERR_NOT_PERMITTED;
+        }
     }
 
     paddr_t kpage_paddr = resolve_paddr(kpage);
@@ -192,25 +259,42 @@ static error_t sys_vm_map(task_t tid, vaddr_t vaddr, vaddr_t src, vaddr_t kpage,
         return ERR_NOT_FOUND;
     }
 
-    // Please note that these paddr checks are added for debugging purpose, not
-    // security: the user is able to access the kernel memory space by modifying
-    // the page table directly.
-    if (is_kernel_paddr(paddr)) {
-        WARN_DBG("paddr %p points to a kernel memory area", paddr);
-        return ERR_NOT_ACCEPTABLE;
-    }
-
     if (is_kernel_paddr(kpage_paddr)) {
         WARN_DBG("kpage %p points to a kernel memory area", kpage);
         return ERR_NOT_ACCEPTABLE;
     }
 
     struct task *task = task_lookup(tid);
-    if (!task) {
+    if (!task || task->state == TASK_ENDPOINT) {
         return ERR_INVALID_TASK;
     }
 
-    return vm_map(task, vaddr, paddr, kpage_paddr, flags);
+    if (!num_pages) {
+        return map_src_page(task, vaddr, src, kpage_paddr, flags);
+    }
+
+    // Copy the array in small chunks: the kernel stack is small.
+    vaddr_t srcs[VM_MAP_CHUNK_LEN];
+    for (size_t i = 0; i < num_pages; i += VM_MAP_CHUNK_LEN) {
+        size_t n = MIN(num_pages - i, VM_MAP_CHUNK_LEN);
+        memcpy_from_user(srcs, (__user const vaddr_t *) src + i,
+                         n * sizeof(vaddr_t));
+        for (size_t j = 0; j < n; j++) {
+            if (!srcs[j]) {
+                continue;
+            }
+
+            // If the kpage has been used up (ERR_TRY_AGAIN), the caller
+            // retries the whole array with a new one.
+            error_t err = map_src_page(task, vaddr + (i + j) * PAGE_SIZE,
+                                       srcs[j], kpage_paddr, flags);
+            if (err != OK) {
+                return err;
+            }
+        }
+    }
+
+    return OK;
 }
 
 /// Unmaps a memory page from the task's virtual memory space.
@@ -224,15 +308,37 @@ static error_t sys_vm_unmap(task_t tid, vaddr_t vaddr) {
     }
 
     struct task *task = task_lookup(tid);
-    if (!task) {
+    if (!task || task->state == TASK_ENDPOINT) {
         return ERR_INVALID_TASK;
     }
 
     return vm_unmap(task, vaddr);
 }
 
-/// Writes log messages into the arch's console (typically a serial port) and
-/// the kernel log buffer.
+/// Returns 1 if the page at `vaddr` in the task has been accessed since the
+/// last call, or 0 if not. The page's accessed bit is cleared. The pager uses
+/// this to find pages not used recently.
+static int sys_vm_accessed(task_t tid, vaddr_t vaddr) {
+    if (!CAPABLE(CURRENT, CAP_MAP)) {
+        return ERR_NOT_PERMITTED;
+    }
+
+    if (!IS_ALIGNED(vaddr, PAGE_SIZE)
+        || is_kernel_addr_range(vaddr, PAGE_SIZE)) {
+        return ERR_INVALID_ARG;
+    }
+
+    struct task *task = task_lookup(tid);
+    if (!task || task->state == TASK_ENDPOINT) {
+        return ERR_INVALID_TASK;
+    }
+
+    return arch_vm_accessed(task, vaddr);
+}
+
+/// Writes log messages into the kernel log buffer. They are written into the
+/// arch's console (typically a serial port) later in the idle loop or on timer
+/// ticks: it never waits for the console.
 static error_t sys_console_write(__user const char *buf, size_t buf_len) {
     if (buf_len > 1024) {
         WARN_DBG("console_write: too long buffer length");
@@ -244,9 +350,8 @@ static error_t sys_console_write(__user const char *buf, size_t buf_len) {
     while (remaining > 0) {
         int copy_len = MIN(remaining, (int) sizeof(kbuf));
         memcpy_from_user(kbuf, buf, copy_len);
-        for (int i = 0; i < copy_len; i++) {
-            printk("%c", kbuf[i]);
-        }
+        klog_write_str(kbuf, copy_len);
+        buf += copy_len;
         remaining -= copy_len;
     }
 
@@ -309,7 +414,7 @@ long handle_syscall(int n, long a1, long a2, long a3, long a4, long a5) {
     long ret;
     switch (n) {
         case SYS_IPC:
-            ret = sys_ipc(a1, a2, (__user struct message *) a3, a4);
+            ret = sys_ipc(a1, a2, (__user struct message *) a3, a4, a5);
             break;
         case SYS_NOTIFY:
             ret = sys_notify(a1, a2);
@@ -344,6 +449,9 @@ long handle_syscall(int n, long a1, long a2, long a3, long a4, long a5) {
         case SYS_VM_UNMAP:
             ret = sys_vm_unmap(a1, a2);
             break;
+        case SYS_VM_ACCESSED:
+            ret = sys_vm_accessed(a1, a2);
+            break;
         case SYS_IRQ_ACQUIRE:
             ret = sys_irq_acquire(a1);
             break;
@@ -375,7 +483,7 @@ void abi_emu_hook(trap_frame_t *frame, enum abi_hook_type type) {
     memcpy(&m.abi_hook.frame, frame, sizeof(m.abi_hook.frame));
 
     error_t err = ipc(CURRENT->pager, CURRENT->pager->tid,
-                      (__user struct message *) &m, IPC_CALL | IPC_KERNEL);
+                      (__user struct message *) &m, IPC_CALL | IPC_KERNEL, 0);
     if (IS_ERROR(err)) {
         WARN_DBG("%s: aborted kernel ipc", CURRENT->name);
         task_exit(EXP_ABORTED_KERNEL_IPC);
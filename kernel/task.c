@@ -16,6 +16,9 @@ static struct task tasks[CONFIG_NUM_TASKS];
 static list_t runqueues[TASK_PRIORITY_MAX];
 /// IRQ owners.
 static struct task *irq_owners[IRQ_MAX];
+/// Tasks with a running timer (`timeout` or `ipc_timeout`). The timer
+/// interrupt handler visits only tasks in this queue.
+static list_t timer_queue;
 
 static void enqueue_task(struct task *task) {
     list_push_back(&runqueues[task->priority], &task->runqueue_next);
@@ -42,14 +45,17 @@ struct task *task_lookup(task_t tid) {
     return task;
 }
 
-/// Initializes a task and enqueue it into the run-queue.
+/// Initializes a task and enqueue it into the run-queue. If `TASK_THREAD` is
+/// set in `flags`, the new task shares the address space with the current
+/// task and starts with the stack pointer `sp`.
 error_t task_create(struct task *task, const char *name, vaddr_t ip,
-                    struct task *pager, unsigned flags) {
+                    vaddr_t sp, struct task *pager, unsigned flags) {
     if (task->state != TASK_UNUSED) {
         return ERR_ALREADY_EXISTS;
     }
 
-    unsigned allowed_flags = TASK_ALL_CAPS | TASK_ABI_EMU | TASK_HV;
+    unsigned allowed_flags = TASK_ALL_CAPS | TASK_ABI_EMU | TASK_HV
+                             | TASK_THREAD | TASK_AS_ENDPOINT;
     if ((flags & ~allowed_flags) != 0) {
         WARN_DBG("unknown task flags (%x)", flags);
         return ERR_INVALID_ARG;
@@ -76,36 +82,83 @@ error_t task_create(struct task *task, const char *name, vaddr_t ip,
     }
 #endif
 
-    // Do arch-specific initialization.
-    error_t err;
-    if ((err = arch_task_create(task, ip)) != OK) {
-        return err;
+    if ((flags & TASK_THREAD) != 0
+        && (flags & (TASK_ABI_EMU | TASK_HV | TASK_ALL_CAPS)) != 0) {
+        WARN_DBG("TASK_THREAD can't be used with TASK_ABI_EMU, TASK_HV, or "
+                 "TASK_ALL_CAPS");
+        return ERR_INVALID_ARG;
+    }
+
+    bool is_endpoint = (flags & TASK_AS_ENDPOINT) != 0;
+    if (is_endpoint && flags != TASK_AS_ENDPOINT) {
+        WARN_DBG("TASK_AS_ENDPOINT can't be used with other flags");
+        return ERR_INVALID_ARG;
+    }
+
+    // A thread shares the address space owned by the creator task. Threads
+    // created by a thread belong to the same owner. An endpoint is owned by
+    // the task given as `pager`: only the owner and its threads are allowed
+    // to receive from it.
+    if (is_endpoint) {
+        task->owner = pager->owner;
+    } else {
+        task->owner = (flags & TASK_THREAD) ? CURRENT->owner : task;
+    }
+
+    // Do arch-specific initialization. An endpoint is never executed.
+    if (!is_endpoint) {
+        error_t err;
+        if ((err = arch_task_create(task, ip, sp)) != OK) {
+            return err;
+        }
+    } else {
+        pager = NULL;
     }
 
     // Initialize fields.
-    TRACE("new task #%d: %s (pager=%s)", task->tid, name,
-          pager ? pager->name : NULL);
-    task->state = TASK_BLOCKED;
+    TRACE("new %s #%d: %s (pager=%s)", is_endpoint ? "endpoint" : "task",
+          task->tid, name, pager ? pager->name : NULL);
+    task->state = is_endpoint ? TASK_ENDPOINT : TASK_BLOCKED;
     task->flags = flags;
     task->notifications = 0;
     task->pager = pager;
+    task->kpage = 0;
     task->src = IPC_DENY;
     task->timeout = 0;
+    task->ipc_timeout = 0;
+    task->ipc_timed_out = false;
     task->quantum = 0;
     task->priority = TASK_PRIORITY_MAX - 1;
     task->ref_count = 0;
-    bitmap_fill(task->caps, sizeof(task->caps), (flags & TASK_ALL_CAPS) != 0);
+    if (flags & TASK_THREAD) {
+        // A thread has the same capabilities as the owner (e.g. a driver's
+        // worker thread needs CAP_IO to access its device).
+        memcpy(task->caps, task->owner->caps, sizeof(task->caps));
+    } else {
+        bitmap_fill(task->caps, sizeof(task->caps),
+                    (flags & TASK_ALL_CAPS) != 0);
+    }
     strncpy2(task->name, name, sizeof(task->name));
+    task->endpoint_call = false;
     list_init(&task->senders);
+    list_init(&task->receivers);
     list_nullify(&task->runqueue_next);
     list_nullify(&task->sender_next);
+    list_nullify(&task->timer_next);
+    task->queued_on = NULL;
 
     if (pager) {
         pager->ref_count++;
     }
 
+    // The owner must not be destroyed until all of its threads (and endpoints)
+    // are destroyed.
+    if (task->owner != task) {
+        task->owner->ref_count++;
+    }
+
     // Append the newly created task into the runqueue.
-    if (task != IDLE_TASK && ((flags & TASK_SCHED) == 0)) {
+    if (task != IDLE_TASK && !is_endpoint && ((flags & TASK_SCHED) == 0)) {
         task_resume(task);
     }
 
@@ -133,19 +186,31 @@ error_t task_destroy(struct task *task) {
     }
 
     TRACE("destroying %s...", task->name);
+    bool is_endpoint = task->state == TASK_ENDPOINT;
     list_remove(&task->runqueue_next);
-    list_remove(&task->sender_next);
-    arch_task_destroy(task);
+    ipc_queue_remove(task);
+    list_remove(&task->timer_next);
+    if (!is_endpoint) {
+        arch_task_destroy(task);
+    }
+
     task->state = TASK_UNUSED;
 
     if (task->pager) {
         task->pager->ref_count--;
     }
 
-    // Abort sender IPC operations.
-    LIST_FOR_EACH (sender, &task->senders, struct task, sender_next) {
-        notify(sender, NOTIFY_ABORTED);
-        list_remove(&sender->sender_next);
+    if (task->owner != task) {
+        task->owner->ref_count--;
+    }
+
+    // Abort sender IPC operations and receive operations from the endpoint:
+    // wake them up to return ERR_ABORTED. Each waiter is popped in O(1).
+    struct task *waiter;
+    while ((waiter = ipc_queue_pop(&task->senders)) != NULL
+           || (waiter = ipc_queue_pop(&task->receivers)) != NULL) {
+        notify(waiter, NOTIFY_ABORTED);
+        task_resume(waiter);
     }
 
     // Release IRQ ownership.
@@ -173,7 +238,7 @@ __noreturn void task_exit(enum exception_type exp) {
     m.exception.task = CURRENT->tid;
     m.exception.exception = exp;
     error_t err = ipc(CURRENT->pager, 0, (__user struct message *) &m,
-                      IPC_SEND | IPC_KERNEL);
+                      IPC_SEND | IPC_KERNEL, 0);
     OOPS_OK(err);
 
     // Wait until the pager task destroys this task...
@@ -252,6 +317,15 @@ void task_switch(void) {
     stack_check();
 }
 
+/// Enqueues the task into the timer queue if it's not yet in the queue. Call
+/// this function after setting `task->timeout` or `task->ipc_timeout`.
+void task_watch_timeout(struct task *task) {
+    // `timer_next` is nullified when the task is removed from the queue.
+    if (list_is_null(&task->timer_next)) {
+        list_push_back(&timer_queue, &task->timer_next);
+    }
+}
+
 /// Starts receiving notifications by IRQs.
 error_t task_listen_irq(struct task *task, unsigned irq) {
     if (irq >= IRQ_MAX) {
@@ -291,7 +365,8 @@ __mustuse error_t vm_map(struct task *task, vaddr_t vaddr, paddr_t paddr,
     // Prevent corrupting kernel memory. Note that the user is still able to
     // bypass this check to access the kernel memory by mapping the page table
     // structures.
-    if (is_kernel_addr_range(vaddr, PAGE_SIZE)) {
+    size_t len = (flags & MAP_LARGE) ? LARGE_PAGE_SIZE : PAGE_SIZE;
+    if (is_kernel_addr_range(vaddr, len)) {
         WARN_DBG("vaddr %p points to a kernel memory area", vaddr);
         return ERR_NOT_ACCEPTABLE;
     }
@@ -318,20 +393,40 @@ void handle_timer_irq(void) {
     bool resumed_by_timeout = false;
     if (mp_is_bsp()) {
         // Handle task timeouts.
-        for (int i = 0; i < CONFIG_NUM_TASKS; i++) {
-            struct task *task = &tasks[i];
-            if (task->state == TASK_UNUSED || !task->timeout) {
-                continue;
+        LIST_FOR_EACH (task, &timer_queue, struct task, timer_next) {
+            if (task->timeout) {
+                task->timeout--;
+                if (!task->timeout) {
+                    notify(task, NOTIFY_TIMER);
+                    resumed_by_timeout = true;
+                }
+            }
+
+            // The IPC timeout elapses only while the task is blocked in the
+            // IPC operation.
+            if (task->ipc_timeout && task->state == TASK_BLOCKED) {
+                task->ipc_timeout--;
+                if (!task->ipc_timeout) {
+                    // Give up waiting for the peer task: remove the task from
+                    // the sender queue (if it's in one) and resume it. ipc()
+                    // returns ERR_TIMEOUT.
+                    ipc_queue_remove(task);
+                    task->ipc_timed_out = true;
+                    task_resume(task);
+                    resumed_by_timeout = true;
+                }
             }
 
-            task->timeout--;
-            if (!task->timeout) {
-                notify(task, NOTIFY_TIMER);
-                resumed_by_timeout = true;
+            if (!task->timeout && !task->ipc_timeout) {
+                list_remove(&task->timer_next);
             }
         }
     }
 
+    // The CPU may be too busy to reach the idle loop: write kernel logs into
+    // the console before they're overwritten.
+    klog_drain_if_filled(KLOG_DRAIN_LEN);
+
     // Switch task if the current task has spend its time slice.
     DEBUG_ASSERT(CURRENT == IDLE_TASK || CURRENT->quantum >= 0);
     CURRENT->quantum--;
@@ -351,23 +446,96 @@ void handle_irq(unsigned irq) {
     }
 }
 
+/// Maps the pages described in the pager's reply to a page fault. It gives up
+/// mapping the rest of pages if a new page table is needed but no kpage is
+/// left: the task faults on them again.
+static error_t map_pages_from_pager(struct task *task, struct task *pager,
+                                    struct message *m) {
+    vaddr_t vaddr = m->page_fault_reply.vaddr;
+    vaddr_t src = m->page_fault_reply.paddr;
+    size_t num_pages = m->page_fault_reply.num_pages;
+    if (!num_pages) {
+        // The pager has mapped pages by itself.
+        return OK;
+    }
+
+    if (!CAPABLE(pager, CAP_MAP) || num_pages > PAGER_MAP_MAX_PAGES
+        || !IS_ALIGNED(vaddr, PAGE_SIZE) || !IS_ALIGNED(src, PAGE_SIZE)) {
+        return ERR_INVALID_ARG;
+    }
+
+    for (size_t i = 0; i < num_pages; i++) {
+        // Same as vm_map system call: `src` is a physical address only if the
+        // pager is the init task.
+        vaddr_t page_src = src + i * PAGE_SIZE;
+        paddr_t paddr = (pager->tid == INIT_TASK) ? page_src
+                                                  : vm_resolve(pager, page_src);
+        if (!paddr || is_kernel_paddr(paddr)) {
+            return ERR_NOT_ACCEPTABLE;
+        }
+
+        while (true) {
+            // The run is mapped page by page: ignore MAP_LARGE.
+            error_t err = vm_map(task, vaddr + i * PAGE_SIZE, paddr,
+                                 task->kpage,
+                                 MAP_TYPE(m->page_fault_reply.attrs));
+            if (err == OK) {
+                break;
+            }
+
+            if (err == ERR_TRY_AGAIN) {
+                // The kpage is now used for a page table. Retry without it:
+                // it succeeds if no other page table is missing.
+                task->kpage = 0;
+                continue;
+            }
+
+            // ERR_EMPTY: another page table is missing but we have no kpage.
+            // Stop here: the task faults again and the pager gives a new one.
+            return (err == ERR_EMPTY) ? OK : err;
+        }
+    }
+
+    return OK;
+}
+
 /// The page fault handler. It calls a pager to ask to update the page table.
 void handle_page_fault(vaddr_t addr, vaddr_t ip, unsigned fault) {
     if (CURRENT->pager == NULL) {
         PANIC("page fault in the init task: addr=%p, ip=%p", addr, ip);
     }
 
+    // Threads share the page table (and the kpage) with the owner.
+    struct task *owner = CURRENT->owner;
+    struct task *pager = CURRENT->pager;
     struct message m;
     m.type = PAGE_FAULT_MSG;
     m.page_fault.task = CURRENT->tid;
     m.page_fault.vaddr = addr;
     m.page_fault.ip = ip;
     m.page_fault.fault = fault;
-    error_t err = ipc(CURRENT->pager, CURRENT->pager->tid,
-                      (__user struct message *) &m, IPC_CALL | IPC_KERNEL);
+    m.page_fault.need_kpage = owner->kpage == 0;
+    error_t err = ipc(pager, pager->tid, (__user struct message *) &m,
+                      IPC_CALL | IPC_KERNEL, 0);
     if (err != OK || m.type != PAGE_FAULT_REPLY_MSG) {
         task_exit(EXP_INVALID_MSG_FROM_PAGER);
     }
+
+    paddr_t kpage = m.page_fault_reply.kpage;
+    if (kpage && !owner->kpage) {
+        if (!IS_ALIGNED(kpage, PAGE_SIZE) || is_kernel_paddr(kpage)
+            || pager->tid != INIT_TASK) {
+            task_exit(EXP_INVALID_MSG_FROM_PAGER);
+        }
+
+        owner->kpage = kpage;
+    }
+
+    if (map_pages_from_pager(owner, pager, &m) != OK) {
+        WARN_DBG("%s: invalid mapping in the page fault reply from %s",
+                 CURRENT->name, pager->name);
+        task_exit(EXP_INVALID_MSG_FROM_PAGER);
+    }
 }
 
 /// Prints the task states. Used for debugging.
@@ -376,6 +544,7 @@ void task_dump(void) {
         [TASK_UNUSED] = "unused",
         [TASK_RUNNABLE] = "runnable",
         [TASK_BLOCKED] = "blocked",
+        [TASK_ENDPOINT] = "endpoint",
     };
 
     for (unsigned i = 0; i < CONFIG_NUM_TASKS; i++) {
@@ -392,6 +561,14 @@ void task_dump(void) {
                 INFO("    - #%d %s", sender->tid, sender->name);
             }
         }
+
+        if (!list_is_empty(&task->receivers)) {
+            INFO("  receivers:");
+            LIST_FOR_EACH (receiver, &task->receivers, struct task,
+                           sender_next) {
+                INFO("    - #%d %s", receiver->tid, receiver->name);
+            }
+        }
     }
 }
 
@@ -401,6 +578,8 @@ void task_init(void) {
         list_init(&runqueues[i]);
     }
 
+    list_init(&timer_queue);
+
     for (int i = 0; i < CONFIG_NUM_TASKS; i++) {
         tasks[i].state = TASK_UNUSED;
         tasks[i].tid = i + 1;
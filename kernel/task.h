@@ -6,6 +6,7 @@
 #include <config.h>
 #include <list.h>
 #include <message.h>
+#include <printk.h>
 #include <types.h>
 
 /// The context switching time slice (# of ticks).
@@ -22,8 +23,13 @@ STATIC_ASSERT(TASK_TIME_SLICE > 0);
 #define TASK_RUNNABLE 1
 /// The task is waiting for a receiver/sender task in IPC.
 #define TASK_BLOCKED 2
+/// The task struct is an endpoint: it's not executed but it queues messages
+/// to be received by one of the tasks receiving from it.
+#define TASK_ENDPOINT 3
 
 #define TASK_PRIORITY_MAX 8
+/// The maximum number of pages mapped from a page fault reply.
+#define PAGER_MAP_MAX_PAGES 64
 STATIC_ASSERT(TASK_PRIORITY_MAX > 0);
 
 // struct arch_cpuvar *
@@ -57,12 +63,19 @@ struct task {
     char name[CONFIG_TASK_NAME_LEN];
     /// Flags.
     unsigned flags;
-    /// Number of references to this task.
+    /// Number of references to this task (as a pager or as the owner of
+    /// threads).
     unsigned ref_count;
+    /// The task which owns the address space. It points to the task itself
+    /// unless the task is a thread created with `TASK_THREAD`.
+    struct task *owner;
     /// The pager task. When a page fault or an exception (e.g. divide by zero)
     /// occurred, the kernel sends a message to the pager to allow it to
     /// resolve the faults (or kill the task).
     struct task *pager;
+    /// A page given by the pager in a page fault reply to be used for page
+    /// table structures. It is kept until the kernel needs a new table.
+    paddr_t kpage;
     /// The remaining time slice in ticks. If this value reaches 0, the kernel
     /// switches into the next task (so-called preemptive context switching).
     int quantum;
@@ -82,14 +95,35 @@ struct task {
     /// The IPC timeout in milliseconds. When it become 0, the kernel notify the
     /// task with `NOTIFY_TIMER`.
     msec_t timeout;
+    /// The remaining time in milliseconds until the kernel gives up waiting for
+    /// the peer task in the current IPC operation. Zero means no timeout.
+    msec_t ipc_timeout;
+    /// Set to true by the kernel when it aborts the blocked IPC operation
+    /// because `ipc_timeout` has expired.
+    bool ipc_timed_out;
     /// The queue of tasks that are waiting for this task to get ready for
     /// receiving a message. If this task gets ready, it resumes all threads in
     /// this queue.
     list_t senders;
+    /// The queue of tasks that are waiting for a message sent to this endpoint
+    /// (used only if the state is `TASK_ENDPOINT`).
+    list_t receivers;
+    /// True if the task is in an endpoint's sender queue and waits for the
+    /// reply from the receiver task (IPC_CALL).
+    bool endpoint_call;
     /// A (intrusive) list element in the runqueue.
     list_elem_t runqueue_next;
-    /// A (intrusive) list element in a sender queue.
+    /// A (intrusive) list element in a sender queue or an endpoint's receiver
+    /// queue.
     list_elem_t sender_next;
+    /// The task which owns the queue `sender_next` is linked into or NULL if
+    /// the task is not in any queue. Together with the task table (indexed by
+    /// task IDs), it serves as an index of sender queues: we can check whether
+    /// a specific sender is waiting for the receiver without walking its
+    /// queue.
+    struct task *queued_on;
+    /// A (intrusive) list element in the timer queue.
+    list_elem_t timer_next;
     /// Capabilities (bitmap).
     uint8_t caps[BITMAP_SIZE(CAP_MAX)];
 };
@@ -99,10 +133,36 @@ struct cpuvar {
     struct arch_cpuvar arch;
     struct task *current_task;
     struct task idle_task;
+    struct klog klog;
 };
 
+/// Appends `task` into `queue`, a sender queue or an endpoint's receiver queue
+/// owned by `owner`.
+static inline void ipc_queue_push(struct task *owner, list_t *queue,
+                                  struct task *task) {
+    DEBUG_ASSERT(!task->queued_on);
+    list_push_back(queue, &task->sender_next);
+    task->queued_on = owner;
+}
+
+/// Removes `task` from the queue it is waiting in (if any).
+static inline void ipc_queue_remove(struct task *task) {
+    list_remove(&task->sender_next);
+    task->queued_on = NULL;
+}
+
+/// Removes the first task from `queue`. Returns NULL if it's empty.
+static inline struct task *ipc_queue_pop(list_t *queue) {
+    struct task *task = LIST_POP_FRONT(queue, struct task, sender_next);
+    if (task) {
+        task->queued_on = NULL;
+    }
+
+    return task;
+}
+
 __mustuse error_t task_create(struct task *task, const char *name, vaddr_t ip,
-                              struct task *pager, unsigned flags);
+                              vaddr_t sp, struct task *pager, unsigned flags);
 __mustuse error_t task_destroy(struct task *task);
 __noreturn void task_exit(enum exception_type exp);
 void task_block(struct task *task);
@@ -111,6 +171,7 @@ error_t task_schedule(struct task *task, int priority);
 struct task *task_lookup(task_t tid);
 struct task *task_lookup_unchecked(task_t tid);
 void task_switch(void);
+void task_watch_timeout(struct task *task);
 __mustuse error_t vm_map(struct task *task, vaddr_t vaddr, paddr_t paddr,
                          paddr_t kpage, unsigned flags);
 __mustuse error_t vm_unmap(struct task *task, vaddr_t vaddr);
@@ -129,8 +190,9 @@ void unlock(void);
 void mp_start(void);
 int mp_self(void);
 int mp_num_cpus(void);
+struct cpuvar *mp_cpuvar_of(int cpu);
 void mp_reschedule(void);
-__mustuse error_t arch_task_create(struct task *task, vaddr_t ip);
+__mustuse error_t arch_task_create(struct task *task, vaddr_t ip, vaddr_t sp);
 void arch_task_destroy(struct task *task);
 void arch_task_switch(struct task *prev, struct task *next);
 void arch_enable_irq(unsigned irq);
@@ -138,6 +200,7 @@ void arch_disable_irq(unsigned irq);
 __mustuse error_t arch_vm_map(struct task *task, vaddr_t vaddr, paddr_t paddr,
                               paddr_t kpage, unsigned flags);
 __mustuse error_t arch_vm_unmap(struct task *task, vaddr_t vaddr);
+int arch_vm_accessed(struct task *task, vaddr_t vaddr);
 paddr_t vm_resolve(struct task *task, vaddr_t vaddr);
 
 #endif
@@ -0,0 +1,166 @@
+#include <avl.h>
+#include <print_macros.h>
+
+static int height(struct avl_node *node) {
+    return node ? node->height : 0;
+}
+
+static void update_height(struct avl_node *node) {
+    node->height = 1 + MAX(height(node->left), height(node->right));
+}
+
+/// Replaces the `old` child of `parent` (or the root if `parent` is NULL) with
+/// `new`.
+static void replace_child(struct avl_tree *tree, struct avl_node *parent,
+                          struct avl_node *old, struct avl_node *new) {
+    if (!parent) {
+        tree->root = new;
+    } else if (parent->left == old) {
+        parent->left = new;
+    } else {
+        parent->right = new;
+    }
+}
+
+/// Rotates the subtree left and returns the new subtree root.
+static struct avl_node *rotate_left(struct avl_tree *tree,
+                                    struct avl_node *node) {
+    struct avl_node *right = node->right;
+    node->right = right->left;
+    if (right->left) {
+        right->left->parent = node;
+    }
+
+    right->parent = node->parent;
+    replace_child(tree, node->parent, node, right);
+    right->left = node;
+    node->parent = right;
+    update_height(node);
+    update_height(right);
+    return right;
+}
+
+/// Rotates the subtree right and returns the new subtree root.
+static struct avl_node *rotate_right(struct avl_tree *tree,
+                                     struct avl_node *node) {
+    struct avl_node *left = node->left;
+    node->left = left->right;
+    if (left->right) {
+        left->right->parent = node;
+    }
+
+    left->parent = node->parent;
+    replace_child(tree, node->parent, node, left);
+    left->right = node;
+    node->parent = left;
+    update_height(node);
+    update_height(left);
+    return left;
+}
+
+/// Updates heights and restores the balance from `node` to the root.
+static void rebalance(struct avl_tree *tree, struct avl_node *node) {
+    while (node) {
+        update_height(node);
+        int balance = height(node->left) - height(node->right);
+        if (balance > 1) {
+            if (height(node->left->left) < height(node->left->right)) {
+                rotate_left(tree, node->left);
+            }
+
+            node = rotate_right(tree, node);
+        } else if (balance < -1) {
+            if (height(node->right->right) < height(node->right->left)) {
+                rotate_right(tree, node->right);
+            }
+
+            node = rotate_left(tree, node);
+        }
+
+        node = node->parent;
+    }
+}
+
+static struct avl_node *leftmost(struct avl_node *node) {
+    while (node && node->left) {
+        node = node->left;
+    }
+
+    return node;
+}
+
+void avl_init(struct avl_tree *tree) {
+    tree->root = NULL;
+}
+
+/// Inserts `node` into the tree. O(log n).
+void avl_insert(struct avl_tree *tree, struct avl_node *node,
+                avl_compare_t compare) {
+    struct avl_node *parent = NULL;
+    struct avl_node **link = &tree->root;
+    while (*link) {
+        parent = *link;
+        link = (compare(node, parent) < 0) ? &parent->left : &parent->right;
+    }
+
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->height = 1;
+    *link = node;
+    rebalance(tree, parent);
+}
+
+/// Removes `node` from the tree. O(log n).
+void avl_remove(struct avl_tree *tree, struct avl_node *node) {
+    if (node->left && node->right) {
+        // Replace the node with its successor (the leftmost node in the right
+        // subtree), which has no left child.
+        struct avl_node *succ = leftmost(node->right);
+        struct avl_node *fix_from;
+        if (succ->parent == node) {
+            fix_from = succ;
+        } else {
+            fix_from = succ->parent;
+            succ->parent->left = succ->right;
+            if (succ->right) {
+                succ->right->parent = succ->parent;
+            }
+
+            succ->right = node->right;
+            node->right->parent = succ;
+        }
+
+        succ->left = node->left;
+        node->left->parent = succ;
+        succ->parent = node->parent;
+        replace_child(tree, node->parent, node, succ);
+        rebalance(tree, fix_from);
+    } else {
+        struct avl_node *child = node->left ? node->left : node->right;
+        if (child) {
+            child->parent = node->parent;
+        }
+
+        replace_child(tree, node->parent, node, child);
+        rebalance(tree, node->parent);
+    }
+}
+
+/// Returns the node with the smallest key or NULL if the tree is empty.
+struct avl_node *avl_first(struct avl_tree *tree) {
+    return leftmost(tree->root);
+}
+
+/// Returns the next node in the key order or NULL if `node` is the last one.
+struct avl_node *avl_next(struct avl_node *node) {
+    if (node->right) {
+        return leftmost(node->right);
+    }
+
+    while (node->parent && node->parent->right == node) {
+        node = node->parent;
+    }
+
+    return node->parent;
+}
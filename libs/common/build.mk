@@ -1,3 +1,3 @@
 name := common
-objs-y += string.o vprintf.o ubsan.o bitmap.o
+objs-y += string.o vprintf.o ubsan.o bitmap.o avl.o
 subdirs-y += arch/$(ARCH)
@@ -0,0 +1,50 @@
+#ifndef __AVL_H__
+#define __AVL_H__
+
+#include <types.h>
+
+//  An intrusive AVL tree (a self-balancing binary search tree).
+//
+//  Usage:
+//
+//    struct element {
+//        struct avl_node node;
+//        int key;
+//    };
+//
+//    static int compare(struct avl_node *a, struct avl_node *b) {
+//        return AVL_CONTAINER(a, struct element, node)->key
+//               - AVL_CONTAINER(b, struct element, node)->key;
+//    }
+//
+//    avl_insert(&tree, &elem->node, compare);
+//
+//  Lookups are done by walking `tree->root` (`left` has smaller keys and
+//  `right` has greater or equal keys).
+//
+#define AVL_CONTAINER(node, container, field)                                  \
+    ((container *) ((vaddr_t)(node) -offsetof(container, field)))
+
+struct avl_node {
+    struct avl_node *parent;
+    struct avl_node *left;
+    struct avl_node *right;
+    int height;
+};
+
+struct avl_tree {
+    struct avl_node *root;
+};
+
+/// Returns a negative value if `a` is less than `b`, zero if they're equal, or
+/// a positive value if `a` is greater than `b`.
+typedef int (*avl_compare_t)(struct avl_node *a, struct avl_node *b);
+
+void avl_init(struct avl_tree *tree);
+void avl_insert(struct avl_tree *tree, struct avl_node *node,
+                avl_compare_t compare);
+void avl_remove(struct avl_tree *tree, struct avl_node *node);
+struct avl_node *avl_first(struct avl_tree *tree);
+struct avl_node *avl_next(struct avl_node *node);
+
+#endif
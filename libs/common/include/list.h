@@ -80,9 +80,15 @@ static inline void list_nullify(list_elem_t *elem) {
     elem->next = NULL;
 }
 
+// Returns true if the element is not in a list (invalidated by
+// `list_nullify`).
+static inline bool list_is_null(list_elem_t *elem) {
+    return elem->next == NULL;
+}
+
 // Removes a element from the list.
 static inline void list_remove(list_elem_t *elem) {
-    if (!elem->next) {
+    if (list_is_null(elem)) {
         // The element is not in a list.
         return;
     }
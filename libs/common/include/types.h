@@ -119,7 +119,8 @@ typedef int error_t;
 #define DONT_REPLY         (-14)
 #define ERR_IN_USE         (-15)
 #define ERR_TRY_AGAIN      (-16)
-#define ERR_END            (-17)
+#define ERR_TIMEOUT        (-17)
+#define ERR_END            (-18)
 
 // System call numbers.
 #define SYS_NOP           1
@@ -138,18 +139,35 @@ typedef int error_t;
 #define SYS_VM_UNMAP      14
 #define SYS_IRQ_ACQUIRE   15
 #define SYS_IRQ_RELEASE   16
+#define SYS_VM_ACCESSED   17
 
 // Task flags.
-#define TASK_ALL_CAPS (1 << 0)
-#define TASK_ABI_EMU  (1 << 1)
-#define TASK_SCHED    (1 << 2)
-#define TASK_HV       (1 << 3)
+#define TASK_ALL_CAPS    (1 << 0)
+#define TASK_ABI_EMU     (1 << 1)
+#define TASK_SCHED       (1 << 2)
+#define TASK_HV          (1 << 3)
+#define TASK_THREAD      (1 << 4)
+#define TASK_AS_ENDPOINT (1 << 5)
 
 // Map flags.
 // TODO: Support No-Execute bit
 #define MAP_TYPE(flags)    ((flags) &0b11)
 #define MAP_TYPE_READONLY  (0b01 << 0)
 #define MAP_TYPE_READWRITE (0b10 << 0)
+/// Map a large page (LARGE_PAGE_SIZE bytes) instead of a page. Both the virtual
+/// and physical addresses must be aligned to LARGE_PAGE_SIZE.
+#define MAP_LARGE (1 << 2)
+#define LARGE_PAGE_SIZE (512 * PAGE_SIZE)
+/// Map `n` (up to MAP_MAX_PAGES) pages from the virtual address at once: the
+/// `src` is the address of an array of `n` source addresses (0 skips the
+/// page). If it returns ERR_TRY_AGAIN, retry the whole array with a new
+/// kpage: mapping a page again with the same address is harmless.
+#define MAP_PAGES(n)         ((n) << 16)
+#define MAP_NUM_PAGES(flags) (((flags) >> 16) & 0xffff)
+#define MAP_MAX_PAGES        64
+
+// vm.alloc_pages flags.
+#define VM_ALLOC_LARGE (1 << 0)
 
 // IPC source task IDs.
 #define IPC_ANY 0 /* So-called "open receive". */
@@ -175,6 +193,10 @@ typedef uint8_t notifications_t;
 #define NOTIFY_ABORTED (1 << 2)
 #define NOTIFY_ASYNC   (1 << 3)
 
+/// Requests the task to print its heap profile (see `malloc_profile_dump()`).
+/// It's handled in libresea and servers don't have to care about it.
+#define NOTIFY_MALLOC_PROFILE (1 << 4)
+
 // Page Fault exception error codes.
 #define EXP_PF_PRESENT (1 << 0)
 #define EXP_PF_WRITE   (1 << 1)
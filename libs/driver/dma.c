@@ -9,6 +9,9 @@ dma_t dma_alloc(size_t len, unsigned flags) {
     m.type = VM_ALLOC_PAGES_MSG;
     m.vm_alloc_pages.paddr = 0;
     m.vm_alloc_pages.num_pages = ALIGN_UP(len, PAGE_SIZE) / PAGE_SIZE;
+    // Map large areas (e.g. framebuffers) with large pages to reduce TLB
+    // misses.
+    m.vm_alloc_pages.flags = (len >= LARGE_PAGE_SIZE) ? VM_ALLOC_LARGE : 0;
     error_t err = ipc_call(VM_TASK, &m);
     ASSERT_OK(err);
     ASSERT(m.type == VM_ALLOC_PAGES_REPLY_MSG);
@@ -23,7 +26,12 @@ dma_t dma_alloc(size_t len, unsigned flags) {
 
 /// Frees a DMA area.
 void dma_free(dma_t dma) {
-    // TODO:
+    struct message m;
+    m.type = VM_FREE_PAGES_MSG;
+    m.vm_free_pages.vaddr = dma->vaddr;
+    error_t err = ipc_call(VM_TASK, &m);
+    ASSERT_OK(err);
+    free(dma);
 }
 
 /// Performs arch-specific pre-DMA work after writing into the DMA area.
@@ -37,7 +37,11 @@ struct elf32_ehdr {
     uint16_t e_shstrndx;
 } __packed;
 
+#define PT_LOAD 1
 #define PT_NOTE 4
+#define PF_X    (1 << 0)
+#define PF_W    (1 << 1)
+#define PF_R    (1 << 2)
 struct elf64_phdr {
     uint32_t p_type;
     uint32_t p_flags;
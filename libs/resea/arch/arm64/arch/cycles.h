@@ -0,0 +1,13 @@
+#ifndef __ARCH_CYCLES_H__
+#define __ARCH_CYCLES_H__
+
+#include <types.h>
+
+/// Returns the CPU cycle counter (PMCCNTR_EL0).
+static inline uint64_t cycle_counter(void) {
+    uint64_t value;
+    __asm__ __volatile__("mrs %0, pmccntr_el0" : "=r"(value));
+    return value;
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef __ARCH_CYCLES_H__
+#define __ARCH_CYCLES_H__
+
+#include <types.h>
+
+static inline uint64_t cycle_counter(void) {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef __ARCH_CYCLES_H__
+#define __ARCH_CYCLES_H__
+
+#include <types.h>
+
+/// Returns the CPU cycle counter (TSC).
+static inline uint64_t cycle_counter(void) {
+    uint32_t eax, edx;
+    __asm__ __volatile__("rdtscp" : "=a"(eax), "=d"(edx)::"%ecx");
+    return (((uint64_t) edx) << 32) | eax;
+}
+
+#endif
@@ -34,7 +34,18 @@ error_t async_send(task_t dst, struct message *m) {
 
 error_t async_recv(task_t src, struct message *m) {
     m->type = ASYNC_MSG;
-    return ipc_call(src, m);
+    error_t err = ipc_call(src, m);
+    if (err == OK && src == VM_TASK) {
+        // We handle async messages from vm: let vm tell us when servers we
+        // look for exit so that their lookup results can be cached.
+        ipc_lookup_enable_watch();
+        if (m->type == TASK_EXITED_MSG) {
+            // The task might be a server we've looked for.
+            ipc_lookup_invalidate(m->task_exited.task);
+        }
+    }
+
+    return err;
 }
 
 error_t async_reply(task_t dst) {
@@ -10,11 +10,19 @@ void ipc_reply(task_t dst, struct message *m);
 void ipc_reply_err(task_t dst, error_t error);
 error_t ipc_notify(task_t dst, notifications_t notifications);
 error_t ipc_recv(task_t src, struct message *m);
+error_t ipc_recv_timeout(task_t src, struct message *m, msec_t timeout);
+error_t ipc_recv_noblock(task_t src, struct message *m);
 error_t ipc_call(task_t dst, struct message *m);
+error_t ipc_call_timeout(task_t dst, struct message *m, msec_t timeout);
 error_t ipc_send_err(task_t dst, error_t error);
 error_t ipc_replyrecv(task_t dst, struct message *m);
+void ipc_fill_ool_bufs(void);
 error_t ipc_serve(const char *name);
 task_t ipc_lookup(const char *name);
+void ipc_lookup_enable_watch(void);
+void ipc_lookup_invalidate(task_t task);
+task_t endpoint_create(void);
+error_t endpoint_destroy(task_t endpoint);
 void discard_unknown_message(struct message *m);
 
 #endif
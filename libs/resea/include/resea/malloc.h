@@ -2,40 +2,94 @@
 #define __RESEA_MALLOC_H__
 
 #include <config.h>
+#include <list.h>
 #include <types.h>
 
 #define MALLOC_FREE        0x0a110ced0a110cedULL /* hexspeak of "alloced" */
-#define MALLOC_IN_USE      0xdea110cddea110cdULL /* hexspeak of "deallocd" */
 #define MALLOC_REDZONE_LEN 16
-#define MALLOC_FRAME_LEN   (sizeof(struct malloc_chunk) + MALLOC_REDZONE_LEN)
 
 #define MALLOC_REDZONE_UNDFLOW_MARKER 0x5a
 #define MALLOC_REDZONE_OVRFLOW_MARKER 0x5b
 
-/// The header of allocated/free memory chunks. The data area follows
-//  immediately after this header (`data` points to the area).
-struct malloc_chunk {
-    struct malloc_chunk *next;
-    size_t capacity;
+/// The largest size served from slabs. Larger blocks are allocated in pages.
+#define MALLOC_SLAB_MAX 2048
+/// The number of slab size classes (see `class_sizes` in malloc.c).
+#define MALLOC_NUM_CLASSES 24
+/// Free page runs shorter than this are kept in exact-length lists.
+#define MALLOC_NUM_RUN_BINS 32
+
+enum malloc_page_type {
+    /// The first page of a free page run.
+    MALLOC_PAGE_FREE = 1,
+    /// A page holding small objects of a size class.
+    MALLOC_PAGE_SLAB = 2,
+    /// The first page of a large block.
+    MALLOC_PAGE_LARGE = 3,
+};
+
+/// The metadata of a heap page. The heap is split into runs of pages: a free
+/// run, a slab (a single page), or a large block. Only the first page of a
+/// run (`type`, `num_pages`, and so on) and the last one (`head`) are kept
+/// up to date. `type` of other pages is 0.
+struct malloc_page {
+    /// An element in a free run list or a partial slab list.
+    list_elem_t next;
+    /// The type of the run (`enum malloc_page_type`).
+    uint8_t type;
+    /// The size class (slab).
+    uint8_t class;
+    /// The number of free objects (slab).
+    uint16_t num_free;
+    /// The number of pages in the run.
+    uint32_t num_pages;
+    /// The index of the first page of the run (valid in its last page).
+    uint32_t head;
+    /// The offset of the first object which has never been allocated (slab).
+    uint32_t unused_offset;
+    /// Freed objects (slab).
+    void *free_objs;
+    /// The requested size (large block).
     size_t size;
-    uint64_t magic;
-    uint8_t underflow_redzone[MALLOC_REDZONE_LEN];
-    uint8_t data[];
-    // `overflow_redzone` follows immediately after `data`.
-    // uint8_t overflow_redzone[MALLOC_REDZONE_LEN];
+    /// The index in the call site table (large block, `MALLOC_PROFILE`).
+    uint32_t site;
 };
 
-#ifdef ARCH_X64
-/// Ensure that it's aligned to 16 bytes for performance (SSE instructions
-/// requires 128-bit-aligned memory address).
-STATIC_ASSERT(sizeof(struct malloc_chunk) == 48);
-#endif
+/// The header of a slab object in debug builds or with `MALLOC_PROFILE`.
+/// The data area follows immediately after this header and the overflow
+/// redzone (debug builds) follows the data.
+struct malloc_header {
+    uint32_t size;
+    /// The index in the call site table (`MALLOC_PROFILE`).
+    uint32_t site;
+    uint8_t underflow_redzone[sizeof(uint64_t)];
+};
+
+STATIC_ASSERT(sizeof(struct malloc_header) == MALLOC_REDZONE_LEN);
+
+/// The number of call sites tracked by `MALLOC_PROFILE`. The last entry
+/// counts allocations from call sites which didn't fit in the table.
+#define MALLOC_PROFILE_NUM_SITES 128
+/// The number of size histogram buckets: the i-th bucket counts allocations
+/// of (8 << i, 16 << i] bytes. The last one counts all larger ones.
+#define MALLOC_PROFILE_NUM_BUCKETS 16
+
+/// Allocation statistics of a call site (`MALLOC_PROFILE`).
+struct malloc_site {
+    /// The return address of the malloc call (0 if not in use).
+    vaddr_t addr;
+    size_t num_allocs;
+    size_t num_frees;
+    size_t live_bytes;
+    size_t peak_bytes;
+};
 
 void *malloc(size_t size);
+void *aligned_alloc(size_t align, size_t size);
 void *realloc(void *ptr, size_t size);
 void free(void *ptr);
 char *strndup(const char *s, size_t n);
 char *strdup(const char *s);
+void malloc_profile_dump(void);
 void malloc_init(void);
 
 #endif
@@ -4,11 +4,14 @@
 #include <types.h>
 
 struct message;
-error_t sys_ipc(task_t dst, task_t src, struct message *m, unsigned flags);
+error_t sys_ipc(task_t dst, task_t src, struct message *m, unsigned flags,
+                msec_t timeout);
 error_t sys_notify(task_t dst, notifications_t notifications);
 error_t sys_timer_set(msec_t timeout);
 task_t sys_task_create(task_t tid, const char *name, vaddr_t ip, task_t pager,
                        unsigned flags);
+task_t sys_thread_create(task_t tid, const char *name, vaddr_t ip,
+                         vaddr_t sp);
 error_t sys_task_destroy(task_t task);
 error_t sys_task_exit(void);
 task_t sys_task_self(void);
@@ -16,6 +19,7 @@ error_t sys_task_schedule(task_t task, int priority);
 error_t sys_vm_map(task_t task, vaddr_t vaddr, vaddr_t src, vaddr_t kpage,
                    unsigned flags);
 error_t sys_vm_unmap(task_t task, vaddr_t vaddr);
+int sys_vm_accessed(task_t task, vaddr_t vaddr);
 error_t sys_irq_acquire(unsigned irq);
 error_t sys_irq_release(unsigned irq);
 error_t sys_console_write(const char *buf, size_t len);
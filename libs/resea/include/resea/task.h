@@ -11,6 +11,7 @@ task_t task_self(void);
 error_t vm_map(task_t task, vaddr_t vaddr, vaddr_t src, vaddr_t kpage,
                unsigned flags);
 error_t vm_unmap(task_t task, vaddr_t vaddr);
+int vm_accessed(task_t task, vaddr_t vaddr);
 error_t task_schedule(task_t task, int priority);
 
 #endif
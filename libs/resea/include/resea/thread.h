@@ -0,0 +1,31 @@
+#ifndef __RESEA_THREAD_H__
+#define __RESEA_THREAD_H__
+
+#include <config.h>
+#include <types.h>
+
+/// The size of the stack allocated for each thread.
+#define THREAD_STACK_SIZE (64 * 1024)
+
+typedef void (*thread_entry_t)(void *arg);
+
+/// OoL receive buffers registered to the vm server.
+struct ool_bufs {
+    void *ptrs[CONFIG_OOL_NUM_BUFS];
+    unsigned num;
+};
+
+/// Per-thread states.
+struct thread {
+    bool in_use;
+    /// The stack. It's reused by a thread with the same task ID.
+    void *stack;
+    /// The buffers to receive ool payloads.
+    struct ool_bufs ool_bufs;
+};
+
+task_t thread_create(const char *name, thread_entry_t entry, void *arg);
+__noreturn void thread_exit(void);
+struct thread *thread_current(void);
+
+#endif
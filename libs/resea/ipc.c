@@ -2,14 +2,35 @@
 #include <resea/malloc.h>
 #include <resea/printf.h>
 #include <resea/syscall.h>
+#include <resea/thread.h>
 #include <string.h>
 
-/// The internal buffer to receive ool payloads.
+/// The internal buffers to receive ool payloads (used by the main thread).
 #ifndef CONFIG_NOMMU
-static void *ool_ptr = NULL;
+static struct ool_bufs ool_bufs;
 static const size_t ool_len = CONFIG_OOL_BUFFER_LEN;
 #endif
 
+/// The number of cached `ipc_lookup` results.
+#define LOOKUP_CACHE_SIZE 8
+/// The maximum length of service names cached by `ipc_lookup`.
+#define LOOKUP_CACHE_NAME_LEN 32
+
+/// A cached result of `ipc_lookup`. Results are cached only if vm watches the
+/// servers for us (see `ipc_lookup_enable_watch()`): the entry is dropped when
+/// we receive `task.exited` from vm through `async_recv()`, or when IPC to the
+/// server fails because it no longer exists.
+struct lookup_cache_entry {
+    char name[LOOKUP_CACHE_NAME_LEN];
+    task_t task;
+};
+
+static struct lookup_cache_entry lookup_cache[LOOKUP_CACHE_SIZE];
+/// The entry replaced by the next cache miss (round-robin).
+static unsigned lookup_cache_next = 0;
+/// True if vm watches the servers we've looked for on behalf of us.
+static bool lookup_watch = false;
+
 // for sparse
 error_t ipc_call_pager(struct message *m);
 
@@ -24,14 +45,15 @@ __weak error_t ipc_call_pager(struct message *m) {
 }
 
 #ifndef CONFIG_NOMMU
-static void ool_recv(vaddr_t ptr, size_t len) {
+static void ool_recv_bufs(vaddr_t *ptrs, size_t num, size_t len) {
     struct message m;
-    m.type = OOL_RECV_MSG;
-    m.ool_recv.addr = ptr;
-    m.ool_recv.len = len;
+    m.type = OOL_RECV_BUFS_MSG;
+    m.ool_recv_bufs.bufs = (vaddr_t) ptrs;
+    m.ool_recv_bufs.num = num;
+    m.ool_recv_bufs.len = len;
     error_t err = ipc_call_pager(&m);
     ASSERT_OK(err);
-    ASSERT(m.type == OOL_RECV_REPLY_MSG);
+    ASSERT(m.type == OOL_RECV_BUFS_REPLY_MSG);
 }
 
 static vaddr_t ool_send(task_t dst, vaddr_t ptr, size_t len) {
@@ -60,6 +82,13 @@ static vaddr_t ool_verify(task_t src, vaddr_t ptr, size_t len) {
     ASSERT(m.type == OOL_VERIFY_REPLY_MSG);
     return m.ool_verify_reply.received_at;
 }
+
+/// Returns the receive buffers of the current thread. The vm server manages
+/// receive buffers per task ID: each thread needs its own ones.
+static struct ool_bufs *current_ool_bufs(void) {
+    struct thread *thread = thread_current();
+    return thread ? &thread->ool_bufs : &ool_bufs;
+}
 #endif
 
 static void pre_send(task_t dst, struct message *m) {
@@ -74,16 +103,55 @@ static void pre_send(task_t dst, struct message *m) {
 #endif
 }
 
+/// Registers receive buffers for OoL payloads so that the current thread has
+/// `CONFIG_OOL_NUM_BUFS` ones. Receive operations do this automatically once
+/// the half of them have been consumed: call this before a burst of OoL
+/// payloads from multiple senders.
+void ipc_fill_ool_bufs(void) {
+#ifndef CONFIG_NOMMU
+    struct ool_bufs *bufs = current_ool_bufs();
+    if (bufs->num == CONFIG_OOL_NUM_BUFS) {
+        return;
+    }
+
+    vaddr_t ptrs[CONFIG_OOL_NUM_BUFS];
+    size_t num = 0;
+    while (bufs->num < CONFIG_OOL_NUM_BUFS) {
+        // Page-aligned so that vm can remap large payloads into the buffer
+        // instead of copying them.
+        void *ptr = aligned_alloc(PAGE_SIZE, ool_len);
+        bufs->ptrs[bufs->num++] = ptr;
+        ptrs[num++] = (vaddr_t) ptr;
+    }
+
+    ool_recv_bufs(ptrs, num, ool_len);
+#endif
+}
+
 static void pre_recv(void) {
 #ifndef CONFIG_NOMMU
-    if (!ool_ptr) {
-        ool_ptr = malloc(ool_len);
-        ool_recv((vaddr_t) ool_ptr, ool_len);
+    // Register new receive buffers in a batch once the half of them have
+    // been consumed so that senders don't wait for us to register a new one.
+    if (current_ool_bufs()->num <= CONFIG_OOL_NUM_BUFS / 2) {
+        ipc_fill_ool_bufs();
     }
 #endif
 }
 
 static error_t post_recv(error_t err, struct message *m) {
+    if (IS_ERROR(err)) {
+        // The receive operation has failed (e.g. ERR_TIMEOUT): `m` still
+        // contains the message we've sent.
+        return err;
+    }
+
+    if (m->type == NOTIFICATIONS_MSG
+        && (m->notifications.data & NOTIFY_MALLOC_PROFILE)) {
+        // Requested by the shell (the `heap-profile` command).
+        malloc_profile_dump();
+        m->notifications.data &= ~NOTIFY_MALLOC_PROFILE;
+    }
+
 #ifndef CONFIG_NOMMU
     if (!IS_ERROR(m->type) && m->type & MSG_OOL) {
         // Received a ool payload.
@@ -96,9 +164,15 @@ static error_t post_recv(error_t err, struct message *m) {
             return OK;
         }
 
-        // We've consumed `ool_ptr` so set NULL to it
-        // and reallocate the receiver buffer later.
-        ool_ptr = NULL;
+        // We've consumed the buffer. Forget it and register a new one
+        // later.
+        struct ool_bufs *bufs = current_ool_bufs();
+        for (unsigned i = 0; i < bufs->num; i++) {
+            if (bufs->ptrs[i] == m->ool_ptr) {
+                bufs->ptrs[i] = bufs->ptrs[--bufs->num];
+                break;
+            }
+        }
 
         // A mitigation for a non-terminated (malicious) string payload.
         if (m->type & MSG_STR) {
@@ -113,10 +187,19 @@ static error_t post_recv(error_t err, struct message *m) {
     return (IS_OK(err) && m->type < 0) ? m->type : err;
 }
 
+/// Drops cached `ipc_lookup` results of `dst` if the IPC to it has failed
+/// because it no longer exists (e.g. the server has exited).
+static void invalidate_on_error(task_t dst, error_t err) {
+    if (err == ERR_INVALID_TASK || err == ERR_NOT_FOUND) {
+        ipc_lookup_invalidate(dst);
+    }
+}
+
 error_t ipc_send(task_t dst, struct message *m) {
     void *saved_ool_ptr = m->ool_ptr;
     pre_send(dst, m);
-    error_t err = sys_ipc(dst, 0, m, IPC_SEND);
+    error_t err = sys_ipc(dst, 0, m, IPC_SEND, 0);
+    invalidate_on_error(dst, err);
     m->ool_ptr = saved_ool_ptr;
     return err;
 }
@@ -124,7 +207,8 @@ error_t ipc_send(task_t dst, struct message *m) {
 error_t ipc_send_noblock(task_t dst, struct message *m) {
     void *saved_ool_ptr = m->ool_ptr;
     pre_send(dst, m);
-    error_t err = sys_ipc(dst, 0, m, IPC_SEND | IPC_NOBLOCK);
+    error_t err = sys_ipc(dst, 0, m, IPC_SEND | IPC_NOBLOCK, 0);
+    invalidate_on_error(dst, err);
     m->ool_ptr = saved_ool_ptr;
     return err;
 }
@@ -151,15 +235,37 @@ error_t ipc_notify(task_t dst, notifications_t notifications) {
 }
 
 error_t ipc_recv(task_t src, struct message *m) {
+    return ipc_recv_timeout(src, m, 0);
+}
+
+/// Same as `ipc_recv` but gives up waiting for a message after `timeout`
+/// milliseconds and returns `ERR_TIMEOUT`. Unlike `timer_set`, it doesn't
+/// consume the task's timer.
+error_t ipc_recv_timeout(task_t src, struct message *m, msec_t timeout) {
+    pre_recv();
+    error_t err = sys_ipc(0, src, m, IPC_RECV, timeout);
+    return post_recv(err, m);
+}
+
+/// Same as `ipc_recv` but returns `ERR_WOULD_BLOCK` instead of blocking if
+/// there're no pending messages.
+error_t ipc_recv_noblock(task_t src, struct message *m) {
     pre_recv();
-    error_t err = sys_ipc(0, src, m, IPC_RECV);
+    error_t err = sys_ipc(0, src, m, IPC_RECV | IPC_NOBLOCK, 0);
     return post_recv(err, m);
 }
 
 error_t ipc_call(task_t dst, struct message *m) {
+    return ipc_call_timeout(dst, m, 0);
+}
+
+/// Same as `ipc_call` but returns `ERR_TIMEOUT` if `dst` does not receive the
+/// message or reply to it within `timeout` milliseconds (each).
+error_t ipc_call_timeout(task_t dst, struct message *m, msec_t timeout) {
     pre_recv();
     pre_send(dst, m);
-    error_t err = sys_ipc(dst, dst, m, IPC_CALL);
+    error_t err = sys_ipc(dst, dst, m, IPC_CALL, timeout);
+    invalidate_on_error(dst, err);
     return post_recv(err, m);
 }
 
@@ -167,7 +273,7 @@ error_t ipc_replyrecv(task_t dst, struct message *m) {
     pre_recv();
     pre_send(dst, m);
     unsigned flags = (dst < 0) ? IPC_RECV : (IPC_SEND | IPC_RECV | IPC_NOBLOCK);
-    error_t err = sys_ipc(dst, IPC_ANY, m, flags);
+    error_t err = sys_ipc(dst, IPC_ANY, m, flags, 0);
     return post_recv(err, m);
 }
 
@@ -178,10 +284,21 @@ error_t ipc_serve(const char *name) {
     return ipc_call_pager(&m);
 }
 
+/// Looks for a service. This blocks until the service appears. If
+/// `ipc_lookup_enable_watch()` has been called, the result is cached until the
+/// server exits.
 task_t ipc_lookup(const char *name) {
+    for (int i = 0; i < LOOKUP_CACHE_SIZE; i++) {
+        struct lookup_cache_entry *e = &lookup_cache[i];
+        if (e->task && !strcmp(e->name, name)) {
+            return e->task;
+        }
+    }
+
     struct message m;
     m.type = DISCOVERY_LOOKUP_MSG;
     m.discovery_lookup.name = (char *) name;
+    m.discovery_lookup.watch = lookup_watch;
 
     error_t err = ipc_call_pager(&m);
     if (IS_ERROR(err)) {
@@ -189,7 +306,57 @@ task_t ipc_lookup(const char *name) {
     }
 
     ASSERT_OK(m.type == DISCOVERY_LOOKUP_REPLY_MSG);
-    return m.discovery_lookup_reply.task;
+    task_t task = m.discovery_lookup_reply.task;
+    // Without the watch, we won't know that the server has exited before its
+    // task ID is reused by an unrelated task.
+    if (lookup_watch && strlen(name) < LOOKUP_CACHE_NAME_LEN) {
+        struct lookup_cache_entry *e = &lookup_cache[lookup_cache_next];
+        strncpy2(e->name, name, sizeof(e->name));
+        e->task = task;
+        lookup_cache_next = (lookup_cache_next + 1) % LOOKUP_CACHE_SIZE;
+    }
+
+    return task;
+}
+
+/// Asks vm to send `task.exited` when a server looked for by `ipc_lookup`
+/// exits so that its cached result is dropped before its task ID gets reused.
+/// `async_recv()` calls this once the task receives async messages from vm:
+/// call it only if the task keeps doing so.
+void ipc_lookup_enable_watch(void) {
+    lookup_watch = true;
+}
+
+/// Drops cached `ipc_lookup` results which point to the exited task.
+void ipc_lookup_invalidate(task_t task) {
+    for (int i = 0; i < LOOKUP_CACHE_SIZE; i++) {
+        if (lookup_cache[i].task == task) {
+            lookup_cache[i].task = 0;
+        }
+    }
+}
+
+/// Creates an endpoint. Messages sent to the endpoint are received by one of
+/// the tasks calling `ipc_recv(endpoint, ...)`. The receiver replies directly
+/// to the sender (`m.src`). Returns the endpoint ID on success.
+task_t endpoint_create(void) {
+    struct message m;
+    m.type = ENDPOINT_CREATE_MSG;
+    error_t err = ipc_call_pager(&m);
+    if (IS_ERROR(err)) {
+        return err;
+    }
+
+    ASSERT(m.type == ENDPOINT_CREATE_REPLY_MSG);
+    return m.endpoint_create_reply.endpoint;
+}
+
+/// Destroys an endpoint. Tasks blocked on it return ERR_ABORTED.
+error_t endpoint_destroy(task_t endpoint) {
+    struct message m;
+    m.type = ENDPOINT_DESTROY_MSG;
+    m.endpoint_destroy.endpoint = endpoint;
+    return ipc_call_pager(&m);
 }
 
 /// Discards an unknown message.
@@ -3,175 +3,459 @@
 #include <resea/printf.h>
 #include <string.h>
 
-#define NUM_BINS 16
 extern char __heap[];
 extern char __heap_end[];
 
-static struct malloc_chunk *bins[NUM_BINS];
-
-static void check_buffer_overflow(struct malloc_chunk *chunk) {
-    if (chunk->magic == MALLOC_FREE) {
-        return;
+#ifdef CONFIG_BUILD_DEBUG
+// Surround each block with redzones to detect buffer overflows.
+#    define REDZONE_LEN MALLOC_REDZONE_LEN
+#else
+#    define REDZONE_LEN 0
+#endif
+
+#if defined(CONFIG_BUILD_DEBUG) || defined(CONFIG_MALLOC_PROFILE)
+// Slab objects have a header to remember their sizes.
+#    define HAS_HEADER 1
+#    define HEADER_LEN sizeof(struct malloc_header)
+#else
+#    define HAS_HEADER 0
+#    define HEADER_LEN 0
+#endif
+
+/// The object sizes of slabs. Each of them is a multiple of 16 so that every
+/// object is aligned to 16 bytes.
+static const uint16_t class_sizes[MALLOC_NUM_CLASSES] = {
+    16,  32,  48,  64,  80,  96,  112, 128,  160,  192,  224,  256,
+    320, 384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+};
+/// Maps `(size + 15) / 16` to the smallest size class which fits the size.
+static uint8_t size_to_class[MALLOC_SLAB_MAX / 16 + 1];
+/// Slabs which have at least one free object.
+static list_t partial_slabs[MALLOC_NUM_CLASSES];
+/// Free page runs. The i-th list holds runs of (i + 1) pages except the last
+/// one, which holds all larger runs.
+static list_t free_runs[MALLOC_NUM_RUN_BINS];
+/// The metadata of heap pages, placed at the beginning of the heap.
+static struct malloc_page *pages;
+/// The address of the page described by `pages[0]`.
+static vaddr_t heap_base;
+static uint32_t heap_num_pages;
+/// Serializes heap operations from threads (see `thread_create()`).
+static volatile int heap_lock = 0;
+
+#ifdef CONFIG_MALLOC_PROFILE
+static struct malloc_site sites[MALLOC_PROFILE_NUM_SITES];
+static size_t histogram[MALLOC_PROFILE_NUM_BUCKETS];
+static size_t live_bytes = 0;
+static size_t peak_bytes = 0;
+static unsigned num_snapshots = 0;
+#endif
+
+static void lock_heap(void) {
+    while (__sync_lock_test_and_set(&heap_lock, 1)) {
+        // Another thread is in malloc() or free(). Wait for it.
     }
+}
+
+static void unlock_heap(void) {
+    __sync_lock_release(&heap_lock);
+}
+
+static inline vaddr_t page_addr(struct malloc_page *page) {
+    return heap_base + (page - pages) * PAGE_SIZE;
+}
 
+#ifdef CONFIG_BUILD_DEBUG
+static void fill_overflow_redzone(uint8_t *data, size_t size) {
+    memset(&data[size], MALLOC_REDZONE_OVRFLOW_MARKER, MALLOC_REDZONE_LEN);
+}
+
+static void check_overflow_redzone(uint8_t *data, size_t size) {
     for (size_t i = 0; i < MALLOC_REDZONE_LEN; i++) {
-        if (chunk->underflow_redzone[i] != MALLOC_REDZONE_UNDFLOW_MARKER) {
-            PANIC("detected a malloc buffer underflow: ptr=%p", chunk->data);
+        if (data[size + i] != MALLOC_REDZONE_OVRFLOW_MARKER) {
+            PANIC("detected a malloc buffer overflow: ptr=%p", data);
         }
     }
+}
+#endif
+
+#ifdef CONFIG_MALLOC_PROFILE
+/// Returns the index of the call site in `sites`.
+static uint32_t lookup_site(vaddr_t addr) {
+    uint32_t num_sites = MALLOC_PROFILE_NUM_SITES - 1;
+    uint32_t start = (addr >> 2) % num_sites;
+    for (uint32_t i = 0; i < num_sites; i++) {
+        uint32_t index = (start + i) % num_sites;
+        if (!sites[index].addr) {
+            sites[index].addr = addr;
+            return index;
+        }
 
-    for (size_t i = 0; i < MALLOC_REDZONE_LEN; i++) {
-        if (chunk->data[chunk->capacity + i] != MALLOC_REDZONE_OVRFLOW_MARKER) {
-            PANIC("detected a malloc buffer overflow: ptr=%p", chunk->data);
+        if (sites[index].addr == addr) {
+            return index;
         }
     }
-}
 
-static struct malloc_chunk *insert(void *ptr, size_t len) {
-    ASSERT(len > MALLOC_FRAME_LEN);
-    struct malloc_chunk *new_chunk = ptr;
-    new_chunk->magic = MALLOC_FREE;
-    new_chunk->capacity = len - MALLOC_FRAME_LEN;
-    new_chunk->size = 0;
-    new_chunk->next = NULL;
+    // The table is full.
+    return num_sites;
+}
 
-    // Append the new chunk into the linked list.
-    struct malloc_chunk **chunk = &bins[NUM_BINS - 1];
-    while (*chunk != NULL) {
-        check_buffer_overflow(*chunk);
-        chunk = &(*chunk)->next;
+static uint32_t profile_alloc(void *addr, size_t size) {
+    uint32_t index = lookup_site((vaddr_t) addr);
+    struct malloc_site *site = &sites[index];
+    site->num_allocs++;
+    site->live_bytes += size;
+    site->peak_bytes = MAX(site->peak_bytes, site->live_bytes);
+    live_bytes += size;
+    peak_bytes = MAX(peak_bytes, live_bytes);
+
+    int bucket = 0;
+    while (bucket < MALLOC_PROFILE_NUM_BUCKETS - 1
+           && size > (16UL << bucket)) {
+        bucket++;
     }
-    *chunk = new_chunk;
+    histogram[bucket]++;
+    return index;
+}
+
+static void profile_free(uint32_t index, size_t size) {
+    sites[index].num_frees++;
+    sites[index].live_bytes -= size;
+    live_bytes -= size;
+}
+#else
+static inline uint32_t profile_alloc(__unused void *addr,
+                                     __unused size_t size) {
+    return 0;
+}
+
+static inline void profile_free(__unused uint32_t index,
+                                __unused size_t size) {
+}
+#endif
 
-    return new_chunk;
+static int run_bin(uint32_t num_pages) {
+    return (num_pages < MALLOC_NUM_RUN_BINS) ? num_pages - 1
+                                             : MALLOC_NUM_RUN_BINS - 1;
 }
 
-static struct malloc_chunk *split(struct malloc_chunk *chunk, size_t len) {
-    size_t new_chunk_len = MALLOC_FRAME_LEN + len;
-    ASSERT(chunk->capacity >= new_chunk_len);
+static struct malloc_page *set_run(uint32_t index, uint32_t num_pages,
+                                   enum malloc_page_type type) {
+    struct malloc_page *page = &pages[index];
+    page->type = type;
+    page->num_pages = num_pages;
+    pages[index + num_pages - 1].head = index;
+    return page;
+}
 
-    void *new_chunk_ptr =
-        &chunk->data[chunk->capacity + MALLOC_REDZONE_LEN - new_chunk_len];
-    chunk->capacity -= new_chunk_len;
+static void insert_free_run(uint32_t index, uint32_t num_pages) {
+    struct malloc_page *page = set_run(index, num_pages, MALLOC_PAGE_FREE);
+    list_t *bin = &free_runs[run_bin(num_pages)];
+    list_insert(bin, bin->next, &page->next);
+}
 
-    ASSERT(new_chunk_len > MALLOC_FRAME_LEN);
+/// Frees a page run and merges it with free neighbours.
+static void free_run(uint32_t index, uint32_t num_pages) {
+    uint32_t next = index + num_pages;
+    if (next < heap_num_pages && pages[next].type == MALLOC_PAGE_FREE) {
+        list_remove(&pages[next].next);
+        num_pages += pages[next].num_pages;
+        pages[next].type = 0;
+    }
 
-    struct malloc_chunk *new_chunk = new_chunk_ptr;
-    new_chunk->magic = MALLOC_FREE;
-    new_chunk->capacity = len;
-    new_chunk->size = 0;
-    new_chunk->next = NULL;
+    if (index > 0) {
+        uint32_t prev = pages[index - 1].head;
+        if (pages[prev].type == MALLOC_PAGE_FREE) {
+            list_remove(&pages[prev].next);
+            num_pages += pages[prev].num_pages;
+            pages[index].type = 0;
+            index = prev;
+        }
+    }
 
-    return new_chunk;
+    insert_free_run(index, num_pages);
 }
 
-static int get_bin_idx_from_size(size_t size) {
-    // If requested size is less or equal to the size of second largest chunk
-    // (the last fixed chunk).
-    for (size_t i = 0; i < NUM_BINS - 1; i++) {
-        if (size <= 1 << i) {
-            return i;
+/// Allocates `num_pages` contiguous pages.
+static uint32_t alloc_run(uint32_t num_pages, enum malloc_page_type type) {
+    struct malloc_page *found = NULL;
+    for (int i = run_bin(num_pages); i < MALLOC_NUM_RUN_BINS - 1; i++) {
+        if (!list_is_empty(&free_runs[i])) {
+            found = LIST_CONTAINER(free_runs[i].next, struct malloc_page, next);
+            break;
         }
     }
 
-    // Return -1 indicating the last, dynamic-sized chunk
-    return -1;
+    if (!found) {
+        LIST_FOR_EACH (page, &free_runs[MALLOC_NUM_RUN_BINS - 1],
+                       struct malloc_page, next) {
+            if (page->num_pages >= num_pages) {
+                found = page;
+                break;
+            }
+        }
+    }
+
+    if (!found) {
+        PANIC("out of memory");
+    }
+
+    uint32_t index = found - pages;
+    uint32_t found_pages = found->num_pages;
+    list_remove(&found->next);
+    set_run(index, num_pages, type);
+    if (found_pages > num_pages) {
+        // Return the remaining pages. Its neighbours are not free: the run
+        // has already been merged with them.
+        insert_free_run(index + num_pages, found_pages - num_pages);
+    }
+
+    return index;
 }
 
-void *malloc(size_t size) {
+static void *slab_alloc(int class) {
+    list_t *slabs = &partial_slabs[class];
+    struct malloc_page *slab;
+    if (list_is_empty(slabs)) {
+        slab = &pages[alloc_run(1, MALLOC_PAGE_SLAB)];
+        slab->class = class;
+        slab->num_free = PAGE_SIZE / class_sizes[class];
+        slab->unused_offset = 0;
+        slab->free_objs = NULL;
+        list_insert(slabs, slabs->next, &slab->next);
+    } else {
+        slab = LIST_CONTAINER(slabs->next, struct malloc_page, next);
+    }
+
+    void *obj;
+    if (slab->free_objs) {
+        obj = slab->free_objs;
+        slab->free_objs = *((void **) obj);
+    } else {
+        // Objects are carved out lazily not to touch the whole page.
+        obj = (void *) (page_addr(slab) + slab->unused_offset);
+        slab->unused_offset += class_sizes[class];
+    }
+
+    slab->num_free--;
+    if (!slab->num_free) {
+        list_remove(&slab->next);
+    }
+
+    return obj;
+}
+
+static void slab_free(struct malloc_page *slab, void *obj) {
+    *((void **) obj) = slab->free_objs;
+    slab->free_objs = obj;
+    slab->num_free++;
+
+    list_t *slabs = &partial_slabs[slab->class];
+    if (slab->num_free == 1) {
+        list_insert(slabs, slabs->next, &slab->next);
+    } else if (slab->num_free == PAGE_SIZE / class_sizes[slab->class]
+               && slabs->next != slabs->prev) {
+        // The slab is now empty and it's not the last one of the class.
+        list_remove(&slab->next);
+        free_run(slab - pages, 1);
+    }
+}
+
+/// Allocates a block. `site` is the return address of the caller of
+/// `malloc()` and so on.
+static void *malloc_unlocked(size_t size, size_t align, void *site) {
     if (!size) {
         size = 1;
     }
 
-    // Align up to 16-bytes boundary. If the size is less than 16 (including
-    // size == 0), allocate 16 bytes.
-    size = ALIGN_UP(size, 16);
-
-    int bin_idx = get_bin_idx_from_size(size);
-
-    if (bin_idx != -1 && bins[bin_idx] != NULL) {
-        // Check the list corresponding to that size for a free chunk.
-        struct malloc_chunk *allocated = bins[bin_idx];
-        ASSERT(allocated->magic == MALLOC_FREE);
-
-        allocated->magic = MALLOC_IN_USE;
-        allocated->size = size;
-        memset(allocated->underflow_redzone, MALLOC_REDZONE_UNDFLOW_MARKER,
-               MALLOC_REDZONE_LEN);
-        memset(&allocated->data[allocated->capacity],
-               MALLOC_REDZONE_OVRFLOW_MARKER, MALLOC_REDZONE_LEN);
-
-        bins[bin_idx] = allocated->next;
-        allocated->next = NULL;
-        return allocated->data;
-    }
-
-    struct malloc_chunk *prev = NULL;
-    for (struct malloc_chunk *chunk = bins[NUM_BINS - 1]; chunk;
-         chunk = chunk->next) {
-        ASSERT(chunk->magic == MALLOC_FREE);
-
-        struct malloc_chunk *allocated = NULL;
-        size_t chunk_size = bin_idx < 0 ? size : (1 << bin_idx);
-        if (chunk->capacity > chunk_size + MALLOC_FRAME_LEN) {
-            allocated = split(chunk, chunk_size);
-        } else if (chunk->capacity >= chunk_size) {
-            allocated = chunk;
-            // Remove chunk from the linked list.
-            if (prev) {
-                // If it was not at the head of the list.
-                prev->next = chunk->next;
-            } else {
-                // If it was at the head of the list.
-                bins[NUM_BINS - 1] = bins[NUM_BINS - 1]->next;
-            }
+    // Objects in slabs are aligned only to 16 bytes. Allocate pages for a
+    // larger alignment.
+    size_t slot_size = HEADER_LEN + size + REDZONE_LEN;
+    if (align <= 16 && slot_size <= MALLOC_SLAB_MAX) {
+        uint8_t *slot = slab_alloc(size_to_class[(slot_size + 15) / 16]);
+#if HAS_HEADER
+        struct malloc_header *header = (struct malloc_header *) slot;
+        header->size = size;
+        header->site = profile_alloc(site, size);
+#    ifdef CONFIG_BUILD_DEBUG
+        memset(header->underflow_redzone, MALLOC_REDZONE_UNDFLOW_MARKER,
+               sizeof(header->underflow_redzone));
+        fill_overflow_redzone(&slot[sizeof(*header)], size);
+#    endif
+        return &slot[sizeof(*header)];
+#else
+        return slot;
+#endif
+    }
+
+    if (size > (size_t) heap_num_pages * PAGE_SIZE) {
+        PANIC("out of memory");
+    }
+
+    // Large blocks start at the beginning of a page: they have no underflow
+    // redzone.
+    uint32_t num_pages = ALIGN_UP(size + REDZONE_LEN, PAGE_SIZE) / PAGE_SIZE;
+    uint32_t index;
+    if (align <= PAGE_SIZE) {
+        index = alloc_run(num_pages, MALLOC_PAGE_LARGE);
+    } else {
+        // Allocate extra pages and free ones out of the aligned area.
+        uint32_t extra = align / PAGE_SIZE - 1;
+        uint32_t start = alloc_run(num_pages + extra, MALLOC_PAGE_LARGE);
+        index = (ALIGN_UP(page_addr(&pages[start]), align) - heap_base)
+                / PAGE_SIZE;
+        set_run(index, num_pages, MALLOC_PAGE_LARGE);
+
+        uint32_t head_pages = index - start;
+        uint32_t tail_pages = extra - head_pages;
+        if (head_pages) {
+            set_run(start, head_pages, MALLOC_PAGE_LARGE);
+            free_run(start, head_pages);
         }
+        if (tail_pages) {
+            set_run(index + num_pages, tail_pages, MALLOC_PAGE_LARGE);
+            free_run(index + num_pages, tail_pages);
+        }
+    }
+
+    struct malloc_page *page = &pages[index];
+    page->size = size;
+    page->site = profile_alloc(site, size);
+#ifdef CONFIG_BUILD_DEBUG
+    fill_overflow_redzone((uint8_t *) page_addr(page), size);
+#endif
+    return (void *) page_addr(page);
+}
+
+/// Returns the metadata of the page containing `ptr`.
+static struct malloc_page *get_page_from_ptr(void *ptr) {
+    vaddr_t addr = (vaddr_t) ptr;
+    if (addr < heap_base || addr >= heap_base + heap_num_pages * PAGE_SIZE) {
+        PANIC("invalid malloc pointer: ptr=%p", ptr);
+    }
+
+    struct malloc_page *page = &pages[(addr - heap_base) / PAGE_SIZE];
+    switch (page->type) {
+        case MALLOC_PAGE_SLAB:
+            break;
+        case MALLOC_PAGE_LARGE:
+            if (addr != page_addr(page)) {
+                PANIC("invalid malloc pointer: ptr=%p", ptr);
+            }
+            break;
+        default:
+            PANIC("invalid malloc pointer or double-free bug: ptr=%p", ptr);
+    }
+
+    return page;
+}
+
+#if HAS_HEADER
+/// Returns the header of a slab object. In debug builds, it also checks its
+/// redzones.
+static struct malloc_header *get_slab_header(struct malloc_page *slab,
+                                             uint8_t *ptr) {
+    vaddr_t base = page_addr(slab);
+    size_t class_size = class_sizes[slab->class];
+    struct malloc_header *header =
+        (struct malloc_header *) (base
+                                  + ((vaddr_t) ptr - base) / class_size
+                                        * class_size);
+
+#    ifdef CONFIG_BUILD_DEBUG
+    uint64_t magic;
+    memcpy(&magic, header->underflow_redzone, sizeof(magic));
+    if (magic == MALLOC_FREE) {
+        PANIC("double-free bug: ptr=%p", ptr);
+    }
 
-        if (allocated) {
-            allocated->magic = MALLOC_IN_USE;
-            allocated->size = size;
-            memset(allocated->underflow_redzone, MALLOC_REDZONE_UNDFLOW_MARKER,
-                   MALLOC_REDZONE_LEN);
-            memset(&allocated->data[allocated->capacity],
-                   MALLOC_REDZONE_OVRFLOW_MARKER, MALLOC_REDZONE_LEN);
-            allocated->next = NULL;
-            return allocated->data;
+    if (ptr != (uint8_t *) &header[1]) {
+        PANIC("invalid malloc pointer: ptr=%p", ptr);
+    }
+
+    for (size_t i = 0; i < sizeof(header->underflow_redzone); i++) {
+        if (header->underflow_redzone[i] != MALLOC_REDZONE_UNDFLOW_MARKER) {
+            PANIC("detected a malloc buffer underflow: ptr=%p", ptr);
         }
-        prev = chunk;
     }
 
-    PANIC("out of memory");
+    check_overflow_redzone(ptr, header->size);
+#    endif
+    return header;
 }
+#endif
+
+/// Returns the number of bytes available in the block. If blocks have
+/// headers, it returns the requested size instead so that `realloc()` always
+/// moves the block and keeps redzones and profiles consistent.
+static size_t usable_size(struct malloc_page *page, void *ptr) {
+#if HAS_HEADER
+    if (page->type == MALLOC_PAGE_SLAB) {
+        return get_slab_header(page, ptr)->size;
+    }
 
-static struct malloc_chunk *get_chunk_from_ptr(void *ptr) {
-    struct malloc_chunk *chunk =
-        (struct malloc_chunk *) ((uintptr_t) ptr - sizeof(struct malloc_chunk));
+#    ifdef CONFIG_BUILD_DEBUG
+    check_overflow_redzone(ptr, page->size);
+#    endif
+    return page->size;
+#else
+    if (page->type == MALLOC_PAGE_SLAB) {
+        return class_sizes[page->class];
+    }
 
-    // Check its magic and underflow/overflow redzones.
-    ASSERT(chunk->magic == MALLOC_IN_USE);
-    check_buffer_overflow(chunk);
-    return chunk;
+    return page->num_pages * PAGE_SIZE;
+#endif
 }
 
-void free(void *ptr) {
-    if (!ptr) {
+static void free_unlocked(void *ptr) {
+    struct malloc_page *page = get_page_from_ptr(ptr);
+    if (page->type == MALLOC_PAGE_LARGE) {
+#ifdef CONFIG_BUILD_DEBUG
+        check_overflow_redzone(ptr, page->size);
+#endif
+        profile_free(page->site, page->size);
+        free_run(page - pages, page->num_pages);
         return;
     }
-    struct malloc_chunk *chunk = get_chunk_from_ptr(ptr);
-    if (chunk->magic == MALLOC_FREE) {
-        PANIC("double-free bug!");
-    }
 
-    chunk->magic = MALLOC_FREE;
+#if HAS_HEADER
+    struct malloc_header *header = get_slab_header(page, ptr);
+    profile_free(header->site, header->size);
+#    ifdef CONFIG_BUILD_DEBUG
+    uint64_t magic = MALLOC_FREE;
+    memcpy(header->underflow_redzone, &magic, sizeof(magic));
+#    endif
+    ptr = header;
+#endif
+    slab_free(page, ptr);
+}
+
+static void *malloc_at(size_t size, size_t align, void *site) {
+    lock_heap();
+    void *ptr = malloc_unlocked(size, align, site);
+    unlock_heap();
+    return ptr;
+}
 
-    int bin_idx = get_bin_idx_from_size(chunk->capacity);
-    bin_idx = bin_idx < 0 ? NUM_BINS - 1 : bin_idx;
+void *malloc(size_t size) {
+    return malloc_at(size, 16, __builtin_return_address(0));
+}
 
-    struct malloc_chunk *head = bins[bin_idx];
-    if (head) {
-        chunk->next = head;
+/// Allocates a memory block aligned to `align` bytes (a power of two). It
+/// can be freed by `free()`.
+void *aligned_alloc(size_t align, size_t size) {
+    DEBUG_ASSERT(align && (align & (align - 1)) == 0);
+    return malloc_at(size, align, __builtin_return_address(0));
+}
+
+void free(void *ptr) {
+    if (!ptr) {
+        return;
     }
-    bins[bin_idx] = chunk;
+
+    lock_heap();
+    free_unlocked(ptr);
+    unlock_heap();
 }
 
 void *realloc(void *ptr, size_t size) {
@@ -179,30 +463,116 @@ void *realloc(void *ptr, size_t size) {
         return malloc(size);
     }
 
-    struct malloc_chunk *chunk = get_chunk_from_ptr(ptr);
-    size_t prev_size = chunk->size;
-    if (size <= chunk->capacity) {
-        // There's enough room. Keep using the current chunk.
+    lock_heap();
+    size_t capacity = usable_size(get_page_from_ptr(ptr), ptr);
+    unlock_heap();
+
+    if (size <= capacity && !HAS_HEADER) {
+        // There's enough room. Keep using the current block.
         return ptr;
     }
 
     // There's not enough room. Allocate a new space and copy old data.
-    void *new_ptr = malloc(size);
-    memcpy(new_ptr, ptr, prev_size);
+    void *new_ptr = malloc_at(size, 16, __builtin_return_address(0));
+    memcpy(new_ptr, ptr, MIN(size, capacity));
     free(ptr);
     return new_ptr;
 }
 
 char *strndup(const char *s, size_t n) {
-    char *new_s = malloc(n + 1);
+    char *new_s = malloc_at(n + 1, 16, __builtin_return_address(0));
     strncpy2(new_s, s, n + 1);
     return new_s;
 }
 
 char *strdup(const char *s) {
-    return strndup(s, strlen(s));
+    size_t len = strlen(s);
+    char *new_s = malloc_at(len + 1, 16, __builtin_return_address(0));
+    strncpy2(new_s, s, len + 1);
+    return new_s;
+}
+
+/// Prints the heap profile as JSON lines: a `malloc_profile` line followed by
+/// a `malloc_site` line per call site. Use `tools/heap-profile.py` to
+/// symbolize and compare them.
+void malloc_profile_dump(void) {
+#ifdef CONFIG_MALLOC_PROFILE
+    static struct malloc_site snapshot[MALLOC_PROFILE_NUM_SITES];
+    size_t snapshot_histogram[MALLOC_PROFILE_NUM_BUCKETS];
+
+    // Take a snapshot not to print while holding the lock.
+    lock_heap();
+    memcpy(snapshot, sites, sizeof(snapshot));
+    memcpy(snapshot_histogram, histogram, sizeof(snapshot_histogram));
+    size_t live = live_bytes;
+    size_t peak = peak_bytes;
+    unsigned id = ++num_snapshots;
+    unlock_heap();
+
+    uint64_t num_allocs = 0;
+    uint64_t num_frees = 0;
+    for (int i = 0; i < MALLOC_PROFILE_NUM_SITES; i++) {
+        num_allocs += snapshot[i].num_allocs;
+        num_frees += snapshot[i].num_frees;
+    }
+
+    printf("{\"type\":\"malloc_profile\",\"program\":\"%s\","
+           "\"snapshot\":%d,\"live_bytes\":%lld,\"peak_bytes\":%lld,"
+           "\"num_allocs\":%lld,\"num_frees\":%lld,\"histogram\":[",
+           __program_name(), id, (uint64_t) live, (uint64_t) peak, num_allocs,
+           num_frees);
+    for (int i = 0; i < MALLOC_PROFILE_NUM_BUCKETS; i++) {
+        printf("%s%lld", (i > 0) ? "," : "", (uint64_t) snapshot_histogram[i]);
+    }
+    printf("]}\n");
+
+    for (int i = 0; i < MALLOC_PROFILE_NUM_SITES; i++) {
+        struct malloc_site *site = &snapshot[i];
+        if (!site->num_allocs) {
+            continue;
+        }
+
+        printf("{\"type\":\"malloc_site\",\"program\":\"%s\","
+               "\"snapshot\":%d,\"addr\":\"%p\",\"num_allocs\":%lld,"
+               "\"num_frees\":%lld,\"live_bytes\":%lld,"
+               "\"peak_bytes\":%lld}\n",
+               __program_name(), id, (void *) site->addr,
+               (uint64_t) site->num_allocs,
+               (uint64_t) site->num_frees, (uint64_t) site->live_bytes,
+               (uint64_t) site->peak_bytes);
+    }
+#else
+    WARN("malloc profiling is disabled (enable CONFIG_MALLOC_PROFILE)");
+#endif
 }
 
 void malloc_init(void) {
-    insert(__heap, (size_t) __heap_end - (size_t) __heap);
+    int class = 0;
+    for (size_t i = 0; i < sizeof(size_to_class); i++) {
+        while (class_sizes[class] < i * 16) {
+            class++;
+        }
+        size_to_class[i] = class;
+    }
+
+    for (int i = 0; i < MALLOC_NUM_CLASSES; i++) {
+        list_init(&partial_slabs[i]);
+    }
+
+    for (int i = 0; i < MALLOC_NUM_RUN_BINS; i++) {
+        list_init(&free_runs[i]);
+    }
+
+    // Place the page metadata at the beginning of the heap. The heap is
+    // filled with zeroes on demand, i.e. entries for pages not yet used
+    // consume no memory.
+    vaddr_t heap = ALIGN_UP((vaddr_t) __heap, PAGE_SIZE);
+    size_t total_pages =
+        (ALIGN_DOWN((vaddr_t) __heap_end, PAGE_SIZE) - heap) / PAGE_SIZE;
+    size_t meta_len =
+        ALIGN_UP(total_pages * sizeof(struct malloc_page), PAGE_SIZE);
+    pages = (struct malloc_page *) heap;
+    heap_base = heap + meta_len;
+    heap_num_pages = total_pages - meta_len / PAGE_SIZE;
+    insert_free_run(0, heap_num_pages);
 }
@@ -35,7 +35,13 @@ pub struct Message {
 extern "C" {
     pub fn malloc(size: size_t) -> *mut u8;
     pub fn free(ptr: *mut u8);
-    pub fn sys_ipc(dst: task_t, src: task_t, m: *mut Message, flags: c_unsigned) -> error_t;
+    pub fn sys_ipc(
+        dst: task_t,
+        src: task_t,
+        m: *mut Message,
+        flags: c_unsigned,
+        timeout: msec_t,
+    ) -> error_t;
     pub fn sys_notify(dst: task_t, notifications: notifications_t) -> error_t;
     pub fn sys_timer_set(timeout: msec_t) -> error_t;
     pub fn sys_task_create(
@@ -57,6 +63,7 @@ extern "C" {
         flags: c_unsigned,
     ) -> error_t;
     pub fn sys_vm_unmap(task: task_t, vaddr: vaddr_t) -> error_t;
+    pub fn sys_vm_accessed(task: task_t, vaddr: vaddr_t) -> c_int;
     pub fn sys_irq_acquire(irq: c_unsigned) -> error_t;
     pub fn sys_irq_release(irq: c_unsigned) -> error_t;
     pub fn sys_console_write(buf: *const u8, len: size_t) -> error_t;
@@ -3,8 +3,9 @@
 #include <message.h>
 #include <types.h>
 
-error_t sys_ipc(task_t dst, task_t src, struct message *m, unsigned flags) {
-    return syscall(SYS_IPC, dst, src, (uintptr_t) m, flags, 0);
+error_t sys_ipc(task_t dst, task_t src, struct message *m, unsigned flags,
+                msec_t timeout) {
+    return syscall(SYS_IPC, dst, src, (uintptr_t) m, flags, timeout);
 }
 
 error_t sys_notify(task_t dst, notifications_t notifications) {
@@ -20,6 +21,12 @@ task_t sys_task_create(task_t tid, const char *name, vaddr_t ip, task_t pager,
     return syscall(SYS_TASK_CREATE, tid, (uintptr_t) name, ip, pager, flags);
 }
 
+task_t sys_thread_create(task_t tid, const char *name, vaddr_t ip,
+                         vaddr_t sp) {
+    return syscall(SYS_TASK_CREATE, tid, (uintptr_t) name, ip, sp,
+                   TASK_THREAD);
+}
+
 error_t sys_task_destroy(task_t task) {
     return syscall(SYS_TASK_DESTROY, task, 0, 0, 0, 0);
 }
@@ -45,6 +52,10 @@ error_t sys_vm_unmap(task_t task, vaddr_t vaddr) {
     return syscall(SYS_VM_UNMAP, task, vaddr, 0, 0, 0);
 }
 
+int sys_vm_accessed(task_t task, vaddr_t vaddr) {
+    return syscall(SYS_VM_ACCESSED, task, vaddr, 0, 0, 0);
+}
+
 error_t sys_irq_acquire(unsigned irq) {
     return syscall(SYS_IRQ_ACQUIRE, irq, 0, 0, 0, 0);
 }
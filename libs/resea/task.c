@@ -29,6 +29,10 @@ error_t vm_unmap(task_t task, vaddr_t vaddr) {
     return sys_vm_unmap(task, vaddr);
 }
 
+int vm_accessed(task_t task, vaddr_t vaddr) {
+    return sys_vm_accessed(task, vaddr);
+}
+
 error_t task_schedule(task_t task, int priority) {
     return sys_task_schedule(task, priority);
 }
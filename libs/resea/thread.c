@@ -0,0 +1,95 @@
+#include <message.h>
+#include <resea/ipc.h>
+#include <resea/malloc.h>
+#include <resea/printf.h>
+#include <resea/syscall.h>
+#include <resea/task.h>
+#include <resea/thread.h>
+
+/// Per-thread states indexed by the task ID. The main thread does not have
+/// its entry.
+static struct thread threads[CONFIG_NUM_TASKS];
+/// True once the task has created a thread.
+static bool threaded = false;
+
+// Defined in start.S.
+void thread_start(void);
+
+// for sparse
+__noreturn void resea_thread_init(thread_entry_t entry, void *arg);
+
+/// The entry point of threads, called from `thread_start`.
+__noreturn void resea_thread_init(thread_entry_t entry, void *arg) {
+    entry(arg);
+    thread_exit();
+}
+
+/// Creates a thread which shares the address space with the current task and
+/// calls `entry(arg)`. Returns the task ID of the thread on success.
+task_t thread_create(const char *name, thread_entry_t entry, void *arg) {
+    // Allocate a task ID for the thread. The vm server remembers that it
+    // shares the address space with us.
+    struct message m;
+    m.type = TASK_ALLOC_THREAD_MSG;
+    error_t err = ipc_call(VM_TASK, &m);
+    if (err != OK) {
+        return err;
+    }
+
+    ASSERT(m.type == TASK_ALLOC_THREAD_REPLY_MSG);
+    task_t tid = m.task_alloc_thread_reply.task;
+    struct thread *thread = &threads[tid - 1];
+    DEBUG_ASSERT(!thread->in_use);
+
+    // A thread which used the same task ID has already been destroyed: reuse
+    // its stack.
+    if (!thread->stack) {
+        thread->stack = malloc(THREAD_STACK_SIZE);
+    }
+
+    // The receive buffers registered by the previous thread have been
+    // discarded by the vm server.
+    for (unsigned i = 0; i < thread->ool_bufs.num; i++) {
+        free(thread->ool_bufs.ptrs[i]);
+    }
+    thread->ool_bufs.num = 0;
+    thread->in_use = true;
+    threaded = true;
+
+    // Push arguments for `thread_start`.
+    uintptr_t *sp =
+        (uintptr_t *) ((vaddr_t) thread->stack + THREAD_STACK_SIZE);
+    *--sp = (uintptr_t) arg;
+    *--sp = (uintptr_t) entry;
+
+    err = sys_thread_create(tid, name, (vaddr_t) thread_start, (vaddr_t) sp);
+    if (err != OK) {
+        thread->in_use = false;
+        m.type = TASK_FREE_MSG;
+        m.task_free.task = tid;
+        OOPS_OK(ipc_call(VM_TASK, &m));
+        return err;
+    }
+
+    return tid;
+}
+
+/// Exits the current thread. Its stack is kept for a new thread which gets
+/// the same task ID.
+__noreturn void thread_exit(void) {
+    struct thread *thread = thread_current();
+    ASSERT(thread);
+    thread->in_use = false;
+    task_exit();
+}
+
+/// Returns the state of the current thread or NULL if it's the main thread.
+struct thread *thread_current(void) {
+    // Avoid the system call in single-threaded tasks.
+    if (!threaded) {
+        return NULL;
+    }
+
+    struct thread *thread = &threads[task_self() - 1];
+    return thread->in_use ? thread : NULL;
+}
@@ -1,3 +1,4 @@
 name := benchmark
 description := A kernel/userspace benchmark runner
 objs-y := main.o
+boot-deps-y := benchmark_server
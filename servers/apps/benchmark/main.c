@@ -3,6 +3,8 @@
 #include <resea/malloc.h>
 #include <resea/printf.h>
 #include <resea/syscall.h>
+#include <resea/task.h>
+#include <resea/thread.h>
 #include <string.h>
 
 #ifdef __x86_64__
@@ -183,6 +185,156 @@ inline static void end(int i) {
     iters[i].num_exceptions = exception_counter() - iters[i].num_exceptions;
 }
 
+/// The number of sender threads in the fan-in benchmark.
+#define NUM_FANIN_SENDERS 32
+/// The number of task IDs left for tasks spawned at boot. The fan-in benchmark
+/// runs only if CONFIG_NUM_TASKS >= NUM_FANIN_SENDERS + this.
+#define NUM_FANIN_RESERVED_TASKS 16
+/// `benchmark.nop`'s value sent by a sender thread before it exits.
+#define FANIN_SENDER_EXITING 1
+static task_t fanin_receiver;
+static volatile bool fanin_stopping = false;
+
+/// A sender thread in the fan-in benchmark: keeps sending messages to the
+/// main thread until it's stopped.
+static void fanin_sender(__unused void *arg) {
+    struct message m = {.type = BENCHMARK_NOP_MSG};
+    while (!fanin_stopping) {
+        m.benchmark_nop.value = 0;
+        OOPS_OK(ipc_send(fanin_receiver, &m));
+    }
+
+    m.benchmark_nop.value = FANIN_SENDER_EXITING;
+    OOPS_OK(ipc_send(fanin_receiver, &m));
+}
+
+/// Stops the sender threads and waits for their last messages: they exit
+/// right after them.
+static void fanin_stop_senders(task_t *senders, int num_senders) {
+    fanin_stopping = true;
+    for (int i = 0; i < num_senders; i++) {
+        struct message m;
+        do {
+            ASSERT_OK(ipc_recv(senders[i], &m));
+        } while (m.benchmark_nop.value != FANIN_SENDER_EXITING);
+    }
+}
+
+/// Measures closed receives (`ipc_recv(src)`) while many senders are queued
+/// on the receiver, like replies received by busy servers.
+static void fanin_benchmark(void) {
+#if CONFIG_NUM_TASKS < NUM_FANIN_SENDERS + NUM_FANIN_RESERVED_TASKS
+    INFO("IPC fan-in: skipped (needs CONFIG_NUM_TASKS >= %d)",
+         NUM_FANIN_SENDERS + NUM_FANIN_RESERVED_TASKS);
+#else
+    task_t senders[NUM_FANIN_SENDERS];
+    int num_senders = 0;
+    fanin_receiver = task_self();
+    fanin_stopping = false;
+    for (; num_senders < NUM_FANIN_SENDERS; num_senders++) {
+        task_t tid = thread_create("fanin", fanin_sender, NULL);
+        if (IS_ERROR(tid)) {
+            WARN("failed to create a sender thread: %s (try increasing "
+                 "CONFIG_NUM_TASKS)",
+                 err2str(tid));
+            fanin_stop_senders(senders, num_senders);
+            return;
+        }
+
+        senders[num_senders] = tid;
+    }
+
+    // Wait for all senders to get blocked in our sender queue.
+    for (int i = 0; i < num_senders; i++) {
+        struct message m;
+        ASSERT_OK(ipc_recv(senders[i], &m));
+    }
+
+    // Receive from the most recently queued sender first: it's at the tail of
+    // the sender queue.
+    for (int i = 0; i < NUM_ITERS; i++) {
+        struct message m;
+        task_t src = senders[num_senders - 1 - (i % num_senders)];
+        begin(i);
+        ipc_recv(src, &m);
+        end(i);
+        ASSERT(m.type == BENCHMARK_NOP_MSG);
+    }
+
+    fanin_stop_senders(senders, num_senders);
+    INFO("IPC fan-in: %d senders", num_senders);
+    print_stats("IPC fan-in (closed receive)");
+#endif
+}
+
+/// Measures IPC round-trips with a `len`-bytes page-aligned ool payload. vm
+/// copies small payloads and remaps large ones (see
+/// CONFIG_VM_OOL_REMAP_MIN_PAGES).
+static void ool_benchmark(task_t server_task, size_t len) {
+    static uint8_t ool_payload[CONFIG_OOL_BUFFER_LEN] __aligned(PAGE_SIZE) =
+        "This is a ool payload!";
+    char name[64];
+
+    for (int i = 0; i < NUM_ITERS; i++) {
+        struct message m;
+        m.type = BENCHMARK_NOP_WITH_OOL_MSG;
+        m.benchmark_nop_with_ool.data = ool_payload;
+        m.benchmark_nop_with_ool.data_len = len;
+
+        begin(i);
+        ipc_call(server_task, &m);
+        end(i);
+        ASSERT(m.type == BENCHMARK_NOP_WITH_OOL_REPLY_MSG);
+        free(m.benchmark_nop_with_ool_reply.data);
+    }
+
+    snprintf(name, sizeof(name), "IPC round-trip (with %d-bytes ool)", len);
+    print_stats(name);
+}
+
+/// Prints the page allocator benchmark run in vm at boot: it measures
+/// page_alloc() and page_decref() without IPC and mapping overheads.
+static void page_alloc_benchmark(void) {
+#ifdef CONFIG_VM_PAGE_ALLOC_BENCHMARK
+    struct message m;
+    m.type = VM_STATS_MSG;
+    m.vm_stats.task = 0;
+    ASSERT_OK(ipc_call(VM_TASK, &m));
+    INFO("page_alloc (1 page): cycles: avg=%d",
+         m.vm_stats_reply.page_alloc_cycles);
+    INFO("page_decref (1 page): cycles: avg=%d",
+         m.vm_stats_reply.page_free_cycles);
+    INFO("page_alloc (16 pages): cycles: avg=%d",
+         m.vm_stats_reply.page_alloc_16_cycles);
+    INFO("page_decref (16 pages): cycles: avg=%d",
+         m.vm_stats_reply.page_free_16_cycles);
+#else
+    INFO("page_alloc: skipped (needs CONFIG_VM_PAGE_ALLOC_BENCHMARK)");
+#endif
+}
+
+/// Measures the latency of malloc() and free() of `size` bytes.
+static void malloc_benchmark(size_t size) {
+    static void *ptrs[NUM_ITERS];
+    char name[64];
+
+    for (int i = 0; i < NUM_ITERS; i++) {
+        begin(i);
+        ptrs[i] = malloc(size);
+        end(i);
+    }
+    snprintf(name, sizeof(name), "malloc (%d bytes)", size);
+    print_stats(name);
+
+    for (int i = 0; i < NUM_ITERS; i++) {
+        begin(i);
+        free(ptrs[i]);
+        end(i);
+    }
+    snprintf(name, sizeof(name), "free (%d bytes)", size);
+    print_stats(name);
+}
+
 void main(void) {
     INFO("starting IPC benchmark...");
     task_t server_task = ipc_lookup("benchmark_server");
@@ -216,6 +368,14 @@ void main(void) {
     }
     print_stats("memcpy (512-bytes)");
 
+    //
+    //  malloc benchmark
+    //
+    malloc_benchmark(16);
+    malloc_benchmark(256);
+    malloc_benchmark(2000);
+    malloc_benchmark(4 * PAGE_SIZE);
+
     for (int i = 0; i < NUM_ITERS; i++) {
         begin(i);
         syscall(SYS_NOP, 0, 0, 0, 0, 0);
@@ -259,22 +419,38 @@ void main(void) {
     //
     //  IPC round-trip benchmark (with ool payload)
     //
-    for (int i = 0; i < NUM_ITERS; i++) {
-        // Since we don't access the data (ool_payload) to be sent, the kernel
-        // internally handles the page fault on the first message passing. Thus
-        // it should take signficantly long on the first time.
-        static char ool_payload[PAGE_SIZE] = "This is a ool payload!";
+    for (size_t len = PAGE_SIZE; len <= CONFIG_OOL_BUFFER_LEN; len *= 2) {
+        ool_benchmark(server_task, len);
+    }
 
+    //
+    //  Service discovery benchmark
+    //
+    for (int i = 0; i < NUM_ITERS; i++) {
         struct message m;
-        m.type = BENCHMARK_NOP_WITH_OOL_MSG;
-        m.benchmark_nop_with_ool.data = ool_payload;
-        m.benchmark_nop_with_ool.data_len = PAGE_SIZE;
+        m.type = DISCOVERY_LOOKUP_MSG;
+        m.discovery_lookup.name = "benchmark_server";
+        m.discovery_lookup.watch = false;
+        begin(i);
+        ASSERT_OK(ipc_call(VM_TASK, &m));
+        end(i);
+    }
+    print_stats("discovery.lookup");
 
+    for (int i = 0; i < NUM_ITERS; i++) {
         begin(i);
-        ipc_call(server_task, &m);
+        ipc_lookup("benchmark_server");
         end(i);
-        ASSERT(m.type == BENCHMARK_NOP_WITH_OOL_REPLY_MSG);
-        free(m.benchmark_nop_with_ool_reply.data);
     }
-    print_stats("IPC round-trip (with PAGE_SIZE-sized ool)");
+    print_stats("ipc_lookup (cached)");
+
+    //
+    //  Physical memory page allocation benchmark
+    //
+    page_alloc_benchmark();
+
+    //
+    //  IPC fan-in benchmark
+    //
+    fanin_benchmark();
 }
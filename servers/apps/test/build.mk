@@ -1,3 +1,3 @@
 name := test
 description := The integrated tests for kernel and standard library
-objs-y := main.o ipc_test.o libcommon_test.o libresea_test.o unittest_test.o malloc_test.o datetime_test.o shm_test.o
+objs-y := main.o ipc_test.o libcommon_test.o libresea_test.o unittest_test.o malloc_test.o datetime_test.o shm_test.o thread_test.o vm_test.o
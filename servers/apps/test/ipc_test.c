@@ -1,6 +1,7 @@
 #include "test.h"
 #include <resea/ipc.h>
 #include <resea/printf.h>
+#include <resea/task.h>
 #include <string.h>
 
 void ipc_test(void) {
@@ -36,6 +37,18 @@ void ipc_test(void) {
     TEST_ASSERT(err == OK);
     TEST_ASSERT(m.type == BENCHMARK_NOP_WITH_OOL_REPLY_MSG);
 
+    // A receive with timeout: vm never sends a message to us by itself.
+    err = ipc_recv_timeout(VM_TASK, &m, 10);
+    TEST_ASSERT(err == ERR_TIMEOUT);
+
+    // A IPC call with timeout.
+    m.type = BENCHMARK_NOP_MSG;
+    m.benchmark_nop.value = 3;
+    err = ipc_call_timeout(VM_TASK, &m, 1000);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(m.type == BENCHMARK_NOP_REPLY_MSG);
+    TEST_ASSERT(m.benchmark_nop.value == 3 * 7);
+
     // A ool IPC call (with empty payload).
     m.type = BENCHMARK_NOP_WITH_OOL_MSG;
     m.benchmark_nop_with_ool.data = NULL;
@@ -43,4 +56,27 @@ void ipc_test(void) {
     err = ipc_call(VM_TASK, &m);
     TEST_ASSERT(err == OK);
     TEST_ASSERT(m.type == BENCHMARK_NOP_WITH_OOL_REPLY_MSG);
+
+    // Service discovery: a service keeps its ID when it's registered again.
+    m.type = DISCOVERY_SERVE_MSG;
+    m.discovery_serve.name = "ipc_test";
+    err = ipc_call(VM_TASK, &m);
+    TEST_ASSERT(err == OK);
+    int service = m.discovery_serve_reply.service;
+    m.type = DISCOVERY_SERVE_MSG;
+    m.discovery_serve.name = "ipc_test";
+    err = ipc_call(VM_TASK, &m);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(m.discovery_serve_reply.service == service);
+    m.type = DISCOVERY_LOOKUP_MSG;
+    m.discovery_lookup.name = "ipc_test";
+    m.discovery_lookup.watch = false;
+    err = ipc_call(VM_TASK, &m);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(m.discovery_lookup_reply.task == task_self());
+    TEST_ASSERT(m.discovery_lookup_reply.service == service);
+
+    // Repeated lookups return the same result (not cached without the watch).
+    TEST_ASSERT(ipc_lookup("ipc_test") == task_self());
+    TEST_ASSERT(ipc_lookup("ipc_test") == task_self());
 }
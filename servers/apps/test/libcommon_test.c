@@ -1,7 +1,107 @@
 #include "test.h"
+#include <avl.h>
 #include <resea/printf.h>
 #include <string.h>
 
+#define NUM_AVL_ELEMS 64
+
+struct avl_elem {
+    struct avl_node node;
+    int key;
+};
+
+static int compare_avl_elem(struct avl_node *a, struct avl_node *b) {
+    return AVL_CONTAINER(a, struct avl_elem, node)->key
+           - AVL_CONTAINER(b, struct avl_elem, node)->key;
+}
+
+static struct avl_elem *avl_lookup(struct avl_tree *tree, int key) {
+    struct avl_node *node = tree->root;
+    while (node) {
+        struct avl_elem *elem = AVL_CONTAINER(node, struct avl_elem, node);
+        if (elem->key == key) {
+            return elem;
+        }
+
+        node = (key < elem->key) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/// Checks the links, heights, and balance of the subtree. Returns its height.
+static int check_avl_subtree(struct avl_node *node, struct avl_node *parent) {
+    if (!node) {
+        return 0;
+    }
+
+    TEST_ASSERT(node->parent == parent);
+    int left = check_avl_subtree(node->left, node);
+    int right = check_avl_subtree(node->right, node);
+    TEST_ASSERT(node->height == 1 + MAX(left, right));
+    TEST_ASSERT(left - right <= 1 && right - left <= 1);
+    return node->height;
+}
+
+/// Checks that the tree is balanced and contains `num` elements in order.
+static void check_avl_tree(struct avl_tree *tree, int num) {
+    check_avl_subtree(tree->root, NULL);
+
+    int count = 0;
+    int prev_key = -1;
+    for (struct avl_node *node = avl_first(tree); node;
+         node = avl_next(node)) {
+        int key = AVL_CONTAINER(node, struct avl_elem, node)->key;
+        TEST_ASSERT(key > prev_key);
+        prev_key = key;
+        count++;
+    }
+
+    TEST_ASSERT(count == num);
+}
+
+static void avl_test(void) {
+    static struct avl_elem elems[NUM_AVL_ELEMS];
+    struct avl_tree tree;
+    avl_init(&tree);
+    TEST_ASSERT(avl_first(&tree) == NULL);
+
+    // Insert keys in an increasing order, which unbalances a naive binary
+    // search tree the most.
+    for (int i = 0; i < NUM_AVL_ELEMS; i++) {
+        elems[i].key = i * 2;
+        avl_insert(&tree, &elems[i].node, compare_avl_elem);
+        check_avl_tree(&tree, i + 1);
+    }
+
+    // log2(64) + 1 = 7 for a perfectly balanced tree. An AVL tree is at most
+    // ~1.44 times taller.
+    TEST_ASSERT(tree.root->height <= 9);
+    for (int i = 0; i < NUM_AVL_ELEMS; i++) {
+        TEST_ASSERT(avl_lookup(&tree, i * 2) == &elems[i]);
+        TEST_ASSERT(avl_lookup(&tree, i * 2 + 1) == NULL);
+    }
+
+    // Remove every other element, and then the rest.
+    int num = NUM_AVL_ELEMS;
+    for (int i = 0; i < NUM_AVL_ELEMS; i += 2) {
+        avl_remove(&tree, &elems[i].node);
+        check_avl_tree(&tree, --num);
+        TEST_ASSERT(avl_lookup(&tree, i * 2) == NULL);
+    }
+
+    for (int i = 1; i < NUM_AVL_ELEMS; i += 2) {
+        TEST_ASSERT(avl_lookup(&tree, i * 2) == &elems[i]);
+    }
+
+    for (int i = NUM_AVL_ELEMS - 1; i > 0; i -= 2) {
+        avl_remove(&tree, &elems[i].node);
+        check_avl_tree(&tree, --num);
+    }
+
+    TEST_ASSERT(tree.root == NULL);
+}
+
 void libcommon_test(void) {
     TEST_ASSERT(!memcmp("a", "a", 1));
     TEST_ASSERT(!memcmp("a", "b", 0));
@@ -9,4 +109,6 @@ void libcommon_test(void) {
 
     TEST_ASSERT(!strncmp("a", "a", 1));
     TEST_ASSERT(!strncmp("a", "b", 0));
+
+    avl_test();
 }
@@ -18,6 +18,8 @@ void main(void) {
     malloc_test();
     datetime_test();
     shm_test();
+    thread_test();
+    vm_test();
 
     if (failed) {
         WARN("Failed %d tests", failed);
@@ -3,6 +3,8 @@
 #include <resea/printf.h>
 #include <string.h>
 #define NUM_PTRS 16
+#define NUM_ALIGNED_PTRS 4
+#define LARGE_BLOCK_LEN (64 * PAGE_SIZE - MALLOC_REDZONE_LEN)
 
 void malloc_test(void) {
     // malloc_init();
@@ -40,4 +42,35 @@ void malloc_test(void) {
     }
     memset(ptr[NUM_PTRS - 1], 0xaa, (1 << 15) + 8);
     free(ptr[NUM_PTRS - 1]);
+
+    // aligned_alloc
+    for (size_t i = 0; i < NUM_ALIGNED_PTRS; i++) {
+        ptr[i] = aligned_alloc(PAGE_SIZE, PAGE_SIZE * (i + 1));
+        TEST_ASSERT(IS_ALIGNED((vaddr_t) ptr[i], PAGE_SIZE));
+        memset(ptr[i], 0xaa, PAGE_SIZE * (i + 1));
+    }
+
+    for (size_t i = 0; i < NUM_ALIGNED_PTRS; i++) {
+        free(ptr[i]);
+    }
+
+    // A freed object is reused by the next allocation of the same class.
+    void *obj = malloc(100);
+    free(obj);
+    void *obj2 = malloc(100);
+    TEST_ASSERT(obj == obj2);
+    free(obj2);
+
+    // Freed neighbouring large blocks are coalesced into a larger one. Free a
+    // block as large as both first: the most recently freed run is reused
+    // first, so they're carved out of it next to each other.
+    free(malloc(2 * LARGE_BLOCK_LEN));
+    uint8_t *block1 = malloc(LARGE_BLOCK_LEN);
+    uint8_t *block2 = malloc(LARGE_BLOCK_LEN);
+    TEST_ASSERT(block2 == block1 + 64 * PAGE_SIZE);
+    free(block1);
+    free(block2);
+    uint8_t *block3 = malloc(2 * LARGE_BLOCK_LEN);
+    TEST_ASSERT(block3 == block1);
+    free(block3);
 }
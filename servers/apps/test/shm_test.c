@@ -68,7 +68,67 @@ void shm_access_test(void) {
     TEST_ASSERT(strcmp(TEST_DATA, buf) == 0);
 }
 
+void shm_named_test(void) {
+    struct message m;
+    error_t err;
+    // Create a multi-page named shared memory
+    m.type = SHM_CREATE_NAMED_MSG;
+    m.shm_create_named.name = "test_ring";
+    m.shm_create_named.size = PAGE_SIZE * 3;
+    err = ipc_call(INIT_TASK, &m);
+    ASSERT_OK(err);
+    int shm_id = m.shm_create_named_reply.shm_id;
+    // The same name can't be used twice
+    m.type = SHM_CREATE_NAMED_MSG;
+    m.shm_create_named.name = "test_ring";
+    m.shm_create_named.size = PAGE_SIZE;
+    err = ipc_call(INIT_TASK, &m);
+    TEST_ASSERT(err == ERR_ALREADY_EXISTS);
+    // Look for it by the name
+    m.type = SHM_LOOKUP_MSG;
+    m.shm_lookup.name = "test_ring";
+    err = ipc_call(INIT_TASK, &m);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(m.shm_lookup_reply.shm_id == shm_id);
+    // Map it twice: it's mapped at the same address
+    m.type = SHM_MAP_MSG;
+    m.shm_map.shm_id = shm_id;
+    m.shm_map.writable = true;
+    err = ipc_call(INIT_TASK, &m);
+    ASSERT_OK(err);
+    vaddr_t vaddr = m.shm_map_reply.vaddr;
+    m.type = SHM_MAP_MSG;
+    m.shm_map.shm_id = shm_id;
+    m.shm_map.writable = true;
+    err = ipc_call(INIT_TASK, &m);
+    ASSERT_OK(err);
+    TEST_ASSERT(m.shm_map_reply.vaddr == vaddr);
+    // All pages are accessible
+    memset((void *) vaddr, 0xaa, PAGE_SIZE * 3);
+    // Unmap it twice
+    for (int i = 0; i < 2; i++) {
+        m.type = SHM_UNMAP_MSG;
+        m.shm_unmap.shm_id = shm_id;
+        err = ipc_call(INIT_TASK, &m);
+        TEST_ASSERT(err == OK);
+    }
+    m.type = SHM_UNMAP_MSG;
+    m.shm_unmap.shm_id = shm_id;
+    err = ipc_call(INIT_TASK, &m);
+    TEST_ASSERT(err == ERR_NOT_FOUND);
+    // Close it
+    m.type = SHM_CLOSE_MSG;
+    m.shm_close.shm_id = shm_id;
+    err = ipc_call(INIT_TASK, &m);
+    TEST_ASSERT(err == OK);
+    m.type = SHM_LOOKUP_MSG;
+    m.shm_lookup.name = "test_ring";
+    err = ipc_call(INIT_TASK, &m);
+    TEST_ASSERT(err == ERR_NOT_FOUND);
+}
+
 void shm_test(void) {
     shm_util_test();
     shm_access_test();
+    shm_named_test();
 }
@@ -0,0 +1,149 @@
+#include "test.h"
+#include <resea/ipc.h>
+#include <resea/malloc.h>
+#include <resea/printf.h>
+#include <resea/task.h>
+#include <resea/thread.h>
+#include <string.h>
+
+static task_t main_thread;
+static int shared_value = 0;
+
+static void worker(void *arg) {
+    // The thread shares the address space with the main thread.
+    shared_value = *((int *) arg);
+
+    // Touch a new page (handled by the pager in the shared address space).
+    char *buf = malloc(PAGE_SIZE * 2);
+    memset(buf, 0xaa, PAGE_SIZE * 2);
+    free(buf);
+
+    struct message m;
+    m.type = BENCHMARK_NOP_MSG;
+    m.benchmark_nop.value = shared_value + 1;
+    ipc_send(main_thread, &m);
+}
+
+static void endpoint_worker(void *arg) {
+    task_t ep = (task_t) (uintptr_t) arg;
+    while (true) {
+        struct message m;
+        error_t err = ipc_recv(ep, &m);
+        if (err == ERR_ABORTED) {
+            // The endpoint has been destroyed.
+            break;
+        }
+
+        TEST_ASSERT(err == OK);
+        TEST_ASSERT(m.type == BENCHMARK_NOP_MSG);
+        TEST_ASSERT(m.src == main_thread);
+        m.type = BENCHMARK_NOP_REPLY_MSG;
+        m.benchmark_nop_reply.value = m.benchmark_nop.value * 2;
+        ipc_reply(m.src, &m);
+    }
+}
+
+static void endpoint_test(void) {
+    task_t ep = endpoint_create();
+    TEST_ASSERT(IS_OK(ep));
+    if (IS_ERROR(ep)) {
+        return;
+    }
+
+    // Send a message before any workers start receiving from the endpoint.
+    struct message m;
+    m.type = BENCHMARK_NOP_MSG;
+    m.benchmark_nop.value = 1;
+    TEST_ASSERT(ipc_send_noblock(ep, &m) == ERR_WOULD_BLOCK);
+
+    for (int i = 0; i < 2; i++) {
+        task_t tid = thread_create("test_worker", endpoint_worker,
+                                   (void *) (uintptr_t) ep);
+        TEST_ASSERT(IS_OK(tid));
+    }
+
+    // The reply comes from one of the workers.
+    for (int i = 0; i < 8; i++) {
+        m.type = BENCHMARK_NOP_MSG;
+        m.benchmark_nop.value = i;
+        error_t err = ipc_call(ep, &m);
+        TEST_ASSERT(err == OK);
+        TEST_ASSERT(m.type == BENCHMARK_NOP_REPLY_MSG);
+        TEST_ASSERT(m.benchmark_nop_reply.value == i * 2);
+        TEST_ASSERT(m.src != ep && m.src != main_thread);
+    }
+
+    TEST_ASSERT(endpoint_destroy(ep) == OK);
+}
+
+/// As many as the receive buffers registered by `ipc_fill_ool_bufs()`: each
+/// payload is copied into one of them before we receive the message.
+#define NUM_OOL_SENDERS CONFIG_OOL_NUM_BUFS
+
+static void ool_sender(void *arg) {
+    static char payloads[NUM_OOL_SENDERS][16];
+    int i = (int) (uintptr_t) arg;
+    snprintf(payloads[i], sizeof(payloads[i]), "payload #%d", i);
+
+    struct message m;
+    m.type = BENCHMARK_NOP_WITH_OOL_MSG;
+    m.benchmark_nop_with_ool.data = payloads[i];
+    m.benchmark_nop_with_ool.data_len = sizeof(payloads[i]);
+    ipc_send(main_thread, &m);
+}
+
+/// Receives OoL payloads from multiple senders in the reverse order: payloads
+/// are copied into the receive buffers before we receive the messages.
+static void ool_burst_test(void) {
+    // Receive operations register new buffers only after the half of them
+    // have been consumed: fill them up so that all senders get one.
+    ipc_fill_ool_bufs();
+
+    task_t senders[NUM_OOL_SENDERS];
+    for (int i = 0; i < NUM_OOL_SENDERS; i++) {
+        senders[i] =
+            thread_create("ool_sender", ool_sender, (void *) (uintptr_t) i);
+        TEST_ASSERT(IS_OK(senders[i]));
+        if (IS_ERROR(senders[i])) {
+            return;
+        }
+    }
+
+    for (int i = NUM_OOL_SENDERS - 1; i >= 0; i--) {
+        char expected[16];
+        snprintf(expected, sizeof(expected), "payload #%d", i);
+
+        struct message m;
+        error_t err = ipc_recv_timeout(senders[i], &m, 1000);
+        TEST_ASSERT(err == OK);
+        TEST_ASSERT(m.type == BENCHMARK_NOP_WITH_OOL_MSG);
+        if (err == OK && m.type == BENCHMARK_NOP_WITH_OOL_MSG) {
+            TEST_ASSERT(!strcmp(m.benchmark_nop_with_ool.data, expected));
+            free(m.benchmark_nop_with_ool.data);
+        }
+    }
+}
+
+void thread_test(void) {
+    main_thread = task_self();
+
+    int value = 123;
+    task_t tid = thread_create("test_thread", worker, &value);
+    TEST_ASSERT(IS_OK(tid));
+    if (IS_ERROR(tid)) {
+        return;
+    }
+
+    TEST_ASSERT(tid != main_thread);
+    TEST_ASSERT(thread_current() == NULL);
+
+    struct message m;
+    error_t err = ipc_recv_timeout(tid, &m, 1000);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(m.type == BENCHMARK_NOP_MSG);
+    TEST_ASSERT(m.benchmark_nop.value == 124);
+    TEST_ASSERT(shared_value == 123);
+
+    endpoint_test();
+    ool_burst_test();
+}
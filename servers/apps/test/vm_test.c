@@ -0,0 +1,144 @@
+#include <resea/ipc.h>
+#include <resea/printf.h>
+#include <resea/task.h>
+#include "test.h"
+
+#define NUM_PAGES 16
+
+/// Not yet touched: pages are filled on page faults. Volatile to prevent the
+/// compiler from assuming its contents.
+static volatile uint8_t zeroed_buf[NUM_PAGES * PAGE_SIZE] __aligned(PAGE_SIZE);
+
+static void zero_pool_test(void) {
+    struct message m;
+    m.type = VM_STATS_MSG;
+    m.vm_stats.task = 0;
+    ASSERT_OK(ipc_call(INIT_TASK, &m));
+    size_t hits = m.vm_stats_reply.zero_pool_hits;
+    size_t misses = m.vm_stats_reply.zero_pool_misses;
+
+    // Pages from the pool or zero-filled synchronously must be zeroed.
+    bool zeroed = true;
+    for (size_t i = 0; i < sizeof(zeroed_buf); i++) {
+        if (zeroed_buf[i]) {
+            zeroed = false;
+        }
+    }
+    TEST_ASSERT(zeroed);
+
+    m.type = VM_STATS_MSG;
+    m.vm_stats.task = 0;
+    ASSERT_OK(ipc_call(INIT_TASK, &m));
+    TEST_ASSERT(m.vm_stats_reply.zero_pool_hits
+                    + m.vm_stats_reply.zero_pool_misses
+                >= hits + misses + NUM_PAGES);
+}
+
+static vaddr_t alloc_pages(size_t num_pages, unsigned flags) {
+    struct message m;
+    m.type = VM_ALLOC_PAGES_MSG;
+    m.vm_alloc_pages.num_pages = num_pages;
+    m.vm_alloc_pages.paddr = 0;
+    m.vm_alloc_pages.flags = flags;
+    ASSERT_OK(ipc_call(INIT_TASK, &m));
+    return m.vm_alloc_pages_reply.vaddr;
+}
+
+static void free_pages(vaddr_t vaddr) {
+    struct message m;
+    m.type = VM_FREE_PAGES_MSG;
+    m.vm_free_pages.vaddr = vaddr;
+    ASSERT_OK(ipc_call(INIT_TASK, &m));
+}
+
+static void free_pages_test(void) {
+    vaddr_t a = alloc_pages(2, 0);
+    vaddr_t b = alloc_pages(1, 0);
+    TEST_ASSERT(a && b && a != b);
+
+    // A freed virtual address range is reused.
+    free_pages(a);
+    vaddr_t c = alloc_pages(1, 0);
+    vaddr_t d = alloc_pages(1, 0);
+    TEST_ASSERT(c == a);
+    TEST_ASSERT(d == a + PAGE_SIZE);
+
+    // A range can be freed only once.
+    struct message m;
+    m.type = VM_FREE_PAGES_MSG;
+    m.vm_free_pages.vaddr = b;
+    TEST_ASSERT(ipc_call(INIT_TASK, &m) == OK);
+    m.type = VM_FREE_PAGES_MSG;
+    m.vm_free_pages.vaddr = b;
+    TEST_ASSERT(ipc_call(INIT_TASK, &m) == ERR_NOT_FOUND);
+
+    free_pages(c);
+    free_pages(d);
+}
+
+static void large_pages_test(void) {
+    // It falls back to normal pages if large pages are not available.
+    size_t num_pages = LARGE_PAGE_SIZE / PAGE_SIZE + 1;
+    volatile uint8_t *buf =
+        (volatile uint8_t *) alloc_pages(num_pages, VM_ALLOC_LARGE);
+    TEST_ASSERT(buf != NULL);
+
+    size_t len = num_pages * PAGE_SIZE;
+    buf[0] = 0xaa;
+    buf[LARGE_PAGE_SIZE - 1] = 0xbb;
+    buf[len - 1] = 0xcc;
+    TEST_ASSERT(buf[0] == 0xaa);
+    TEST_ASSERT(buf[LARGE_PAGE_SIZE - 1] == 0xbb);
+    TEST_ASSERT(buf[len - 1] == 0xcc);
+    free_pages((vaddr_t) buf);
+
+    // The freed area is reusable.
+    vaddr_t a = alloc_pages(1, 0);
+    TEST_ASSERT(a != 0);
+    free_pages(a);
+}
+
+static void get_task_stats(struct message *m) {
+    m->type = VM_STATS_MSG;
+    m->vm_stats.task = task_self();
+    ASSERT_OK(ipc_call(INIT_TASK, m));
+}
+
+static error_t set_limit(task_t task, size_t max_pages) {
+    struct message m;
+    m.type = VM_SET_LIMIT_MSG;
+    m.vm_set_limit.task = task;
+    m.vm_set_limit.max_pages = max_pages;
+    return ipc_call(INIT_TASK, &m);
+}
+
+static void memory_limit_test(void) {
+    // A task can't lift (or set) its own limit.
+    TEST_ASSERT(set_limit(task_self(), 0) == ERR_NOT_PERMITTED);
+
+    // The test task is privileged (CONFIG_VM_PRIVILEGED_TASKS): it can set
+    // the limit of another task.
+    struct message m;
+    task_t server = ipc_lookup("shm_test_server");
+    m.type = VM_STATS_MSG;
+    m.vm_stats.task = server;
+    ASSERT_OK(ipc_call(INIT_TASK, &m));
+    size_t used =
+        m.vm_stats_reply.resident_pages + m.vm_stats_reply.page_table_pages;
+    TEST_ASSERT(set_limit(server, used + 2) == OK);
+    m.type = VM_STATS_MSG;
+    m.vm_stats.task = server;
+    ASSERT_OK(ipc_call(INIT_TASK, &m));
+    TEST_ASSERT(m.vm_stats_reply.max_pages == used + 2);
+    TEST_ASSERT(set_limit(server, 0) == OK);
+
+    get_task_stats(&m);
+    TEST_ASSERT(m.vm_stats_reply.max_pages == 0);
+}
+
+void vm_test(void) {
+    zero_pool_test();
+    free_pages_test();
+    large_pages_test();
+    memory_limit_test();
+}
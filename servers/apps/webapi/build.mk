@@ -1,3 +1,4 @@
 name := webapi
 description := A WebAPI server
 objs-y := main.o
+boot-deps-y := tcpip
@@ -2,3 +2,4 @@ name := e1000
 description := Intel e1000 network device driver
 objs-y := main.o e1000.o
 libs-y := driver
+boot-deps-y := dm tcpip
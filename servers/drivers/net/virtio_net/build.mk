@@ -2,3 +2,4 @@ name := virtio_net
 description := A virtio-net network device driver
 objs-y := main.o
 libs-y := virtio driver
+boot-deps-y := tcpip
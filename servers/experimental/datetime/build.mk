@@ -1,3 +1,4 @@
 name := datetime
 description := Datetime management server
 objs-y := main.o
+boot-deps-y := rtc
@@ -2,3 +2,4 @@ name := hdaudio
 description := Intel HD Audio Driver
 objs-y := main.o hdaudio.o
 libs-y := driver
+boot-deps-y := dm
@@ -1,3 +1,4 @@
 name := fatfs
 description := A FAT file system driver
 objs-y := main.o fat.o
+boot-deps-y := disk
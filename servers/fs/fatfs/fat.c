@@ -5,12 +5,16 @@
 #include <string.h>
 
 error_t fat_probe(struct fat *fs,
-                  void (*blk_read)(size_t offset, void *buf, size_t len),
-                  void (*blk_write)(size_t offset, const void *buf,
-                                    size_t len)) {
+                  error_t (*blk_read)(offset_t sector, void *buf,
+                                      size_t num_sectors),
+                  error_t (*blk_write)(offset_t sector, const void *buf,
+                                       size_t num_sectors)) {
     struct bpb bpb;
     STATIC_ASSERT(sizeof(bpb) == SECTOR_SIZE);
-    blk_read(0, &bpb, 1);
+    error_t err = blk_read(0, &bpb, 1);
+    if (IS_ERROR(err)) {
+        return err;
+    }
 
     if (bpb.sector_size != SECTOR_SIZE) {
         WARN("unexpected sector size: %d (expected to be %d)", bpb.sector_size,
@@ -136,7 +140,9 @@ static offset_t cluster2lba(struct fat *fs, cluster_t cluster) {
     return (((cluster - 2) * fs->sectors_per_cluster) + fs->data_lba);
 }
 
-static offset_t get_next_cluster(struct fat *fs, cluster_t cluster) {
+/// Reads the FAT entry of `cluster` into `next`.
+static error_t get_next_cluster(struct fat *fs, cluster_t cluster,
+                                cluster_t *next) {
     DEBUG_ASSERT(cluster >= 2);
     size_t fat_ent_size, entries_per_sector;
     switch (fs->type) {
@@ -147,16 +153,22 @@ static offset_t get_next_cluster(struct fat *fs, cluster_t cluster) {
     }
 
     uint8_t buf[SECTOR_SIZE];
-    fs->blk_read(fs->fat_lba + (cluster / entries_per_sector), &buf, 1);
+    error_t err =
+        fs->blk_read(fs->fat_lba + (cluster / entries_per_sector), &buf, 1);
+    if (IS_ERROR(err)) {
+        return err;
+    }
 
     switch (fs->type) {
         case FAT16: {
-            return ((uint16_t *) buf)[cluster % entries_per_sector];
+            *next = ((uint16_t *) buf)[cluster % entries_per_sector];
+            return OK;
         }
     }
 }
 
-static offset_t alloc_cluster(struct fat *fs) {
+/// Looks for a free cluster and stores it into `cluster`.
+static error_t alloc_cluster(struct fat *fs, cluster_t *cluster) {
     size_t fat_ent_size, entries_per_sector;
     switch (fs->type) {
         case FAT16:
@@ -169,7 +181,11 @@ static offset_t alloc_cluster(struct fat *fs) {
     for (size_t i = 0; i < fs->sectors_per_fat; i++) {
         __aligned(4) uint8_t buf[SECTOR_SIZE];
 
-        fs->blk_read(fs->fat_lba + i, &buf, 1);
+        error_t err = fs->blk_read(fs->fat_lba + i, &buf, 1);
+        if (IS_ERROR(err)) {
+            return err;
+        }
+
         switch (fs->type) {
             case FAT16: {
                 uint16_t *table = (uint16_t *) buf;
@@ -177,7 +193,8 @@ static offset_t alloc_cluster(struct fat *fs) {
                 for (size_t j = 0; j < entries_per_sector; j++) {
                     if (*table == 0) {
                         DBG("alloc = %d", i * entries_per_sector + j);
-                        return i * entries_per_sector + j;
+                        *cluster = i * entries_per_sector + j;
+                        return OK;
                     }
                 }
                 break;
@@ -189,7 +206,7 @@ static offset_t alloc_cluster(struct fat *fs) {
     PANIC("run out of free clusters");
 }
 
-static void open_root_dir(struct fat *fs, struct fat_dir *dir) {
+static error_t open_root_dir(struct fat *fs, struct fat_dir *dir) {
     offset_t lba;
     switch (fs->type) {
         case FAT16:
@@ -202,46 +219,72 @@ static void open_root_dir(struct fat *fs, struct fat_dir *dir) {
 
     dir->entries = malloc(fs->sectors_per_cluster * SECTOR_SIZE);
     dir->index = 0;
-    fs->blk_read(lba, dir->entries, fs->sectors_per_cluster);
+    error_t err = fs->blk_read(lba, dir->entries, fs->sectors_per_cluster);
+    if (IS_ERROR(err)) {
+        free(dir->entries);
+        return err;
+    }
+
+    return OK;
 }
 
-static void opendir_from_dirent(struct fat *fs, struct fat_dir *dir,
-                                struct fat_dirent *e) {
+static error_t opendir_from_dirent(struct fat *fs, struct fat_dir *dir,
+                                   struct fat_dirent *e) {
     dir->cluster = get_cluster_from_entry(e);
     dir->entries = malloc(fs->sectors_per_cluster * SECTOR_SIZE);
     dir->index = 0;
-    fs->blk_read(cluster2lba(fs, dir->cluster), dir->entries,
-                 fs->sectors_per_cluster);
+    error_t err = fs->blk_read(cluster2lba(fs, dir->cluster), dir->entries,
+                               fs->sectors_per_cluster);
+    if (IS_ERROR(err)) {
+        free(dir->entries);
+        return err;
+    }
+
+    return OK;
 }
 
 /// Looks for the file from the root directory.
-static struct fat_dirent *lookup(struct fat *fs, const char *path) {
+static error_t lookup(struct fat *fs, const char *path,
+                      struct fat_dirent **entry) {
     char *p = (char *) path;
     if (*p == '/') {
         p++;
     }
 
     struct fat_dir dir;
-    open_root_dir(fs, &dir);
+    error_t err = open_root_dir(fs, &dir);
+    if (IS_ERROR(err)) {
+        return err;
+    }
+
     while (1) {
         char name[9];
         char ext[4];
         p = get_next_filename(p, (char *) name, (char *) ext);
         while (1) {
-            struct fat_dirent *e = fat_readdir(fs, &dir);
+            struct fat_dirent *e;
+            err = fat_readdir(fs, &dir, &e);
+            if (IS_ERROR(err)) {
+                return err;
+            }
+
             if (!e) {
                 // No such a file.
-                return NULL;
+                return ERR_NOT_FOUND;
             }
 
             if (filename_equals(e, (const char *) name, (const char *) ext)) {
                 if (!p) {
                     // Found the file!
-                    return e;
+                    *entry = e;
+                    return OK;
                 }
 
                 // Enter the next directory level.
-                opendir_from_dirent(fs, &dir, e);
+                err = opendir_from_dirent(fs, &dir, e);
+                if (IS_ERROR(err)) {
+                    return err;
+                }
                 break;
             }
         }
@@ -249,9 +292,10 @@ static struct fat_dirent *lookup(struct fat *fs, const char *path) {
 }
 
 error_t fat_open(struct fat *fs, struct fat_file *file, const char *path) {
-    struct fat_dirent *e = lookup(fs, path);
-    if (!e) {
-        return ERR_NOT_FOUND;
+    struct fat_dirent *e;
+    error_t err = lookup(fs, path, &e);
+    if (IS_ERROR(err)) {
+        return err;
     }
 
     file->cluster = get_cluster_from_entry(e);
@@ -267,7 +311,8 @@ error_t fat_truncate(struct fat *fs, struct fat_file *file, offset_t offset) {
 
 error_t fat_create(struct fat *fs, struct fat_file *file, const char *path,
                    bool exist_ok) {
-    if (fat_open(fs, file, path) == OK) {
+    error_t err = fat_open(fs, file, path);
+    if (err == OK) {
         // The file already exists.
         if (!exist_ok) {
             return ERR_ALREADY_EXISTS;
@@ -276,6 +321,10 @@ error_t fat_create(struct fat *fs, struct fat_file *file, const char *path,
         return fat_truncate(fs, file, 0);
     }
 
+    if (err != ERR_NOT_FOUND) {
+        return err;
+    }
+
     // The file does not exist. Create a new dir entry.
     NYI();
     return OK;
@@ -290,8 +339,12 @@ int fat_read(struct fat *fs, struct fat_file *file, offset_t off, void *buf,
     // Traverse the FAT table until the target cluster.
     cluster_t current = file->cluster;
     size_t nth_cluster = off / (fs->sectors_per_cluster * SECTOR_SIZE);
+    error_t err;
     while (nth_cluster > 0) {
-        current = get_next_cluster(fs, current);
+        if (IS_ERROR(err = get_next_cluster(fs, current, &current))) {
+            return err;
+        }
+
         if (is_end_of_cluster(fs, current)) {
             return 0;
         }
@@ -308,7 +361,11 @@ int fat_read(struct fat *fs, struct fat_file *file, offset_t off, void *buf,
         for (offset_t i = sector_offset; i < fs->sectors_per_cluster; i++) {
             // Use a temporary buffer to support unaligned read operations.
             uint8_t buf[SECTOR_SIZE];
-            fs->blk_read(cluster2lba(fs, current) + i, buf, 1);
+            err = fs->blk_read(cluster2lba(fs, current) + i, buf, 1);
+            if (IS_ERROR(err)) {
+                return err;
+            }
+
             size_t copy_len = MIN(file->size, MIN(remaining, SECTOR_SIZE));
             memcpy(p, &buf[off_in_cluster], copy_len);
 
@@ -321,7 +378,10 @@ int fat_read(struct fat *fs, struct fat_file *file, offset_t off, void *buf,
         }
 
         off_in_cluster = 0;
-        current = get_next_cluster(fs, current);
+        if (IS_ERROR(err = get_next_cluster(fs, current, &current))) {
+            return err;
+        }
+
         if (is_end_of_cluster(fs, current)) {
             return len - remaining;
         }
@@ -339,10 +399,15 @@ int fat_write(struct fat *fs, struct fat_file *file, offset_t off,
     // Traverse the FAT table until the target cluster.
     cluster_t current = file->cluster;
     size_t nth_cluster = off / (fs->sectors_per_cluster * SECTOR_SIZE);
+    error_t err;
     while (nth_cluster > 0) {
-        current = get_next_cluster(fs, current);
-        if (is_end_of_cluster(fs, current)) {
-            current = alloc_cluster(fs);
+        if (IS_ERROR(err = get_next_cluster(fs, current, &current))) {
+            return err;
+        }
+
+        if (is_end_of_cluster(fs, current)
+            && IS_ERROR(err = alloc_cluster(fs, &current))) {
+            return err;
         }
 
         ASSERT(is_valid_cluster(fs, current));
@@ -358,9 +423,16 @@ int fat_write(struct fat *fs, struct fat_file *file, offset_t off,
             // Use a temporary buffer to support unaligned read operations.
             size_t copy_len = MIN(file->size, MIN(remaining, SECTOR_SIZE));
             uint8_t buf[SECTOR_SIZE];
-            fs->blk_read(cluster2lba(fs, current) + i, buf, 1);
+            err = fs->blk_read(cluster2lba(fs, current) + i, buf, 1);
+            if (IS_ERROR(err)) {
+                return err;
+            }
+
             memcpy(&buf[off_in_cluster], p, copy_len);
-            fs->blk_write(cluster2lba(fs, current) + i, buf, 1);
+            err = fs->blk_write(cluster2lba(fs, current) + i, buf, 1);
+            if (IS_ERROR(err)) {
+                return err;
+            }
 
             if (remaining <= SECTOR_SIZE) {
                 return copy_len;
@@ -371,9 +443,13 @@ int fat_write(struct fat *fs, struct fat_file *file, offset_t off,
         }
 
         off_in_cluster = 0;
-        current = get_next_cluster(fs, current);
-        if (is_end_of_cluster(fs, current)) {
-            current = alloc_cluster(fs);
+        if (IS_ERROR(err = get_next_cluster(fs, current, &current))) {
+            return err;
+        }
+
+        if (is_end_of_cluster(fs, current)
+            && IS_ERROR(err = alloc_cluster(fs, &current))) {
+            return err;
         }
 
         ASSERT(is_valid_cluster(fs, current));
@@ -382,48 +458,65 @@ int fat_write(struct fat *fs, struct fat_file *file, offset_t off,
 
 error_t fat_opendir(struct fat *fs, struct fat_dir *dir, const char *path) {
     if (!strcmp(path, "/")) {
-        open_root_dir(fs, dir);
-        return OK;
+        return open_root_dir(fs, dir);
     }
 
-    struct fat_dirent *e = lookup(fs, path);
-    if (!e) {
-        return ERR_NOT_FOUND;
+    struct fat_dirent *e;
+    error_t err = lookup(fs, path, &e);
+    if (IS_ERROR(err)) {
+        return err;
     }
 
-    opendir_from_dirent(fs, dir, e);
-    return OK;
+    return opendir_from_dirent(fs, dir, e);
 }
 
 void fat_closedir(struct fat *fs, struct fat_dir *dir) {
     free(dir->entries);
 }
 
-struct fat_dirent *fat_readdir(struct fat *fs, struct fat_dir *dir) {
+/// Reads the next directory entry into `entry`. It's set to NULL at the end
+/// of the directory.
+error_t fat_readdir(struct fat *fs, struct fat_dir *dir,
+                    struct fat_dirent **entry) {
+    *entry = NULL;
+    int num_entries =
+        (fs->sectors_per_cluster * SECTOR_SIZE) / sizeof(struct fat_dirent);
+    if (dir->index == num_entries) {
+        // Read the next cluster. It's done here instead of right after
+        // consuming the last entry so that the entry we've returned is not
+        // overwritten.
+        cluster_t next;
+        error_t err = get_next_cluster(fs, dir->cluster, &next);
+        if (IS_ERROR(err)) {
+            return err;
+        }
+
+        if (!next) {
+            dir->index = -1;
+            return OK;
+        }
+
+        err = fs->blk_read(cluster2lba(fs, next), dir->entries,
+                           fs->sectors_per_cluster);
+        if (IS_ERROR(err)) {
+            return err;
+        }
+
+        dir->cluster = next;
+        dir->index = 0;
+    }
+
     if (dir->index < 0) {
-        return NULL;
+        return OK;
     }
 
     struct fat_dirent *e = &dir->entries[dir->index];
     if (!e->name[0]) {
         dir->index = -1;
-        return NULL;
+        return OK;
     }
 
     dir->index++;
-    int num_entries =
-        (fs->sectors_per_cluster * SECTOR_SIZE) / sizeof(struct fat_dirent);
-    if (dir->index == num_entries) {
-        // Read the next cluster.
-        dir->cluster = get_next_cluster(fs, dir->cluster);
-        if (dir->cluster) {
-            dir->index = 0;
-            fs->blk_read(cluster2lba(fs, dir->cluster), dir->entries,
-                         fs->sectors_per_cluster);
-        } else {
-            dir->index = -1;
-        }
-    }
-
-    return e;
+    *entry = e;
+    return OK;
 }
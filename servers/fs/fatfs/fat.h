@@ -20,8 +20,9 @@ struct fat {
     cluster_t root_dir_lba;
     offset_t data_lba;
 
-    void (*blk_read)(offset_t sector, void *buf, size_t num_sectors);
-    void (*blk_write)(offset_t sector, const void *buf, size_t num_sectors);
+    error_t (*blk_read)(offset_t sector, void *buf, size_t num_sectors);
+    error_t (*blk_write)(offset_t sector, const void *buf,
+                         size_t num_sectors);
 };
 
 struct fat_file {
@@ -97,10 +98,10 @@ struct fat_dirent {
 } __packed;
 
 error_t fat_probe(struct fat *fs,
-                  void (*blk_read)(offset_t sector, void *buf,
-                                   size_t num_sectors),
-                  void (*blk_write)(offset_t sector, const void *buf,
-                                    size_t num_sectors));
+                  error_t (*blk_read)(offset_t sector, void *buf,
+                                      size_t num_sectors),
+                  error_t (*blk_write)(offset_t sector, const void *buf,
+                                       size_t num_sectors));
 error_t fat_open(struct fat *fs, struct fat_file *file, const char *path);
 error_t fat_create(struct fat *fs, struct fat_file *file, const char *path,
                    bool exist_ok);
@@ -110,6 +111,7 @@ int fat_write(struct fat *fs, struct fat_file *file, offset_t off,
               const void *buf, size_t len);
 error_t fat_opendir(struct fat *fs, struct fat_dir *dir, const char *path);
 void fat_closedir(struct fat *fs, struct fat_dir *dir);
-struct fat_dirent *fat_readdir(struct fat *fs, struct fat_dir *dir);
+error_t fat_readdir(struct fat *fs, struct fat_dir *dir,
+                    struct fat_dirent **entry);
 
 #endif
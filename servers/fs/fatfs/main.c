@@ -5,28 +5,45 @@
 #include <resea/printf.h>
 #include <string.h>
 
+/// The maximum time to wait for the disk driver in milliseconds.
+#define BLK_TIMEOUT 5000
+
 static task_t ramdisk_server;
 
-void blk_read(size_t sector, void *buf, size_t num_sectors) {
+/// Reads sectors from the disk. Returns ERR_TIMEOUT if the disk driver does
+/// not respond: it's passed back to the client instead of killing the server.
+error_t blk_read(offset_t sector, void *buf, size_t num_sectors) {
     struct message m;
     m.type = BLK_READ_MSG;
     m.blk_read.sector = sector;
     m.blk_read.num_sectors = num_sectors;
-    error_t err = ipc_call(ramdisk_server, &m);
-    ASSERT(IS_OK(err));
+    error_t err = ipc_call_timeout(ramdisk_server, &m, BLK_TIMEOUT);
+    if (IS_ERROR(err)) {
+        WARN_DBG("failed to read sector %lld: %s", sector, err2str(err));
+        return err;
+    }
+
     ASSERT(m.type == BLK_READ_REPLY_MSG);
     memcpy(buf, m.blk_read_reply.data, m.blk_read_reply.data_len);
+    return OK;
 }
 
-void blk_write(size_t sector, const void *buf, size_t num_sectors) {
+/// Writes sectors into the disk. Returns ERR_TIMEOUT if the disk driver does
+/// not respond.
+error_t blk_write(offset_t sector, const void *buf, size_t num_sectors) {
     struct message m;
     m.type = BLK_WRITE_MSG;
     m.blk_write.sector = sector;
     m.blk_write.data = (void *) buf;
     m.blk_write.data_len = num_sectors * SECTOR_SIZE;
-    error_t err = ipc_call(ramdisk_server, &m);
-    ASSERT(IS_OK(err));
+    error_t err = ipc_call_timeout(ramdisk_server, &m, BLK_TIMEOUT);
+    if (IS_ERROR(err)) {
+        WARN_DBG("failed to write sector %lld: %s", sector, err2str(err));
+        return err;
+    }
+
     ASSERT(m.type == BLK_WRITE_REPLY_MSG);
+    return OK;
 }
 
 void main(void) {
@@ -45,7 +62,7 @@ void main(void) {
     struct fat_dirent *e;
     char tmp[12];
     ASSERT_OK(fat_opendir(&fs, &dir, "/"));
-    while ((e = fat_readdir(&fs, &dir)) != NULL) {
+    while (IS_OK(fat_readdir(&fs, &dir, &e)) && e != NULL) {
         strncpy2(tmp, (const char *) e->name, sizeof(tmp));
         DBG("/%s", tmp);
     }
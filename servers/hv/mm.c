@@ -284,6 +284,7 @@ static void *alloc_page(struct guest *guest, size_t num_pages, gpaddr_t gpaddr,
     struct message m;
     m.type = VM_ALLOC_PAGES_MSG;
     m.vm_alloc_pages.paddr = 0;
+    m.vm_alloc_pages.flags = 0;
     m.vm_alloc_pages.num_pages = num_pages;
     error_t err = ipc_call(VM_TASK, &m);
     ASSERT_OK(err);
@@ -2,6 +2,7 @@ name := minlin
 description := A Linux ABI emulation layer
 objs-y := main.o proc.o mm.o fs.o tty.o syscall.o waitqueue.o
 libs-y := driver
+boot-deps-y := fs
 
 $(BUILD_DIR)/minlin.tar:
 	mkdir -p $(BUILD_DIR)
@@ -5,6 +5,9 @@
 #include <resea/malloc.h>
 #include <string.h>
 
+/// The maximum time to wait for the file system server in milliseconds.
+#define FS_TIMEOUT 5000
+
 static task_t fs_server;
 
 extern struct file_ops dummy_file_ops;
@@ -69,7 +72,7 @@ static errno_t driver_open(struct file *file, const char *path, int flags,
     struct message m;
     m.type = FS_OPEN_MSG;
     m.fs_open.path = (char *) path;
-    error_t err = ipc_call(fs_server, &m);
+    error_t err = ipc_call_timeout(fs_server, &m, FS_TIMEOUT);
     if (IS_ERROR(err)) {
         return -EDOM;  // FIXME: Convert error_t to errno_t.
     }
@@ -87,7 +90,7 @@ static ssize_t driver_read(struct file *file, uint8_t *buf, size_t len) {
     m.fs_read.handle = file->inode->handle;
     m.fs_read.offset = file->pos;
     m.fs_read.len = len;
-    error_t err = ipc_call(fs_server, &m);
+    error_t err = ipc_call_timeout(fs_server, &m, FS_TIMEOUT);
     if (IS_ERROR(err)) {
         return -EDOM;  // FIXME: Convert error_t to errno_t.
     }
@@ -103,7 +106,7 @@ int driver_stat(const char *path, struct stat *stat) {
     struct message m;
     m.type = FS_STAT_MSG;
     m.fs_stat.path = (char *) path;
-    error_t err = ipc_call(fs_server, &m);
+    error_t err = ipc_call_timeout(fs_server, &m, FS_TIMEOUT);
     if (IS_ERROR(err)) {
         return -ENOENT;  // FIXME: Convert error_t to errno_t.
     }
@@ -87,7 +87,10 @@ void main(void) {
                 error_t err = handle_page_fault(proc, m.page_fault.vaddr,
                                                 m.page_fault.fault);
                 if (err == OK) {
+                    // We've mapped the page by ourselves.
                     m.type = PAGE_FAULT_REPLY_MSG;
+                    m.page_fault_reply.num_pages = 0;
+                    m.page_fault_reply.kpage = 0;
                     ipc_reply(proc->task, &m);
                 }
 
@@ -22,6 +22,7 @@ struct mchunk *mm_alloc_mchunk(struct mm *mm, vaddr_t vaddr, size_t len) {
     struct message m;
     m.type = VM_ALLOC_PAGES_MSG;
     m.vm_alloc_pages.paddr = 0;
+    m.vm_alloc_pages.flags = 0;
     m.vm_alloc_pages.num_pages = len / PAGE_SIZE;
     error_t err = ipc_call(VM_TASK, &m);
     ASSERT_OK(err);
@@ -39,6 +39,67 @@ static void ps_command(__unused int argc, __unused char **argv) {
     kdebug("ps");
 }
 
+static void mem_command(__unused int argc, __unused char **argv) {
+    struct message m;
+    m.type = VM_STATS_MSG;
+    m.vm_stats.task = 0;
+    if (ipc_call(VM_TASK, &m) != OK) {
+        WARN("mem: failed to get the memory statistics");
+        return;
+    }
+
+    INFO("free: %d KiB (reclaimed: %d pages)",
+         m.vm_stats_reply.num_free_pages * PAGE_SIZE / 1024,
+         m.vm_stats_reply.reclaimed_pages);
+    for (task_t tid = 1; tid <= CONFIG_NUM_TASKS; tid++) {
+        m.type = VM_STATS_MSG;
+        m.vm_stats.task = tid;
+        if (ipc_call(VM_TASK, &m) != OK) {
+            // Not in use.
+            continue;
+        }
+
+        INFO("#%d: resident=%d, shared=%d, page_tables=%d, shm=%d, ool=%d, "
+             "limit=%d (pages)",
+             tid, m.vm_stats_reply.resident_pages,
+             m.vm_stats_reply.shared_pages, m.vm_stats_reply.page_table_pages,
+             m.vm_stats_reply.shm_pages, m.vm_stats_reply.ool_buf_pages,
+             m.vm_stats_reply.max_pages);
+    }
+}
+
+static void limit_command(int argc, char **argv) {
+    if (argc < 3) {
+        WARN("limit: too few arguments");
+        return;
+    }
+
+    struct message m;
+    m.type = VM_SET_LIMIT_MSG;
+    m.vm_set_limit.task = atoi(argv[1]);
+    m.vm_set_limit.max_pages = atoi(argv[2]);
+    error_t err = ipc_call(VM_TASK, &m);
+    if (err != OK) {
+        WARN("limit: failed to set the limit of #%d: %s", atoi(argv[1]),
+             err2str(err));
+    }
+}
+
+static void heap_profile_command(int argc, char **argv) {
+    if (argc < 2) {
+        WARN("heap-profile: too few arguments");
+        return;
+    }
+
+    // The task prints its heap profile in the log when it receives the
+    // notification.
+    task_t tid = atoi(argv[1]);
+    error_t err = ipc_notify(tid, NOTIFY_MALLOC_PROFILE);
+    if (err != OK) {
+        WARN("heap-profile: failed to notify #%d: %s", tid, err2str(err));
+    }
+}
+
 static void quit_command(__unused int argc, __unused char **argv) {
     kdebug("q");
 }
@@ -47,6 +108,9 @@ static void help_command(__unused int argc, __unused char **argv) {
     INFO("help              -  Print this message.");
     INFO("<task> cmdline... -  Launch a task.");
     INFO("ps                -  List tasks.");
+    INFO("mem               -  Show the memory usage of tasks.");
+    INFO("limit tid pages   -  Limit the memory usage of a task (0: none).");
+    INFO("heap-profile tid  -  Print the heap profile of a task.");
     INFO("q                 -  Halt the computer.");
     INFO("fs-read path      -  Read a file.");
     INFO("fs-write path str -  Write a string into a file.");
@@ -56,6 +120,9 @@ static void help_command(__unused int argc, __unused char **argv) {
 struct command commands[] = {
     {.name = "help", .run = help_command},
     {.name = "ps", .run = ps_command},
+    {.name = "mem", .run = mem_command},
+    {.name = "limit", .run = limit_command},
+    {.name = "heap-profile", .run = heap_profile_command},
     {.name = "q", .run = quit_command},
     {.name = "fs-read", .run = fs_read_command},
     {.name = "fs-write", .run = fs_write_command},
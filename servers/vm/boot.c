@@ -0,0 +1,231 @@
+#include "boot.h"
+#include "bootfs.h"
+#include "page_fault.h"
+#include "task.h"
+#include <elf/elf.h>
+#include <list.h>
+#include <resea/malloc.h>
+#include <resea/printf.h>
+#include <string.h>
+
+/// An autostarted server which waits for services it depends on.
+struct boot_server {
+    list_elem_t next;
+    struct bootfs_file *file;
+    /// The dependencies in the boot manifest ("dep1,dep2", terminated by a
+    /// whitespace or NUL).
+    const char *deps;
+    /// The first page of the file used to prefetch its program headers.
+    void *file_header;
+    /// The prefetch cursor: the program header and the offset in it.
+    unsigned phdr_index;
+    offset_t offset;
+};
+
+/// Servers not yet spawned (`struct boot_server`).
+static list_t pending_servers;
+
+/// Returns true if `name` is listed in `list` separated by whitespaces.
+static bool is_listed(const char *name, const char *list) {
+    size_t len = strlen(name);
+    while (*list != '\0') {
+        if (!strncmp(name, list, len) && (list[len] == '\0' || list[len] == ' ')) {
+            return true;
+        }
+
+        while (*list != '\0' && *list != ' ') {
+            list++;
+        }
+
+        if (*list == ' ') {
+            list++;
+        }
+    }
+
+    return false;
+}
+
+/// Looks for the dependencies of the server in the boot manifest
+/// ("name:dep1,dep2 name2:dep3 ..."). Returns NULL if it has no dependencies.
+static const char *lookup_deps(const char *name) {
+    const char *manifest = BOOT_MANIFEST;
+    size_t len = strlen(name);
+    while (*manifest != '\0') {
+        if (!strncmp(name, manifest, len) && manifest[len] == ':') {
+            return &manifest[len + 1];
+        }
+
+        while (*manifest != '\0' && *manifest != ' ') {
+            manifest++;
+        }
+
+        if (*manifest == ' ') {
+            manifest++;
+        }
+    }
+
+    return NULL;
+}
+
+/// Returns true if all services in `deps` have been registered.
+static bool deps_available(const char *deps) {
+    while (*deps != '\0' && *deps != ' ') {
+        size_t len = 0;
+        while (deps[len] != '\0' && deps[len] != ' ' && deps[len] != ',') {
+            len++;
+        }
+
+        char name[SERVICE_NAME_LEN];
+        strncpy2(name, deps, MIN(len + 1, sizeof(name)));
+        if (!service_available(name)) {
+            return false;
+        }
+
+        deps += len;
+        if (*deps == ',') {
+            deps++;
+        }
+    }
+
+    return true;
+}
+
+static void spawn(struct bootfs_file *file) {
+    task_t tid = task_spawn(file, "");
+    if (IS_ERROR(tid)) {
+        WARN("%s: failed to spawn: %s", file->name, err2str(tid));
+    }
+}
+
+static void spawn_pending(struct boot_server *server) {
+    list_remove(&server->next);
+    spawn(server->file);
+    free(server->file_header);
+    free(server);
+}
+
+/// Launches autostarted servers in bootfs. Servers whose dependencies are not
+/// yet available are deferred until the services get registered so that
+/// independent servers start first without waiting for them.
+void boot_spawn_servers(void) {
+    int num_launched = 0;
+    struct bootfs_file *file;
+    for (int i = 0; (file = bootfs_open(i)) != NULL; i++) {
+        if (!is_listed(file->name, AUTOSTARTS)) {
+            continue;
+        }
+
+        num_launched++;
+        const char *deps = lookup_deps(file->name);
+        if (!deps || deps_available(deps)) {
+            spawn(file);
+            continue;
+        }
+
+        TRACE("%s: deferred until its dependencies are ready", file->name);
+        struct boot_server *server = malloc(sizeof(*server));
+        server->file = file;
+        server->deps = deps;
+        server->file_header = malloc(PAGE_SIZE);
+        read_file(file, 0, server->file_header, PAGE_SIZE);
+        server->phdr_index = 0;
+        server->offset = 0;
+
+        struct elf64_ehdr *ehdr = server->file_header;
+        if (memcmp(ehdr->e_ident, "\x7f" "ELF", 4) != 0) {
+            // Not an ELF file: task_spawn() will complain about it.
+            server->phdr_index = UINT32_MAX;
+        }
+
+        list_nullify(&server->next);
+        list_push_back(&pending_servers, &server->next);
+    }
+
+    if (!num_launched) {
+        WARN("no servers to launch");
+    }
+}
+
+/// Spawns deferred servers whose dependencies have become available. Called
+/// when a service is registered.
+void boot_service_registered(void) {
+    LIST_FOR_EACH (server, &pending_servers, struct boot_server, next) {
+        if (deps_available(server->deps)) {
+            spawn_pending(server);
+        }
+    }
+}
+
+/// Spawns all deferred servers regardless of their dependencies. Called on
+/// the boot timeout: a server may look for the service only optionally, or the
+/// service may be missing in the build config (the server warns about it).
+void boot_spawn_pending(void) {
+    LIST_FOR_EACH (server, &pending_servers, struct boot_server, next) {
+        WARN("%s: dependencies are not ready, starting anyway...",
+             server->file->name);
+        spawn_pending(server);
+    }
+}
+
+static bool prefetch_done(struct boot_server *server) {
+    struct elf64_ehdr *ehdr = server->file_header;
+    return server->phdr_index >= ehdr->e_phnum;
+}
+
+/// Returns true if there're deferred servers whose images are not yet in the
+/// page cache.
+bool boot_should_prefetch(void) {
+    LIST_FOR_EACH (server, &pending_servers, struct boot_server, next) {
+        if (!prefetch_done(server)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/// Reads up to `max_pages` pages of deferred server images into the page
+/// cache so that they don't wait for bootfs (and decompression) in page
+/// faults once spawned.
+void boot_prefetch(size_t max_pages) {
+    LIST_FOR_EACH (server, &pending_servers, struct boot_server, next) {
+        struct elf64_ehdr *ehdr = server->file_header;
+        struct elf64_phdr *phdrs =
+            (struct elf64_phdr *) ((uintptr_t) ehdr + ehdr->e_ehsize);
+        while (!prefetch_done(server)) {
+            struct elf64_phdr *phdr = &phdrs[server->phdr_index];
+            // `server->offset` is relative to the page containing p_vaddr:
+            // the file contents may extend into one more page than p_filesz
+            // if p_vaddr is not page-aligned.
+            size_t len = ALIGN_UP(phdr->p_vaddr + phdr->p_filesz, PAGE_SIZE)
+                         - ALIGN_DOWN(phdr->p_vaddr, PAGE_SIZE);
+            if (phdr->p_type != PT_LOAD || !phdr->p_vaddr
+                || server->offset >= len) {
+                server->phdr_index++;
+                server->offset = 0;
+                continue;
+            }
+
+            if (!max_pages) {
+                return;
+            }
+
+            // Use the same file offsets as the page fault handler.
+            vaddr_t page_vaddr =
+                ALIGN_DOWN(phdr->p_vaddr, PAGE_SIZE) + server->offset;
+            offset_t offset = (page_vaddr - phdr->p_vaddr) + phdr->p_offset;
+            if (!get_cached_file_page(server->file, offset)) {
+                // Out of memory. Leave it to the page fault handler.
+                server->phdr_index = ehdr->e_phnum;
+                break;
+            }
+
+            server->offset += PAGE_SIZE;
+            max_pages--;
+        }
+    }
+}
+
+void boot_init(void) {
+    list_init(&pending_servers);
+}
@@ -0,0 +1,13 @@
+#ifndef __BOOT_H__
+#define __BOOT_H__
+
+#include <types.h>
+
+void boot_spawn_servers(void);
+void boot_service_registered(void);
+void boot_spawn_pending(void);
+bool boot_should_prefetch(void);
+void boot_prefetch(size_t max_pages);
+void boot_init(void);
+
+#endif
@@ -1,13 +1,270 @@
 #include "bootfs.h"
+#include "page_alloc.h"
+#include "task.h"
+#include <avl.h>
+#include <config.h>
+#include <list.h>
+#include <resea/malloc.h>
+#include <resea/printf.h>
 #include <string.h>
 
 extern char __bootfs[];
 static struct bootfs_file *files;
 static unsigned num_files;
+/// True if files are compressed (`BOOTFS_COMPRESSED`).
+static bool compressed;
 
+/// A decompressed block of a file.
+struct cached_block {
+    struct bootfs_file *file;
+    unsigned index;
+    /// The value of `block_cache_clock` when the block was last used. The
+    /// least recently used block is evicted on a miss.
+    unsigned long last_used;
+    uint8_t *data;
+};
+
+/// Recently decompressed blocks. Spawning a task reads the ELF header and
+/// then faults in pages near each other, so a few blocks are enough to avoid
+/// decompressing the same block for every page.
+static struct cached_block block_cache[CONFIG_VM_BOOTFS_BLOCK_CACHE_SIZE];
+static unsigned long block_cache_clock = 0;
+
+/// A physical memory page which contains the file data. It is shared among
+/// tasks spawned from the same file.
+struct cached_page {
+    struct avl_node node;
+    /// An element in `clock_list`.
+    list_elem_t clock_next;
+    struct bootfs_file *file;
+    offset_t offset;
+    paddr_t paddr;
+    /// Set when the page is looked up (i.e. a task faults on it), and cleared
+    /// when the clock hand passes it. Accesses to the page mapped in tasks
+    /// are sampled from the accessed bits in their page tables.
+    bool referenced;
+};
+
+/// The page cache of each file (indexed by the file index). Each tree holds
+/// `struct cached_page` indexed by the file offset.
+static struct avl_tree *page_caches;
+/// All cached pages in the order of the clock hand: the page at the front is
+/// the next one to be examined by bootfs_cache_reclaim().
+static list_t clock_list;
+static size_t num_cached_pages = 0;
+size_t num_reclaimed_pages = 0;
+
+static int compare_offset(struct avl_node *a, struct avl_node *b) {
+    offset_t x = AVL_CONTAINER(a, struct cached_page, node)->offset;
+    offset_t y = AVL_CONTAINER(b, struct cached_page, node)->offset;
+    return (x < y) ? -1 : (x > y);
+}
+
+/// Returns the physical address of the cached page which contains the file
+/// data at `off` or 0 if it is not cached.
+paddr_t bootfs_cache_lookup(struct bootfs_file *file, offset_t off) {
+    struct avl_node *node = page_caches[file - files].root;
+    while (node) {
+        struct cached_page *page = AVL_CONTAINER(node, struct cached_page, node);
+        if (page->offset == off) {
+            page->referenced = true;
+            return page->paddr;
+        }
+
+        node = (off < page->offset) ? node->left : node->right;
+    }
+
+    return 0;
+}
+
+/// Adds a page filled with the file data at `off` into the page cache. The
+/// caller passes its reference to the page to the cache.
+void bootfs_cache_insert(struct bootfs_file *file, offset_t off,
+                         paddr_t paddr) {
+    struct cached_page *page = malloc(sizeof(*page));
+    page->file = file;
+    page->offset = off;
+    page->paddr = paddr;
+    page->referenced = true;
+    avl_insert(&page_caches[file - files], &page->node, compare_offset);
+    list_nullify(&page->clock_next);
+    list_push_back(&clock_list, &page->clock_next);
+    num_cached_pages++;
+}
+
+/// Frees up to `num_pages` cached pages which have not been accessed recently
+/// (the clock algorithm). Pages mapped in tasks are unmapped from them: the
+/// file data is read again on the next page fault. Returns the number of
+/// freed pages.
+size_t bootfs_cache_reclaim(size_t num_pages) {
+    // Examine each page at most twice: once to clear the referenced bit and
+    // once to reclaim it.
+    size_t max_scan = 2 * num_cached_pages;
+    size_t freed = 0;
+    for (size_t i = 0; i < max_scan && freed < num_pages; i++) {
+        struct cached_page *page =
+            LIST_POP_FRONT(&clock_list, struct cached_page, clock_next);
+        // Evaluate both: the accessed bits are cleared as well.
+        bool accessed =
+            task_page_cache_accessed(page->file, page->offset, page->paddr);
+        if (page->referenced || accessed
+            || !task_page_cache_unmap(page->file, page->offset,
+                                      page->paddr)) {
+            // Give it a second chance (or it's pinned by someone else).
+            page->referenced = false;
+            list_push_back(&clock_list, &page->clock_next);
+            continue;
+        }
+
+        avl_remove(&page_caches[page->file - files], &page->node);
+        page_decref(paddr2pfn(page->paddr), 1);
+        free(page);
+        num_cached_pages--;
+        freed++;
+    }
+
+    num_reclaimed_pages += freed;
+    return freed;
+}
+
+/// Reads the extension bytes of a literal/match length.
+static bool lz4_read_len(const uint8_t **src, const uint8_t *src_end,
+                         size_t *len) {
+    uint8_t byte;
+    do {
+        if (*src >= src_end) {
+            return false;
+        }
+
+        byte = *(*src)++;
+        *len += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+/// Decompresses a block in the LZ4 block format. Returns the length of the
+/// decompressed data or -1 if the block is corrupted.
+static int lz4_decompress(const uint8_t *src, size_t src_len, uint8_t *dst,
+                          size_t dst_len) {
+    const uint8_t *src_end = src + src_len;
+    uint8_t *dst_start = dst;
+    uint8_t *dst_end = dst + dst_len;
+    while (src < src_end) {
+        uint8_t token = *src++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !lz4_read_len(&src, src_end, &lit_len)) {
+            return -1;
+        }
+
+        if (lit_len > (size_t) (src_end - src)
+            || lit_len > (size_t) (dst_end - dst)) {
+            return -1;
+        }
+
+        memcpy(dst, src, lit_len);
+        src += lit_len;
+        dst += lit_len;
+
+        // The last sequence has no match.
+        if (src == src_end) {
+            break;
+        }
+
+        if (src_end - src < 2) {
+            return -1;
+        }
+
+        size_t offset = src[0] | (src[1] << 8);
+        src += 2;
+        if (!offset || offset > (size_t) (dst - dst_start)) {
+            return -1;
+        }
+
+        size_t match_len = token & 0x0f;
+        if (match_len == 15 && !lz4_read_len(&src, src_end, &match_len)) {
+            return -1;
+        }
+
+        match_len += 4;
+        if (match_len > (size_t) (dst_end - dst)) {
+            return -1;
+        }
+
+        // The match may overlap with the bytes being copied.
+        const uint8_t *match = dst - offset;
+        while (match_len-- > 0) {
+            *dst++ = *match++;
+        }
+    }
+
+    return dst - dst_start;
+}
+
+/// Returns the decompressed `index`-th block of the file.
+static uint8_t *get_block(struct bootfs_file *file, unsigned index) {
+    struct cached_block *victim = &block_cache[0];
+    for (int i = 0; i < CONFIG_VM_BOOTFS_BLOCK_CACHE_SIZE; i++) {
+        struct cached_block *block = &block_cache[i];
+        if (block->data && block->file == file && block->index == index) {
+            block->last_used = ++block_cache_clock;
+            return block->data;
+        }
+
+        if (block->last_used < victim->last_used) {
+            victim = block;
+        }
+    }
+
+    if (!victim->data) {
+        victim->data = malloc(BOOTFS_BLOCK_SIZE);
+    }
+
+    // A compressed file starts with the offsets of blocks followed by the
+    // blocks. A block is stored as it is if compression does not shrink it.
+    uint8_t *base = (uint8_t *) __bootfs + file->offset;
+    uint32_t *offsets = (uint32_t *) base;
+    size_t block_len =
+        MIN(BOOTFS_BLOCK_SIZE, file->len - index * BOOTFS_BLOCK_SIZE);
+    size_t stored_len = offsets[index + 1] - offsets[index];
+    if (stored_len == block_len) {
+        memcpy(victim->data, &base[offsets[index]], block_len);
+    } else {
+        int decompressed_len = lz4_decompress(&base[offsets[index]], stored_len,
+                                              victim->data, block_len);
+        if (decompressed_len != (int) block_len) {
+            PANIC("bootfs: corrupted block #%d in %s", index, file->name);
+        }
+    }
+
+    victim->file = file;
+    victim->index = index;
+    victim->last_used = ++block_cache_clock;
+    return victim->data;
+}
+
+/// Reads the file data. Bytes beyond the end of a compressed file are filled
+/// with zeros.
 void read_file(struct bootfs_file *file, offset_t off, void *buf, size_t len) {
-    void *p = (void *) (((uintptr_t) __bootfs) + file->offset + off);
-    memcpy(buf, p, len);
+    if (!compressed) {
+        void *p = (void *) (((uintptr_t) __bootfs) + file->offset + off);
+        memcpy(buf, p, len);
+        return;
+    }
+
+    uint8_t *dst = buf;
+    while (len > 0 && off < file->len) {
+        offset_t off_in_block = off % BOOTFS_BLOCK_SIZE;
+        size_t copy_len = MIN(len, BOOTFS_BLOCK_SIZE - off_in_block);
+        copy_len = MIN(copy_len, file->len - off);
+        uint8_t *block = get_block(file, off / BOOTFS_BLOCK_SIZE);
+        memcpy(dst, &block[off_in_block], copy_len);
+        dst += copy_len;
+        off += copy_len;
+        len -= copy_len;
+    }
+
+    memset(dst, 0, len);
 }
 
 struct bootfs_file *bootfs_open(unsigned index) {
@@ -21,6 +278,12 @@ struct bootfs_file *bootfs_open(unsigned index) {
 void bootfs_init(void) {
     struct bootfs_header *header = (struct bootfs_header *) __bootfs;
     num_files = header->num_files;
+    compressed = (header->flags & BOOTFS_COMPRESSED) != 0;
     files =
         (struct bootfs_file *) (((uintptr_t) &__bootfs) + header->files_off);
+    list_init(&clock_list);
+    page_caches = malloc(sizeof(*page_caches) * num_files);
+    for (unsigned i = 0; i < num_files; i++) {
+        avl_init(&page_caches[i]);
+    }
 }
@@ -7,9 +7,14 @@ struct bootfs_header {
     uint32_t version;
     uint32_t files_off;
     uint32_t num_files;
-    uint32_t padding;
+    uint32_t flags;
 } __packed;
 
+/// Files are split into blocks compressed independently in the LZ4 block
+/// format. Keep in sync with tools/mkbootfs.py.
+#define BOOTFS_COMPRESSED  (1 << 0)
+#define BOOTFS_BLOCK_SIZE  (16 * 1024)
+
 struct bootfs_file {
     char name[48];
     uint32_t offset;
@@ -17,8 +22,13 @@ struct bootfs_file {
     uint8_t padding[8];
 } __packed;
 
+extern size_t num_reclaimed_pages;
+
 struct bootfs_file *bootfs_open(unsigned index);
 void read_file(struct bootfs_file *file, offset_t off, void *buf, size_t len);
+paddr_t bootfs_cache_lookup(struct bootfs_file *file, offset_t off);
+void bootfs_cache_insert(struct bootfs_file *file, offset_t off, paddr_t paddr);
+size_t bootfs_cache_reclaim(size_t num_pages);
 void bootfs_init(void);
 
 #endif
@@ -0,0 +1,121 @@
+#include "deferred.h"
+#include "page_fault.h"
+#include "task.h"
+#include <config.h>
+#include <list.h>
+#include <resea/malloc.h>
+#include <string.h>
+
+/// OoL payloads larger than this are copied in a deferred request.
+#define DEFERRED_OOL_LEN (4 * PAGE_SIZE)
+
+/// A slow request deferred to be handled between cheap ones.
+struct deferred_msg {
+    list_elem_t next;
+    struct message m;
+};
+
+/// Deferred requests (`struct deferred_msg`) in the arrival order.
+static list_t deferred_msgs;
+/// The number of messages handled since a deferred request was handled.
+static unsigned num_handled = 0;
+
+/// Returns true if handling the message may take a long time: page faults
+/// which read bootfs, large OoL copies, and spawning a task.
+static bool is_slow(struct message *m) {
+    switch (m->type) {
+        case PAGE_FAULT_MSG: {
+            if (m->src != KERNEL_TASK) {
+                return false;
+            }
+
+            struct task *task = task_find(m->page_fault.task);
+            if (!task) {
+                return false;
+            }
+
+            // Threads share the address space with its owner.
+            return page_fault_is_slow(task->owner, m->page_fault.vaddr,
+                                      m->page_fault.fault);
+        }
+        case OOL_SEND_MSG:
+            return m->ool_send.len >= DEFERRED_OOL_LEN;
+        case TASK_LAUNCH_MSG:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/// Queues the message if it's a slow request. The caller (or the faulted
+/// task) stays blocked until it is handled. Returns true if it's deferred.
+bool defer_if_slow(struct message *m) {
+    if (!is_slow(m)) {
+        return false;
+    }
+
+    struct deferred_msg *deferred = malloc(sizeof(*deferred));
+    memcpy(&deferred->m, m, sizeof(*m));
+    list_nullify(&deferred->next);
+    list_push_back(&deferred_msgs, &deferred->next);
+    return true;
+}
+
+/// Returns true if there're deferred requests.
+bool deferred_pending(void) {
+    return !list_is_empty(&deferred_msgs);
+}
+
+/// Dequeues the oldest deferred request into `m`. Returns false if there're
+/// no deferred requests.
+bool deferred_pop(struct message *m) {
+    struct deferred_msg *deferred =
+        LIST_POP_FRONT(&deferred_msgs, struct deferred_msg, next);
+    if (!deferred) {
+        return false;
+    }
+
+    memcpy(m, &deferred->m, sizeof(*m));
+    free(deferred);
+    num_handled = 0;
+    return true;
+}
+
+/// Called after handling a received message. Dequeues the oldest deferred
+/// request once every `CONFIG_VM_DEFERRED_INTERVAL` messages so that deferred
+/// requests are not starved while vm keeps receiving cheap ones.
+bool deferred_pop_due(struct message *m) {
+    if (!deferred_pending()) {
+        return false;
+    }
+
+    if (++num_handled < CONFIG_VM_DEFERRED_INTERVAL) {
+        return false;
+    }
+
+    return deferred_pop(m);
+}
+
+/// Drops deferred requests from the exiting task: its task ID will be reused.
+void deferred_task_exit(struct task *task) {
+    LIST_FOR_EACH (deferred, &deferred_msgs, struct deferred_msg, next) {
+        struct message *m = &deferred->m;
+        bool from_task =
+            m->src == task->tid
+            || (m->type == PAGE_FAULT_MSG && m->page_fault.task == task->tid);
+        if (!from_task) {
+            continue;
+        }
+
+        if (m->type == TASK_LAUNCH_MSG) {
+            free(m->task_launch.name_and_cmdline);
+        }
+
+        list_remove(&deferred->next);
+        free(deferred);
+    }
+}
+
+void deferred_init(void) {
+    list_init(&deferred_msgs);
+}
@@ -0,0 +1,15 @@
+#ifndef __DEFERRED_H__
+#define __DEFERRED_H__
+
+#include <message.h>
+#include <types.h>
+
+struct task;
+bool defer_if_slow(struct message *m);
+bool deferred_pending(void);
+bool deferred_pop(struct message *m);
+bool deferred_pop_due(struct message *m);
+void deferred_task_exit(struct task *task);
+void deferred_init(void);
+
+#endif
@@ -1,9 +1,13 @@
+#include "boot.h"
 #include "bootfs.h"
+#include "deferred.h"
 #include "ool.h"
 #include "page_alloc.h"
 #include "page_fault.h"
 #include "shm.h"
 #include "task.h"
+#include "zero_pool.h"
+#include <config.h>
 #include <elf/elf.h>
 #include <list.h>
 #include <resea/async.h>
@@ -14,6 +18,16 @@
 #include <resea/timer.h>
 #include <string.h>
 
+/// The number of pages zeroed at once while the vm server is idle. Keep it
+/// small so that incoming messages don't wait long.
+#define ZERO_POOL_REFILL_BATCH 8
+/// The number of pages of deferred servers read into the page cache at once
+/// while the vm server is idle.
+#define BOOT_PREFETCH_BATCH 8
+/// The maximum number of page cache pages reclaimed at once when free memory
+/// is below the watermark.
+#define RECLAIM_BATCH 16
+
 // for sparse
 error_t ipc_call_pager(struct message *m);
 
@@ -24,6 +38,9 @@ error_t ipc_call_pager(struct message *m) {
         case OOL_RECV_MSG:
             err = handle_ool_recv(m);
             break;
+        case OOL_RECV_BUFS_MSG:
+            err = handle_ool_recv_bufs(m);
+            break;
         case OOL_VERIFY_MSG:
             err = handle_ool_verify(m);
             break;
@@ -41,319 +58,583 @@ error_t ipc_call_pager(struct message *m) {
     return err;
 }
 
-static void spawn_servers(void) {
-    // Launch servers in bootfs.
-    int num_launched = 0;
-    struct bootfs_file *file;
-    for (int i = 0; (file = bootfs_open(i)) != NULL; i++) {
-        // Autostart server names (separated by whitespace).
-        char *startups = AUTOSTARTS;
-
-        // Execute the file if it is listed in the autostarts.
-        while (*startups != '\0') {
-            size_t len = strlen(file->name);
-            if (!strncmp(file->name, startups, len)
-                && (startups[len] == '\0' || startups[len] == ' ')) {
-                ASSERT_OK(task_spawn(file, ""));
-                num_launched++;
-                break;
-            }
-
-            while (*startups != '\0' && *startups != ' ') {
-                startups++;
-            }
+/// Returns true if the task is listed in `CONFIG_VM_PRIVILEGED_TASKS`, i.e.
+/// allowed to set the memory limit of other tasks.
+static bool is_privileged(struct task *task) {
+    const char *p = CONFIG_VM_PRIVILEGED_TASKS;
+    size_t name_len = strlen(task->name);
+    while (*p) {
+        const char *end = strchr(p, ' ');
+        size_t len = end ? (size_t) (end - p) : strlen(p);
+        if (len == name_len && !strncmp(p, task->name, len)) {
+            return true;
+        }
 
-            if (*startups == ' ') {
-                startups++;
-            }
+        if (!end) {
+            break;
         }
-    }
 
-    if (!num_launched) {
-        WARN("no servers to launch");
+        p = end + 1;
     }
+
+    return false;
 }
 
-void main(void) {
-    TRACE("starting...");
-    bootfs_init();
-    page_alloc_init();
-    task_init();
-    page_fault_init();
-    spawn_servers();
+static void handle_message(struct message *m) {
+    error_t err;
+    struct task *caller = NULL;
+    if (m->src != KERNEL_TASK) {
+        caller = task_lookup(m->src);
+        ASSERT(caller);
+    }
 
-    timer_set(5000);
+    struct message r;
+    bzero(&r, sizeof(r));
 
-    // The mainloop: receive and handle messages.
-    INFO("ready");
-    while (true) {
-        struct message m;
-        error_t err = ipc_recv(IPC_ANY, &m);
-        ASSERT_OK(err);
-
-        struct task *caller = NULL;
-        if (m.src != KERNEL_TASK) {
-            caller = task_lookup(m.src);
-            ASSERT(caller);
+    switch (m->type) {
+        case NOTIFICATIONS_MSG:
+            if (m->notifications.data & NOTIFY_TIMER) {
+                boot_spawn_pending();
+                service_warn_deadlocked_tasks();
+                zero_pool_refill(CONFIG_VM_ZERO_POOL_PAGES);
+            }
+            break;
+        case ASYNC_MSG:
+            async_reply(m->src);
+            break;
+        case OOL_RECV_MSG: {
+            task_t src = m->src;
+            error_t err = handle_ool_recv(m);
+            switch (err) {
+                case DONT_REPLY:
+                    break;
+                case OK:
+                    ipc_reply(src, m);
+                    break;
+                default:
+                    ipc_reply_err(src, err);
+            }
+            break;
+        }
+        case OOL_RECV_BUFS_MSG: {
+            task_t src = m->src;
+            error_t err = handle_ool_recv_bufs(m);
+            switch (err) {
+                case DONT_REPLY:
+                    break;
+                case OK:
+                    ipc_reply(src, m);
+                    break;
+                default:
+                    ipc_reply_err(src, err);
+            }
+            break;
+        }
+        case OOL_VERIFY_MSG: {
+            task_t src = m->src;
+            error_t err = handle_ool_verify(m);
+            switch (err) {
+                case DONT_REPLY:
+                    break;
+                case OK:
+                    ipc_reply(src, m);
+                    break;
+                default:
+                    ipc_reply_err(src, err);
+            }
+            break;
+        }
+        case OOL_SEND_MSG: {
+            task_t src = m->src;
+            error_t err = handle_ool_send(m);
+            switch (err) {
+                case DONT_REPLY:
+                    break;
+                case OK:
+                    ipc_reply(src, m);
+                    break;
+                default:
+                    ipc_reply_err(src, err);
+            }
+            break;
         }
+        case BENCHMARK_NOP_MSG:
+            r.type = BENCHMARK_NOP_REPLY_MSG;
+            r.benchmark_nop_reply.value = m->benchmark_nop.value * 7;
+            ipc_reply(m->src, &r);
+            break;
+        case BENCHMARK_NOP_WITH_OOL_MSG:
+            free(m->benchmark_nop_with_ool.data);
+            r.type = BENCHMARK_NOP_WITH_OOL_REPLY_MSG;
+            r.benchmark_nop_with_ool_reply.data = "reply!";
+            r.benchmark_nop_with_ool_reply.data_len = 7;
+            ipc_reply(m->src, &r);
+            break;
+        case EXCEPTION_MSG: {
+            if (m->src != KERNEL_TASK) {
+                WARN("forged exception message from #%d, ignoring...",
+                     m->src);
+                break;
+            }
 
-        struct message r;
-        bzero(&r, sizeof(r));
+            struct task *task = task_lookup(m->exception.task);
+            ASSERT(task);
+            ASSERT(task->pager == vm_task->tid);
+            ASSERT(m->exception.task == task->tid);
 
-        switch (m.type) {
-            case NOTIFICATIONS_MSG:
-                if (m.notifications.data & NOTIFY_TIMER) {
-                    service_warn_deadlocked_tasks();
-                }
-                break;
-            case ASYNC_MSG:
-                async_reply(m.src);
-                break;
-            case OOL_RECV_MSG: {
-                task_t src = m.src;
-                error_t err = handle_ool_recv(&m);
-                switch (err) {
-                    case DONT_REPLY:
-                        break;
-                    case OK:
-                        ipc_reply(src, &m);
-                        break;
-                    default:
-                        ipc_reply_err(src, err);
+            if (m->exception.exception == EXP_GRACE_EXIT) {
+                if (task->owner == task) {
+                    INFO("%s: terminated its execution", task->name);
                 }
-                break;
+            } else {
+                WARN("%s: exception occurred, killing the task...",
+                     task->name);
+                // An exception in a thread kills the whole task.
+                task = task->owner;
             }
-            case OOL_VERIFY_MSG: {
-                task_t src = m.src;
-                error_t err = handle_ool_verify(&m);
-                switch (err) {
-                    case DONT_REPLY:
-                        break;
-                    case OK:
-                        ipc_reply(src, &m);
-                        break;
-                    default:
-                        ipc_reply_err(src, err);
-                }
+
+            task_kill(task);
+            break;
+        }
+        case PAGE_FAULT_MSG: {
+            if (m->src != KERNEL_TASK) {
+                WARN("forged page fault message from #%d, ignoring...",
+                     m->src);
                 break;
             }
-            case OOL_SEND_MSG: {
-                task_t src = m.src;
-                error_t err = handle_ool_send(&m);
-                switch (err) {
-                    case DONT_REPLY:
-                        break;
-                    case OK:
-                        ipc_reply(src, &m);
-                        break;
-                    default:
-                        ipc_reply_err(src, err);
-                }
-                break;
+
+            struct task *task = task_lookup(m->page_fault.task);
+            ASSERT(task);
+            ASSERT(task->pager == vm_task->tid);
+            ASSERT(m->page_fault.task == task->tid);
+
+            // Threads share the address space with its owner.
+            struct page_fault_mapping mapping;
+            size_t alloc_failures = num_alloc_failures;
+            bool handled = handle_page_fault(
+                task->owner, m->page_fault.vaddr, m->page_fault.ip,
+                m->page_fault.fault, &mapping);
+            if (!handled && num_alloc_failures != alloc_failures
+                && bootfs_cache_reclaim(RECLAIM_BATCH) > 0) {
+                // Ran out of memory: retry with reclaimed pages.
+                handled = handle_page_fault(task->owner, m->page_fault.vaddr,
+                                            m->page_fault.ip,
+                                            m->page_fault.fault, &mapping);
             }
-            case BENCHMARK_NOP_MSG:
-                r.type = BENCHMARK_NOP_REPLY_MSG;
-                r.benchmark_nop_reply.value = m.benchmark_nop.value * 7;
-                ipc_reply(m.src, &r);
-                break;
-            case BENCHMARK_NOP_WITH_OOL_MSG:
-                free(m.benchmark_nop_with_ool.data);
-                r.type = BENCHMARK_NOP_WITH_OOL_REPLY_MSG;
-                r.benchmark_nop_with_ool_reply.data = "reply!";
-                r.benchmark_nop_with_ool_reply.data_len = 7;
-                ipc_reply(m.src, &r);
+
+            if (!handled) {
+                ipc_reply_err(m->src, ERR_NOT_FOUND);
                 break;
-            case EXCEPTION_MSG: {
-                if (m.src != KERNEL_TASK) {
-                    WARN("forged exception message from #%d, ignoring...",
-                         m.src);
+            }
+
+            // Give a page for page table structures if the kernel has
+            // used the previous one.
+            paddr_t kpage = 0;
+            if (m->page_fault.need_kpage
+                && task_page_alloc(task->owner, NULL, &kpage, 1) != OK) {
+                // Without a kpage the task would fault again forever if a
+                // page table is missing. Retry with reclaimed pages and kill
+                // the task if it's still out of memory (or its limit).
+                kpage = 0;
+                if (!bootfs_cache_reclaim(RECLAIM_BATCH)
+                    || task_page_alloc(task->owner, NULL, &kpage, 1) != OK) {
+                    WARN("%s: out of memory for page tables", task->name);
+                    ipc_reply_err(m->src, ERR_NO_MEMORY);
                     break;
                 }
+            }
 
-                struct task *task = task_lookup(m.exception.task);
-                ASSERT(task);
-                ASSERT(task->pager == vm_task->tid);
-                ASSERT(m.exception.task == task->tid);
+            // The kernel maps the pages before resuming the task.
+            r.type = PAGE_FAULT_REPLY_MSG;
+            r.page_fault_reply.vaddr = mapping.vaddr;
+            r.page_fault_reply.paddr = mapping.paddr;
+            r.page_fault_reply.num_pages = mapping.num_pages;
+            r.page_fault_reply.attrs = mapping.map_type;
+            r.page_fault_reply.kpage = kpage;
 
-                if (m.exception.exception == EXP_GRACE_EXIT) {
-                    INFO("%s: terminated its execution", task->name);
-                } else {
-                    WARN("%s: exception occurred, killing the task...",
-                         task->name);
-                }
+            ipc_reply(task->tid, &r);
+            break;
+        }
+        case DISCOVERY_SERVE_MSG: {
+            int id = service_register(caller, m->discovery_serve.name);
+            free(m->discovery_serve.name);
+            r.type = DISCOVERY_SERVE_REPLY_MSG;
+            r.discovery_serve_reply.service = id;
+            ipc_reply(m->src, &r);
+            break;
+        }
+        case DISCOVERY_LOOKUP_MSG: {
+            int id;
+            task_t server = service_wait(caller, m->discovery_lookup.name,
+                                         m->discovery_lookup.watch, &id);
+            free(m->discovery_lookup.name);
+            if (IS_OK(server)) {
+                r.type = DISCOVERY_LOOKUP_REPLY_MSG;
+                r.discovery_lookup_reply.task = server;
+                r.discovery_lookup_reply.service = id;
+                ipc_reply(m->src, &r);
+            }
+            break;
+        }
+        case VM_ALLOC_PAGES_MSG: {
+            struct task *task = task_lookup(m->src);
+            ASSERT(task);
+
+            vaddr_t vaddr = 0;
+            paddr_t paddr = m->vm_alloc_pages.paddr;
+            size_t num_pages = m->vm_alloc_pages.num_pages;
+            error_t err = ERR_UNAVAILABLE;
+            if (m->vm_alloc_pages.flags & VM_ALLOC_LARGE) {
+                err = task_page_alloc_large(task->owner, &vaddr, &paddr,
+                                            num_pages);
+            }
 
-                task_kill(task);
+            if (err == ERR_UNAVAILABLE) {
+                // Use normal pages.
+                err = task_page_alloc(task->owner, &vaddr, &paddr, num_pages);
+            }
+
+            if (err != OK) {
+                ipc_reply_err(m->src, err);
                 break;
             }
-            case PAGE_FAULT_MSG: {
-                if (m.src != KERNEL_TASK) {
-                    WARN("forged page fault message from #%d, ignoring...",
-                         m.src);
-                    break;
-                }
 
-                struct task *task = task_lookup(m.page_fault.task);
-                ASSERT(task);
-                ASSERT(task->pager == vm_task->tid);
-                ASSERT(m.page_fault.task == task->tid);
+            r.type = VM_ALLOC_PAGES_REPLY_MSG;
+            r.vm_alloc_pages_reply.vaddr = vaddr;
+            r.vm_alloc_pages_reply.paddr = paddr;
+            ipc_reply(m->src, &r);
+            break;
+        }
+        case VM_FREE_PAGES_MSG: {
+            struct task *task = task_lookup(m->src);
+            ASSERT(task);
+
+            error_t err =
+                task_page_free_by_vaddr(task->owner, m->vm_free_pages.vaddr);
+            if (err != OK) {
+                ipc_reply_err(m->src, err);
+                break;
+            }
 
-                paddr_t paddr =
-                    handle_page_fault(task, m.page_fault.vaddr, m.page_fault.ip,
-                                      m.page_fault.fault);
-                if (!paddr) {
-                    ipc_reply_err(m.src, ERR_NOT_FOUND);
+            r.type = VM_FREE_PAGES_REPLY_MSG;
+            ipc_reply(m->src, &r);
+            break;
+        }
+        case VM_STATS_MSG: {
+            bzero(&r, sizeof(r));
+            r.type = VM_STATS_REPLY_MSG;
+            r.vm_stats_reply.num_free_pages = num_unused_pages;
+            r.vm_stats_reply.zero_pool_hits = zero_pool_hits;
+            r.vm_stats_reply.zero_pool_misses = zero_pool_misses;
+            r.vm_stats_reply.reclaimed_pages = num_reclaimed_pages;
+            struct page_alloc_benchmark *bench = &page_alloc_benchmark_result;
+            r.vm_stats_reply.page_alloc_cycles = bench->alloc_cycles;
+            r.vm_stats_reply.page_free_cycles = bench->free_cycles;
+            r.vm_stats_reply.page_alloc_16_cycles = bench->alloc_16_cycles;
+            r.vm_stats_reply.page_free_16_cycles = bench->free_16_cycles;
+            if (m->vm_stats.task) {
+                struct task *task = task_find(m->vm_stats.task);
+                if (!task) {
+                    ipc_reply_err(m->src, ERR_NOT_FOUND);
                     break;
                 }
 
-                vaddr_t aligned_vaddr =
-                    ALIGN_DOWN(m.page_fault.vaddr, PAGE_SIZE);
-                ASSERT_OK(map_page(task, aligned_vaddr, paddr,
-                                   MAP_TYPE_READWRITE, false));
-                r.type = PAGE_FAULT_REPLY_MSG;
+                // Threads and endpoints use the owner's memory.
+                struct task_mem *mem = &task->owner->mem;
+                r.vm_stats_reply.resident_pages = mem->resident;
+                r.vm_stats_reply.shared_pages = mem->shared;
+                r.vm_stats_reply.page_table_pages = mem->page_tables;
+                r.vm_stats_reply.shm_pages = mem->shm;
+                r.vm_stats_reply.ool_buf_pages = task_ool_buf_pages(task);
+                r.vm_stats_reply.max_pages = mem->max_pages;
+            }
+
+            ipc_reply(m->src, &r);
+            break;
+        }
+        case VM_SET_LIMIT_MSG: {
+            struct task *task = task_find(m->vm_set_limit.task);
+            if (!task || task == vm_task) {
+                ipc_reply_err(m->src, ERR_NOT_FOUND);
+                break;
+            }
+
+            // The limit is set by the task's own pager (except vm: it's the
+            // pager of every task it spawns), or by a privileged task. A task
+            // never sets its own limit.
+            bool own_pager = task->owner->pager != vm_task->tid
+                             && task->owner->pager == caller->owner->tid;
+            bool permitted = caller->owner != task->owner
+                             && (own_pager || is_privileged(caller->owner));
+            if (!permitted) {
+                ipc_reply_err(m->src, ERR_NOT_PERMITTED);
+                break;
+            }
 
-                ipc_reply(task->tid, &r);
+            task->owner->mem.max_pages = m->vm_set_limit.max_pages;
+            r.type = VM_SET_LIMIT_REPLY_MSG;
+            ipc_reply(m->src, &r);
+            break;
+        }
+        case TASK_ALLOC_MSG: {
+            struct task *task = task_alloc(m->task_alloc.pager);
+            if (!task) {
+                ipc_reply_err(m->src, ERR_NOT_FOUND);
                 break;
             }
-            case DISCOVERY_SERVE_MSG: {
-                service_register(caller, m.discovery_serve.name);
-                free(m.discovery_serve.name);
-                r.type = DISCOVERY_SERVE_REPLY_MSG;
-                ipc_reply(m.src, &r);
+
+            r.type = TASK_ALLOC_REPLY_MSG;
+            r.task_alloc_reply.task = task->tid;
+            ipc_reply(m->src, &r);
+            break;
+        }
+        case TASK_FREE_MSG: {
+            struct task *task = task_lookup(m->task_free.task);
+            if (!task) {
+                ipc_reply_err(m->src, ERR_NOT_FOUND);
                 break;
             }
-            case DISCOVERY_LOOKUP_MSG: {
-                task_t server = service_wait(caller, m.discovery_lookup.name);
-                free(m.discovery_lookup.name);
-                if (IS_OK(server)) {
-                    r.type = DISCOVERY_LOOKUP_REPLY_MSG;
-                    r.discovery_lookup_reply.task = server;
-                    ipc_reply(m.src, &r);
-                }
+
+            // A task ID is freed by its pager, or by its owner if it's a
+            // thread (i.e. thread_create() has failed).
+            bool permitted = (task->owner == task)
+                                 ? task->pager == m->src
+                                 : task->owner == caller->owner;
+            if (!permitted) {
+                ipc_reply_err(m->src, ERR_NOT_PERMITTED);
                 break;
             }
-            case VM_ALLOC_PAGES_MSG: {
-                struct task *task = task_lookup(m.src);
-                ASSERT(task);
 
-                vaddr_t vaddr = 0;
-                paddr_t paddr = m.vm_alloc_pages.paddr;
-                error_t err = task_page_alloc(task, &vaddr, &paddr,
-                                              m.vm_alloc_pages.num_pages);
-                if (err != OK) {
-                    ipc_reply_err(m.src, err);
-                    break;
-                }
+            task_free(task);
+            r.type = TASK_FREE_REPLY_MSG;
+            ipc_reply(m->src, &r);
+            break;
+        }
+        case TASK_ALLOC_THREAD_MSG: {
+            struct task *thread = thread_alloc(caller->owner);
+            if (!thread) {
+                ipc_reply_err(m->src, ERR_NOT_FOUND);
+                break;
+            }
 
-                r.type = VM_ALLOC_PAGES_REPLY_MSG;
-                r.vm_alloc_pages_reply.vaddr = vaddr;
-                r.vm_alloc_pages_reply.paddr = paddr;
-                ipc_reply(m.src, &r);
+            r.type = TASK_ALLOC_THREAD_REPLY_MSG;
+            r.task_alloc_thread_reply.task = thread->tid;
+            ipc_reply(m->src, &r);
+            break;
+        }
+        case ENDPOINT_CREATE_MSG: {
+            struct task *ep = endpoint_alloc(caller->owner);
+            if (!ep) {
+                ipc_reply_err(m->src, ERR_NOT_FOUND);
                 break;
             }
-            case TASK_ALLOC_MSG: {
-                struct task *task = task_alloc(m.task_alloc.pager);
-                if (!task) {
-                    ipc_reply_err(m.src, ERR_NOT_FOUND);
-                    break;
-                }
 
-                r.type = TASK_ALLOC_REPLY_MSG;
-                r.task_alloc_reply.task = task->tid;
-                ipc_reply(m.src, &r);
+            r.type = ENDPOINT_CREATE_REPLY_MSG;
+            r.endpoint_create_reply.endpoint = ep->tid;
+            ipc_reply(m->src, &r);
+            break;
+        }
+        case ENDPOINT_DESTROY_MSG: {
+            struct task *ep = task_find(m->endpoint_destroy.endpoint);
+            if (!ep) {
+                ipc_reply_err(m->src, ERR_NOT_FOUND);
                 break;
             }
-            case TASK_FREE_MSG: {
-                struct task *task = task_lookup(m.task_free.task);
-                if (!task) {
-                    ipc_reply_err(m.src, ERR_NOT_FOUND);
-                    break;
-                }
 
-                if (task->pager != m.src) {
-                    ipc_reply_err(m.src, ERR_NOT_PERMITTED);
-                    break;
-                }
+            if (!ep->endpoint || ep->owner != caller->owner) {
+                ipc_reply_err(m->src, ERR_NOT_PERMITTED);
+                break;
+            }
 
-                task_free(task);
-                r.type = TASK_FREE_REPLY_MSG;
-                ipc_reply(m.src, &r);
+            task_kill(ep);
+            r.type = ENDPOINT_DESTROY_REPLY_MSG;
+            ipc_reply(m->src, &r);
+            break;
+        }
+        case TASK_LAUNCH_MSG: {
+            task_t task_or_err =
+                task_spawn_by_cmdline(m->task_launch.name_and_cmdline);
+            free(m->task_launch.name_and_cmdline);
+            if (IS_ERROR(task_or_err)) {
+                ipc_reply_err(m->src, task_or_err);
                 break;
             }
-            case TASK_LAUNCH_MSG: {
-                task_t task_or_err =
-                    task_spawn_by_cmdline(m.task_launch.name_and_cmdline);
-                free(m.task_launch.name_and_cmdline);
-                if (IS_ERROR(task_or_err)) {
-                    ipc_reply_err(m.src, task_or_err);
-                    break;
-                }
 
-                r.type = TASK_LAUNCH_REPLY_MSG;
-                r.task_launch_reply.task = task_or_err;
-                ipc_reply(m.src, &r);
+            r.type = TASK_LAUNCH_REPLY_MSG;
+            r.task_launch_reply.task = task_or_err;
+            ipc_reply(m->src, &r);
+            break;
+        }
+        case TASK_WATCH_MSG: {
+            struct task *task = task_lookup(m->task_watch.task);
+            if (!task) {
+                ipc_reply_err(m->src, ERR_NOT_FOUND);
                 break;
             }
-            case TASK_WATCH_MSG: {
-                struct task *task = task_lookup(m.task_watch.task);
-                if (!task) {
-                    ipc_reply_err(m.src, ERR_NOT_FOUND);
-                    break;
-                }
 
-                task_watch(caller, task);
-                r.type = TASK_WATCH_REPLY_MSG;
-                ipc_reply(m.src, &r);
+            task_watch(caller, task);
+            r.type = TASK_WATCH_REPLY_MSG;
+            ipc_reply(m->src, &r);
+            break;
+        }
+        case TASK_UNWATCH_MSG: {
+            struct task *task = task_lookup(m->task_unwatch.task);
+            if (!task) {
+                ipc_reply_err(m->src, ERR_NOT_FOUND);
                 break;
             }
-            case TASK_UNWATCH_MSG: {
-                struct task *task = task_lookup(m.task_unwatch.task);
-                if (!task) {
-                    ipc_reply_err(m.src, ERR_NOT_FOUND);
-                    break;
-                }
 
-                task_unwatch(caller, task);
-                r.type = TASK_UNWATCH_REPLY_MSG;
-                ipc_reply(m.src, &r);
+            task_unwatch(caller, task);
+            r.type = TASK_UNWATCH_REPLY_MSG;
+            ipc_reply(m->src, &r);
+            break;
+        }
+        case SHM_CREATE_MSG: {
+            struct task *task = task_lookup(m->src);
+            ASSERT(task);
+            int shm_id;
+            err = shm_create(task->owner, m->shm_create.size, NULL, &shm_id);
+            if (err != OK) {
+                ipc_reply_err(m->src, err);
                 break;
             }
-            case SHM_CREATE_MSG: {
-                struct task *task = task_lookup(m.src);
-                ASSERT(task);
-                int slot;
-                err = shm_create(task, m.shm_create.size, &slot);
-                if (err != OK) {
-                    ipc_reply_err(m.src, err);
-                    break;
-                }
-                m.type = SHM_CREATE_REPLY_MSG;
-                m.shm_create_reply.shm_id = slot;
-                ipc_reply(m.src, &m);
+            m->type = SHM_CREATE_REPLY_MSG;
+            m->shm_create_reply.shm_id = shm_id;
+            ipc_reply(m->src, m);
+            break;
+        }
+        case SHM_CREATE_NAMED_MSG: {
+            struct task *task = task_lookup(m->src);
+            ASSERT(task);
+            int shm_id;
+            err = shm_create(task->owner, m->shm_create_named.size,
+                             m->shm_create_named.name, &shm_id);
+            free(m->shm_create_named.name);
+            if (err != OK) {
+                ipc_reply_err(m->src, err);
                 break;
             }
-            case SHM_MAP_MSG: {
-                struct task *task = task_lookup(m.src);
-                error_t err;
-                vaddr_t vaddr;
-                err =
-                    shm_map(task, m.shm_map.shm_id, m.shm_map.writable, &vaddr);
-                if (err != OK) {
-                    ipc_reply_err(m.src, err);
-                    break;
-                }
-                m.type = SHM_MAP_REPLY_MSG;
-                m.shm_map_reply.vaddr = vaddr;
-                ipc_reply(m.src, &m);
+            m->type = SHM_CREATE_NAMED_REPLY_MSG;
+            m->shm_create_named_reply.shm_id = shm_id;
+            ipc_reply(m->src, m);
+            break;
+        }
+        case SHM_LOOKUP_MSG: {
+            struct shm *shm = shm_lookup_by_name(m->shm_lookup.name);
+            free(m->shm_lookup.name);
+            if (!shm) {
+                ipc_reply_err(m->src, ERR_NOT_FOUND);
                 break;
             }
-            case SHM_CLOSE_MSG: {
-                shm_close(m.shm_close.shm_id);
-                m.type = SHM_CLOSE_REPLY_MSG;
-                ipc_reply(m.src, &m);
+            m->type = SHM_LOOKUP_REPLY_MSG;
+            m->shm_lookup_reply.shm_id = shm->shm_id;
+            ipc_reply(m->src, m);
+            break;
+        }
+        case SHM_MAP_MSG: {
+            struct task *task = task_lookup(m->src);
+            error_t err;
+            vaddr_t vaddr;
+            err =
+                shm_map(task->owner, m->shm_map.shm_id, m->shm_map.writable,
+                        &vaddr);
+            if (err != OK) {
+                ipc_reply_err(m->src, err);
                 break;
             }
-            default:
-                discard_unknown_message(&m);
+            m->type = SHM_MAP_REPLY_MSG;
+            m->shm_map_reply.vaddr = vaddr;
+            ipc_reply(m->src, m);
+            break;
         }
+        case SHM_UNMAP_MSG: {
+            struct task *task = task_lookup(m->src);
+            ASSERT(task);
+            err = shm_unmap(task->owner, m->shm_unmap.shm_id);
+            if (err != OK) {
+                ipc_reply_err(m->src, err);
+                break;
+            }
+            m->type = SHM_UNMAP_REPLY_MSG;
+            ipc_reply(m->src, m);
+            break;
+        }
+        case SHM_CLOSE_MSG: {
+            struct task *task = task_lookup(m->src);
+            ASSERT(task);
+            err = shm_close(task->owner, m->shm_close.shm_id);
+            if (err != OK) {
+                ipc_reply_err(m->src, err);
+                break;
+            }
+            m->type = SHM_CLOSE_REPLY_MSG;
+            ipc_reply(m->src, m);
+            break;
+        }
+        default:
+            discard_unknown_message(m);
     }
 }
+
+void main(void) {
+    TRACE("starting...");
+    bootfs_init();
+    page_alloc_init();
+#ifdef CONFIG_VM_PAGE_ALLOC_BENCHMARK
+    page_alloc_benchmark();
+#endif
+    task_init();
+    direct_map_init();
+    page_fault_init();
+    zero_pool_init();
+    deferred_init();
+    boot_init();
+    boot_spawn_servers();
+
+    timer_set(5000);
+
+    // The mainloop: receive and handle messages.
+    INFO("ready");
+    while (true) {
+        // Free page cache pages before running out of memory.
+        if (num_unused_pages < CONFIG_VM_RECLAIM_WATERMARK) {
+            bootfs_cache_reclaim(RECLAIM_BATCH);
+        }
+
+        struct message m;
+        error_t err;
+        if (deferred_pending() || zero_pool_should_refill()
+            || boot_should_prefetch()) {
+            // Handle deferred slow requests, refill the pre-zeroed page pool,
+            // and prefetch deferred servers while there're no pending
+            // messages.
+            err = ipc_recv_noblock(IPC_ANY, &m);
+            if (err == ERR_WOULD_BLOCK) {
+                if (deferred_pop(&m)) {
+                    handle_message(&m);
+                } else {
+                    zero_pool_refill(ZERO_POOL_REFILL_BATCH);
+                    boot_prefetch(BOOT_PREFETCH_BATCH);
+                }
+                continue;
+            }
+        } else {
+            err = ipc_recv(IPC_ANY, &m);
+        }
+
+        ASSERT_OK(err);
+
+        // Slow requests (e.g. page faults which read bootfs) are deferred so
+        // that cheap ones don't wait for them.
+        if (!defer_if_slow(&m)) {
+            handle_message(&m);
+        }
+
+        // Handle a deferred request every few messages so that they make
+        // progress under a constant load.
+        if (deferred_pop_due(&m)) {
+            handle_message(&m);
+        }
+    }
+}
+
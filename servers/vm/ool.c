@@ -1,6 +1,8 @@
 #include "ool.h"
+#include "page_alloc.h"
 #include "page_fault.h"
 #include "task.h"
+#include <config.h>
 #include <message.h>
 #include <resea/ipc.h>
 #include <resea/task.h>
@@ -10,35 +12,116 @@ static uint8_t __src_page[PAGE_SIZE] __aligned(PAGE_SIZE);
 static uint8_t __dst_page[PAGE_SIZE] __aligned(PAGE_SIZE);
 
 static paddr_t vaddr2paddr(struct task *task, vaddr_t vaddr, bool write) {
-    LIST_FOR_EACH (area, &task->page_areas, struct page_area, next) {
-        if (area->vaddr <= vaddr
-            && vaddr < area->vaddr + area->num_pages * PAGE_SIZE) {
-            return area->paddr + (vaddr - area->vaddr);
-        }
+    // Shared pages must not be written: make a private copy first (or fail if
+    // it's not copy-on-write).
+    struct page_area *area = page_area_lookup(task, vaddr);
+    if (area && !(write && area->shared && !area->writable)) {
+        return area->paddr + (vaddr - area->vaddr);
     }
 
-    // The page is not mapped. Try filling it with pager.
+    // The page is not filled yet or needs to be copied. Try filling it with
+    // pager.
     unsigned fault = EXP_PF_USER;
     fault |= write ? EXP_PF_WRITE : 0;
-    return handle_page_fault(task, vaddr, 0, fault);
+    fault |= area ? EXP_PF_PRESENT : 0;
+    struct page_fault_mapping mapping;
+    if (!handle_page_fault(task, vaddr, 0, fault, &mapping)) {
+        return 0;
+    }
+
+    // The page has been copied on write: replace the read-only mapping in the
+    // task. handle_page_fault() only returns the new page (the kernel maps it
+    // on a real page fault), so without this the task would keep reading the
+    // shared page and never see the payload written into its private copy.
+    // Other pages are mapped when the task accesses them.
+    if (area
+        && map_page(task, mapping.vaddr, mapping.paddr, mapping.map_type, true)
+               != OK) {
+        return 0;
+    }
+
+    return mapping.paddr + (ALIGN_DOWN(vaddr, PAGE_SIZE) - mapping.vaddr);
 }
 
-error_t handle_ool_recv(struct message *m) {
-    struct task *task = task_lookup(m->src);
-    ASSERT(task);
+/// Returns true if the page at `vaddr` can be replaced with (or turned into) a
+/// copy-on-write page: it's not yet filled, filled on a page fault, or already
+/// shared as read-only. Pages allocated explicitly (e.g. DMA buffers) and
+/// shared memory (even if it's mapped as read-only) are not: a shm area is
+/// unmapped as a whole and must not be split.
+static bool is_remappable(struct task *task, vaddr_t vaddr) {
+    struct page_area *area = page_area_lookup(task, vaddr);
+    return !area || area->mergeable
+           || (area->shared && !area->writable && !area->shm);
+}
 
-    //    TRACE("accept: %s: %p %d (old=%p)",
-    //        task->name, m->ool_recv.addr, m->ool_recv.len, task->ool_buf);
-    if (task->ool_buf) {
-        return ERR_ALREADY_EXISTS;
+/// Maps the sender's page at `src_vaddr` into the receiver at `dst_vaddr`
+/// instead of copying it. The page is shared as copy-on-write in both tasks.
+/// Returns false if the page needs to be copied instead.
+static bool remap_page(struct task *src_task, vaddr_t src_vaddr,
+                       struct task *dst_task, vaddr_t dst_vaddr) {
+    struct task *src = src_task->owner;
+    struct task *dst = dst_task->owner;
+    if (src_task == vm_task || dst_task == vm_task || src == dst
+        || !is_remappable(src, src_vaddr) || !is_remappable(dst, dst_vaddr)) {
+        return false;
     }
 
-    task->ool_buf = m->ool_recv.addr;
-    task->ool_len = m->ool_recv.len;
+    paddr_t paddr = vaddr2paddr(src, src_vaddr, false);
+    struct page_area *src_area = task_page_area_isolate(src, src_vaddr);
+    if (!paddr || !src_area) {
+        return false;
+    }
+
+    // Write-protect the sender's page: it will be copied when the sender
+    // writes into it.
+    if (!src_area->shared) {
+        if (map_page(src, src_vaddr, paddr, MAP_TYPE_READONLY, true) != OK) {
+            return false;
+        }
+
+        task_page_area_share(src, src_area, true);
+    }
+
+    // Replace the receiver's page. Keep the old page alive until it gets
+    // unmapped.
+    paddr_t old_paddr = 0;
+    struct page_area *dst_area = task_page_area_isolate(dst, dst_vaddr);
+    if (dst_area) {
+        old_paddr = dst_area->paddr;
+        page_incref(paddr2pfn(old_paddr), 1);
+        task_page_area_free(dst, dst_area);
+    }
+
+    task_page_share(dst, dst_vaddr, paddr, 1, true);
+    if (map_page(dst, dst_vaddr, paddr, MAP_TYPE_READONLY, true) != OK) {
+        // The page will be mapped on a page fault.
+        vm_unmap(dst->tid, dst_vaddr);
+    }
+
+    if (old_paddr) {
+        page_decref(paddr2pfn(old_paddr), 1);
+    }
+
+    return true;
+}
+
+/// Returns true if a sender can fill a receive buffer of the task: it has a
+/// registered buffer and room to keep track of the filled one.
+static bool ool_buf_available(struct task *task) {
+    return task->num_ool_bufs > 0
+           && task->num_received_ools < CONFIG_OOL_NUM_BUFS;
+}
+
+/// Copies OoL payloads from the senders waiting for the task's receive buffers
+/// as long as buffers are available.
+static void resume_ool_senders(struct task *task) {
+    while (ool_buf_available(task)) {
+        struct task *sender = LIST_POP_FRONT(&task->ool_sender_queue,
+                                             struct task, ool_sender_next);
+        if (!sender) {
+            break;
+        }
 
-    struct task *sender =
-        LIST_POP_FRONT(&task->ool_sender_queue, struct task, ool_sender_next);
-    if (sender) {
         struct message m;
         memcpy(&m, &sender->ool_sender_m, sizeof(m));
         //        TRACE("%s -> %s: src = %d / %d", task->name, sender->name,
@@ -54,32 +137,118 @@ error_t handle_ool_recv(struct message *m) {
             default:
                 OOPS_OK(err);
                 ipc_reply_err(sender->tid, err);
+                // The task may have been killed.
+                return;
         }
     }
+}
+
+/// Appends a receive buffer into the task's ring of receive buffers.
+static error_t add_ool_buf(struct task *task, vaddr_t addr, size_t len) {
+    if (task->num_ool_bufs >= CONFIG_OOL_NUM_BUFS) {
+        return ERR_NO_MEMORY;
+    }
 
+    unsigned i =
+        (task->ool_bufs_head + task->num_ool_bufs) % CONFIG_OOL_NUM_BUFS;
+    task->ool_bufs[i].addr = addr;
+    task->ool_bufs[i].len = len;
+    task->ool_bufs[i].from = 0;
+    task->num_ool_bufs++;
+    return OK;
+}
+
+error_t handle_ool_recv(struct message *m) {
+    struct task *task = task_lookup(m->src);
+    ASSERT(task);
+
+    //    TRACE("accept: %s: %p %d", task->name, m->ool_recv.addr,
+    //          m->ool_recv.len);
+    error_t err = add_ool_buf(task, m->ool_recv.addr, m->ool_recv.len);
+    if (err != OK) {
+        return err;
+    }
+
+    resume_ool_senders(task);
     m->type = OOL_RECV_REPLY_MSG;
     return OK;
 }
 
+/// Copies `len` bytes at `src` in the task's memory into `dst`.
+static error_t copy_from_task(struct task *task, void *dst, vaddr_t src,
+                              size_t len) {
+    if (task == vm_task) {
+        memcpy(dst, (void *) src, len);
+        return OK;
+    }
+
+    while (len > 0) {
+        offset_t off = src % PAGE_SIZE;
+        size_t copy_len = MIN(len, PAGE_SIZE - off);
+        paddr_t paddr =
+            vaddr2paddr(task->owner, ALIGN_DOWN(src, PAGE_SIZE), false);
+        if (!paddr) {
+            return ERR_INVALID_ARG;
+        }
+
+        void *page = page_ptr(paddr, (vaddr_t) __src_page);
+        if (!page) {
+            return ERR_NO_MEMORY;
+        }
+
+        memcpy(dst, (uint8_t *) page + off, copy_len);
+        dst = (uint8_t *) dst + copy_len;
+        src += copy_len;
+        len -= copy_len;
+    }
+
+    return OK;
+}
+
+error_t handle_ool_recv_bufs(struct message *m) {
+    struct task *task = task_lookup(m->src);
+    ASSERT(task);
+
+    size_t num = m->ool_recv_bufs.num;
+    if (num > CONFIG_OOL_NUM_BUFS - task->num_ool_bufs) {
+        return ERR_NO_MEMORY;
+    }
+
+    vaddr_t addrs[CONFIG_OOL_NUM_BUFS];
+    OK_OR_RETURN(
+        copy_from_task(task, addrs, m->ool_recv_bufs.bufs, num * sizeof(*addrs)));
+    for (size_t i = 0; i < num; i++) {
+        OK_OR_RETURN(add_ool_buf(task, addrs[i], m->ool_recv_bufs.len));
+    }
+
+    resume_ool_senders(task);
+    m->type = OOL_RECV_BUFS_REPLY_MSG;
+    return OK;
+}
+
 error_t handle_ool_verify(struct message *m) {
     struct task *task = task_lookup(m->src);
     ASSERT(task);
 
     //    TRACE("verify: %s: id=%p len=%d (src=%d)", task->name,
     //          m->ool_verify.id, m->ool_verify.len, m->src);
-    if (m->ool_verify.src != task->received_ool_from
-        || m->ool_verify.id != task->received_ool_buf
-        || m->ool_verify.len != task->received_ool_len) {
-        return ERR_INVALID_ARG;
-    }
+    for (unsigned i = 0; i < task->num_received_ools; i++) {
+        struct ool_buf *buf = &task->received_ools[i];
+        if (buf->from == m->ool_verify.src && buf->addr == m->ool_verify.id
+            && buf->len == m->ool_verify.len) {
+            m->type = OOL_VERIFY_REPLY_MSG;
+            m->ool_verify_reply.received_at = buf->addr;
 
-    m->type = OOL_VERIFY_REPLY_MSG;
-    m->ool_verify_reply.received_at = task->received_ool_buf;
+            // Fill the hole with the last one.
+            task->num_received_ools--;
+            *buf = task->received_ools[task->num_received_ools];
 
-    task->received_ool_buf = 0;
-    task->received_ool_len = 0;
-    task->received_ool_from = 0;
-    return OK;
+            resume_ool_senders(task);
+            return OK;
+        }
+    }
+
+    return ERR_INVALID_ARG;
 }
 
 error_t handle_ool_send(struct message *m) {
@@ -91,23 +260,47 @@ error_t handle_ool_send(struct message *m) {
         return ERR_NOT_FOUND;
     }
 
+    if (dst_task->endpoint) {
+        // We don't know which task will receive the message sent to the
+        // endpoint.
+        WARN_DBG("%s: OoL payloads can't be sent to an endpoint",
+                 src_task->name);
+        return ERR_NOT_ACCEPTABLE;
+    }
+
     //    TRACE("do_copy: %s -> %s: %p -> %p, len=%d",
     //        src_task->name, dst_task->name,
     //        m->ool_send.addr, dst_task->ool_buf,
     //        m->ool_send.len);
-    if (!dst_task->ool_buf) {
+    if (!ool_buf_available(dst_task)) {
         memcpy(&src_task->ool_sender_m, m, sizeof(*m));
         list_push_back(&dst_task->ool_sender_queue, &src_task->ool_sender_next);
         return DONT_REPLY;
     }
 
+    // Fill the oldest receive buffer.
+    struct ool_buf *buf = &dst_task->ool_bufs[dst_task->ool_bufs_head];
     size_t len = m->ool_send.len;
     vaddr_t src_buf = m->ool_send.addr;
-    vaddr_t dst_buf = dst_task->ool_buf;
-    DEBUG_ASSERT(len <= dst_task->ool_len);
+    vaddr_t dst_buf = buf->addr;
+    DEBUG_ASSERT(len <= buf->len);
+
+    // Large page-aligned payloads are remapped copy-on-write instead of
+    // being copied.
+    bool remap = len >= CONFIG_VM_OOL_REMAP_MIN_PAGES * PAGE_SIZE
+                 && IS_ALIGNED(src_buf, PAGE_SIZE)
+                 && IS_ALIGNED(dst_buf, PAGE_SIZE);
 
     size_t remaining = len;
     while (remaining > 0) {
+        if (remap && remaining >= PAGE_SIZE
+            && remap_page(src_task, src_buf, dst_task, dst_buf)) {
+            remaining -= PAGE_SIZE;
+            dst_buf += PAGE_SIZE;
+            src_buf += PAGE_SIZE;
+            continue;
+        }
+
         offset_t src_off = src_buf % PAGE_SIZE;
         offset_t dst_off = dst_buf % PAGE_SIZE;
         size_t copy_len =
@@ -118,15 +311,19 @@ error_t handle_ool_send(struct message *m) {
             src_ptr = (void *) src_buf;
         } else {
             paddr_t src_paddr =
-                vaddr2paddr(src_task, ALIGN_DOWN(src_buf, PAGE_SIZE), false);
+                vaddr2paddr(src_task->owner, ALIGN_DOWN(src_buf, PAGE_SIZE),
+                            false);
             if (!src_paddr) {
                 task_kill(src_task);
                 return DONT_REPLY;
             }
 
-            OK_OR_RETURN(map_page(vm_task, (vaddr_t) __src_page, src_paddr,
-                                  MAP_TYPE_READWRITE, true));
-            src_ptr = &__src_page[src_off];
+            void *src_page = page_ptr(src_paddr, (vaddr_t) __src_page);
+            if (!src_page) {
+                return ERR_NO_MEMORY;
+            }
+
+            src_ptr = (uint8_t *) src_page + src_off;
         }
 
         void *dst_ptr;
@@ -134,16 +331,19 @@ error_t handle_ool_send(struct message *m) {
             dst_ptr = (void *) dst_buf;
         } else {
             paddr_t dst_paddr =
-                vaddr2paddr(dst_task, ALIGN_DOWN(dst_buf, PAGE_SIZE), true);
+                vaddr2paddr(dst_task->owner, ALIGN_DOWN(dst_buf, PAGE_SIZE),
+                            true);
             if (!dst_paddr) {
                 task_kill(dst_task);
                 return ERR_UNAVAILABLE;
             }
 
-            // Temporarily map the pages into the our address space.
-            OK_OR_RETURN(map_page(vm_task, (vaddr_t) __dst_page, dst_paddr,
-                                  MAP_TYPE_READWRITE, true));
-            dst_ptr = &__dst_page[dst_off];
+            void *dst_page = page_ptr(dst_paddr, (vaddr_t) __dst_page);
+            if (!dst_page) {
+                return ERR_NO_MEMORY;
+            }
+
+            dst_ptr = (uint8_t *) dst_page + dst_off;
         }
 
         // Copy between the tasks.
@@ -153,13 +353,16 @@ error_t handle_ool_send(struct message *m) {
         src_buf += copy_len;
     }
 
-    dst_task->received_ool_buf = dst_task->ool_buf;
-    dst_task->received_ool_len = m->ool_send.len;
-    dst_task->received_ool_from = src_task->tid;
-    dst_task->ool_buf = 0;
-    dst_task->ool_len = 0;
+    // Move the buffer into the filled ones. It's released by ool.verify.
+    struct ool_buf *received =
+        &dst_task->received_ools[dst_task->num_received_ools++];
+    received->addr = buf->addr;
+    received->len = len;
+    received->from = src_task->tid;
+    dst_task->ool_bufs_head = (dst_task->ool_bufs_head + 1) % CONFIG_OOL_NUM_BUFS;
+    dst_task->num_ool_bufs--;
 
     m->type = OOL_SEND_REPLY_MSG;
-    m->ool_send_reply.id = dst_task->received_ool_buf;
+    m->ool_send_reply.id = received->addr;
     return OK;
 }
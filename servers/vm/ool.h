@@ -5,6 +5,7 @@
 
 struct message;
 error_t handle_ool_recv(struct message *m);
+error_t handle_ool_recv_bufs(struct message *m);
 error_t handle_ool_send(struct message *m);
 error_t handle_ool_verify(struct message *m);
 
@@ -1,73 +1,395 @@
 #include "page_alloc.h"
 #include "page_fault.h"
 #include "task.h"
+#include <arch/cycles.h>
 #include <bootinfo.h>
+#include <config.h>
 #include <resea/malloc.h>
 #include <resea/printf.h>
+#include <resea/task.h>
+#include <string.h>
 
 extern char __free_vaddr_end[];
 
 size_t num_unused_pages = 0;
-static struct page pages[PAGES_MAX];
-static list_t regions;
+/// The result of page_alloc_benchmark() (zeros if not measured).
+struct page_alloc_benchmark page_alloc_benchmark_result;
+/// The number of page_alloc() calls failed due to the shortage of memory.
+size_t num_alloc_failures = 0;
+/// Pages in available RAM regions indexed by PFN. It's allocated in
+/// page_alloc_init() to cover RAM regions described in the memory map.
+static struct page *pages = NULL;
+static size_t pages_len = 0;
+/// The base address of the direct map: the window in vm's virtual address space
+/// where physical memory pages are mapped linearly. Zero if it's not available.
+static vaddr_t direct_map_base = 0;
+/// Free blocks in the buddy allocator. `free_lists[i]` holds free blocks of
+/// `1 << i` pages.
+static list_t free_lists[PAGE_ORDER_MAX + 1];
 
 pfn_t paddr2pfn(paddr_t paddr) {
     ASSERT(IS_ALIGNED(paddr, PAGE_SIZE) && paddr >= PAGES_BASE_ADDR);
     return (paddr - PAGES_BASE_ADDR) / PAGE_SIZE;
 }
 
+/// Returns the smallest order which contains `num_pages` pages.
+static unsigned pages2order(size_t num_pages) {
+    unsigned order = 0;
+    while ((1ULL << order) < num_pages) {
+        order++;
+    }
+
+    return order;
+}
+
+/// Inserts a free block into the free list, merging it with its buddy blocks
+/// as long as possible.
+static void free_block(pfn_t pfn, unsigned order) {
+    num_unused_pages += 1 << order;
+    while (order < PAGE_ORDER_MAX) {
+        pfn_t buddy = pfn ^ (1 << order);
+        if (buddy >= pages_len || !(pages[buddy].flags & PAGE_FREE)
+            || pages[buddy].order != order) {
+            break;
+        }
+
+        // The buddy is also free: merge them into a larger block.
+        list_remove(&pages[buddy].next);
+        pages[buddy].flags &= ~PAGE_FREE;
+        pfn = MIN(pfn, buddy);
+        order++;
+    }
+
+    pages[pfn].flags |= PAGE_FREE;
+    pages[pfn].order = order;
+    list_push_back(&free_lists[order], &pages[pfn].next);
+}
+
+/// Frees `num_pages` pages from `pfn` by splitting them into aligned blocks.
+static void free_range(pfn_t pfn, size_t num_pages) {
+    while (num_pages > 0) {
+        unsigned order = 0;
+        while (order < PAGE_ORDER_MAX && IS_ALIGNED(pfn, 1 << (order + 1))
+               && (1ULL << (order + 1)) <= num_pages) {
+            order++;
+        }
+
+        free_block(pfn, order);
+        pfn += 1 << order;
+        num_pages -= 1 << order;
+    }
+}
+
+/// Removes a free block of the given order from the free lists, splitting a
+/// larger one if needed. Returns the first PFN of the block or false if there
+/// are no sufficiently large free blocks.
+static bool alloc_block(unsigned order, pfn_t *pfn) {
+    unsigned i = order;
+    while (i <= PAGE_ORDER_MAX && list_is_empty(&free_lists[i])) {
+        i++;
+    }
+
+    if (i > PAGE_ORDER_MAX) {
+        return false;
+    }
+
+    struct page *page = LIST_POP_FRONT(&free_lists[i], struct page, next);
+    page->flags &= ~PAGE_FREE;
+    *pfn = page - pages;
+
+    // Return the unused upper halves into the free lists.
+    while (i > order) {
+        i--;
+        pfn_t half = *pfn + (1 << i);
+        pages[half].flags |= PAGE_FREE;
+        pages[half].order = i;
+        list_push_back(&free_lists[i], &pages[half].next);
+    }
+
+    num_unused_pages -= 1 << order;
+    return true;
+}
+
+/// Takes a free page out of the free block containing it so that it can be
+/// referenced (e.g. mapped by vm.alloc_pages with a specific paddr).
+static void claim_free_page(pfn_t pfn) {
+    for (unsigned order = 0; order <= PAGE_ORDER_MAX; order++) {
+        pfn_t head = ALIGN_DOWN(pfn, 1 << order);
+        struct page *page = &pages[head];
+        if ((page->flags & PAGE_FREE) && page->order == order) {
+            list_remove(&page->next);
+            page->flags &= ~PAGE_FREE;
+            num_unused_pages -= 1 << order;
+            free_range(head, pfn - head);
+            free_range(pfn + 1, (head + (1 << order)) - (pfn + 1));
+            return;
+        }
+    }
+
+    UNREACHABLE();
+}
+
 void page_incref(pfn_t pfn, size_t num_pages) {
-    ASSERT(pfn + num_pages <= PAGES_MAX);
     for (size_t i = 0; i < num_pages; i++) {
-        if (!pages[pfn + i].ref_count) {
-            num_unused_pages--;
+        if (pfn + i >= pages_len) {
+            // Not a RAM page (e.g. memory-mapped I/O area).
+            continue;
+        }
+
+        struct page *page = &pages[pfn + i];
+        if (!page->ref_count && (page->flags & PAGE_RAM)) {
+            claim_free_page(pfn + i);
         }
 
-        pages[pfn + i].ref_count++;
+        page->ref_count++;
     }
 }
 
 void page_decref(pfn_t pfn, size_t num_pages) {
-    ASSERT(pfn + num_pages <= PAGES_MAX);
+    // Free pages in runs of unreferenced pages to keep blocks as large as
+    // possible.
+    pfn_t run_start = 0;
+    size_t run_len = 0;
     for (size_t i = 0; i < num_pages; i++) {
-        ASSERT(pages[pfn + i].ref_count > 0);
-        pages[pfn + i].ref_count--;
+        if (pfn + i >= pages_len) {
+            continue;
+        }
+
+        struct page *page = &pages[pfn + i];
+        ASSERT(page->ref_count > 0);
+        page->ref_count--;
 
-        if (!pages[pfn + i].ref_count) {
-            num_unused_pages++;
+        if (!page->ref_count && (page->flags & PAGE_RAM)) {
+            if (run_len > 0 && run_start + run_len == pfn + i) {
+                run_len++;
+                continue;
+            }
+
+            free_range(run_start, run_len);
+            run_start = pfn + i;
+            run_len = 1;
         }
     }
+
+    free_range(run_start, run_len);
 }
 
-/// Allocates continuous physical memory pages. It always returns a valid
-/// physical address: when it runs out of memory, it panics.
+/// Allocates continuous physical memory pages. Returns 0 if it runs out of
+/// memory.
+///
+/// A single page is taken from the free list in O(1). Continuous pages are
+/// taken from the smallest sufficiently large block and the unused tail of the
+/// block is returned into the free lists.
 paddr_t page_alloc(size_t num_pages) {
-    LIST_FOR_EACH (region, &regions, struct available_ram_region, next) {
-        pfn_t first = paddr2pfn(region->base);
-        pfn_t end = first + region->num_pages;
-        for (pfn_t base = first; base < end; base++) {
-            size_t i = 0;
-            while (base + i < end) {
-                if (pages[base + i].ref_count > 0) {
-                    break;
-                }
+    ASSERT(num_pages > 0);
+    unsigned order = pages2order(num_pages);
+    pfn_t pfn;
+    if (order > PAGE_ORDER_MAX || !alloc_block(order, &pfn)) {
+        WARN_DBG("out of memory (%d pages)", num_pages);
+        num_alloc_failures++;
+        return 0;
+    }
 
-                i++;
-                if (i == num_pages) {
-                    break;
-                }
-            }
+    size_t block_len = 1 << order;
+    free_range(pfn + num_pages, block_len - num_pages);
 
-            if (i == num_pages) {
-                // Found sufficiently large free physical pages.
-                page_incref(base, num_pages);
-                paddr_t paddr = PAGES_BASE_ADDR + base * PAGE_SIZE;
-                return paddr;
-            }
+    for (size_t i = 0; i < num_pages; i++) {
+        DEBUG_ASSERT(!pages[pfn + i].ref_count);
+        pages[pfn + i].ref_count = 1;
+    }
+
+    return PAGES_BASE_ADDR + pfn * PAGE_SIZE;
+}
+
+/// Returns the number of references to the physical page.
+unsigned page_ref_count(paddr_t paddr) {
+    pfn_t pfn = paddr2pfn(paddr);
+    return (pfn < pages_len) ? pages[pfn].ref_count : 0;
+}
+
+static int compare_vaddr(struct avl_node *a, struct avl_node *b) {
+    vaddr_t x = AVL_CONTAINER(a, struct page_area, vaddr_node)->vaddr;
+    vaddr_t y = AVL_CONTAINER(b, struct page_area, vaddr_node)->vaddr;
+    return (x < y) ? -1 : (x > y);
+}
+
+static int compare_paddr(struct avl_node *a, struct avl_node *b) {
+    paddr_t x = AVL_CONTAINER(a, struct page_area, paddr_node)->paddr;
+    paddr_t y = AVL_CONTAINER(b, struct page_area, paddr_node)->paddr;
+    return (x < y) ? -1 : (x > y);
+}
+
+/// Returns the page area which contains `vaddr` or NULL if it does not exist.
+/// O(log n).
+struct page_area *page_area_lookup(struct task *task, vaddr_t vaddr) {
+    // Look for the area with the greatest start address <= vaddr.
+    struct page_area *found = NULL;
+    struct avl_node *node = task->page_areas_by_vaddr.root;
+    while (node) {
+        struct page_area *area =
+            AVL_CONTAINER(node, struct page_area, vaddr_node);
+        if (area->vaddr <= vaddr) {
+            found = area;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+
+    if (found && vaddr < found->vaddr + found->num_pages * PAGE_SIZE) {
+        return found;
+    }
+
+    return NULL;
+}
+
+/// Adds (or subtracts if `charge` is false) the pages in `area` to the memory
+/// usage of the task.
+static void page_area_account(struct task *task, struct page_area *area,
+                              bool charge) {
+    size_t *counter;
+    if (area->shm) {
+        counter = &task->mem.shm;
+    } else if (area->shared) {
+        counter = &task->mem.shared;
+    } else if (area->vaddr) {
+        counter = &task->mem.resident;
+    } else {
+        // Pages not mapped into the task are used for page tables.
+        counter = &task->mem.page_tables;
+    }
+
+    if (charge) {
+        *counter += area->num_pages;
+    } else {
+        DEBUG_ASSERT(*counter >= area->num_pages);
+        *counter -= area->num_pages;
+    }
+}
+
+/// Returns true if allocating `num_pages` private pages for the task exceeds
+/// its limit (`task->mem.max_pages`).
+bool task_page_quota_exceeded(struct task *task, size_t num_pages) {
+    struct task_mem *mem = &task->mem;
+    if (mem->max_pages
+        && mem->resident + mem->page_tables + mem->shm_created + num_pages
+               > mem->max_pages) {
+        WARN_DBG("%s: exceeded the memory limit (%d pages)", task->name,
+                 mem->max_pages);
+        return true;
+    }
+
+    return false;
+}
+
+/// Merges `next` into `prev` if both are mergeable and continuous in both
+/// virtual and physical address spaces. Returns true if merged.
+static bool try_merge(struct task *task, struct page_area *prev,
+                      struct page_area *next) {
+    if (!prev || !next || !prev->mergeable || !next->mergeable) {
+        return false;
+    }
+
+    size_t prev_len = prev->num_pages * PAGE_SIZE;
+    if (prev->vaddr + prev_len != next->vaddr
+        || prev->paddr + prev_len != next->paddr) {
+        return false;
+    }
+
+    prev->num_pages += next->num_pages;
+    list_remove(&next->next);
+    avl_remove(&task->page_areas_by_vaddr, &next->vaddr_node);
+    avl_remove(&task->page_areas_by_paddr, &next->paddr_node);
+    free(next);
+    return true;
+}
+
+/// Allocates a page area and inserts it into the task's page area lists.
+static struct page_area *page_area_insert(struct task *task, vaddr_t vaddr,
+                                          paddr_t paddr, size_t num_pages,
+                                          bool mergeable) {
+    struct page_area *area = malloc(sizeof(*area));
+    area->vaddr = vaddr;
+    area->paddr = paddr;
+    area->num_pages = num_pages;
+    area->mergeable = mergeable && vaddr;
+    area->shared = false;
+    area->cow = false;
+    area->writable = false;
+    area->shm = false;
+    area->large = false;
+    page_area_account(task, area, true);
+    list_push_back(&task->page_areas, &area->next);
+    avl_insert(&task->page_areas_by_paddr, &area->paddr_node, compare_paddr);
+    if (vaddr) {
+        avl_insert(&task->page_areas_by_vaddr, &area->vaddr_node,
+                   compare_vaddr);
+    }
+
+    return area;
+}
+
+/// Registers a page area allocated for the task. Returns the area which
+/// contains the pages (it may be an existing one merged with them).
+static struct page_area *page_area_add(struct task *task, vaddr_t vaddr,
+                                       paddr_t paddr, size_t num_pages,
+                                       bool mergeable) {
+    struct page_area *area =
+        page_area_insert(task, vaddr, paddr, num_pages, mergeable);
+    if (area->mergeable) {
+        struct page_area *prev = page_area_lookup(task, vaddr - PAGE_SIZE);
+        struct page_area *next =
+            page_area_lookup(task, vaddr + num_pages * PAGE_SIZE);
+        if (try_merge(task, prev, area)) {
+            area = prev;
         }
+
+        try_merge(task, area, next);
+    }
+
+    return area;
+}
+
+/// Splits `area` at `vaddr` and returns the latter one.
+static struct page_area *page_area_split(struct task *task,
+                                         struct page_area *area,
+                                         vaddr_t vaddr) {
+    size_t num_pages = (vaddr - area->vaddr) / PAGE_SIZE;
+    DEBUG_ASSERT(0 < num_pages && num_pages < area->num_pages);
+    DEBUG_ASSERT(!area->large && !area->shm);
+
+    page_area_account(task, area, false);
+    struct page_area *latter = page_area_insert(
+        task, vaddr, area->paddr + num_pages * PAGE_SIZE,
+        area->num_pages - num_pages, area->mergeable);
+    page_area_account(task, latter, false);
+    latter->shared = area->shared;
+    latter->cow = area->cow;
+    latter->writable = area->writable;
+    area->num_pages = num_pages;
+    page_area_account(task, area, true);
+    page_area_account(task, latter, true);
+    return latter;
+}
+
+/// Splits the page area which contains `vaddr` so that the page at `vaddr`
+/// has its own page area. Returns NULL if the page is not allocated.
+struct page_area *task_page_area_isolate(struct task *task, vaddr_t vaddr) {
+    DEBUG_ASSERT(IS_ALIGNED(vaddr, PAGE_SIZE));
+    struct page_area *area = page_area_lookup(task, vaddr);
+    if (!area) {
+        return NULL;
+    }
+
+    if (area->vaddr < vaddr) {
+        area = page_area_split(task, area, vaddr);
+    }
+
+    if (area->num_pages > 1) {
+        page_area_split(task, area, vaddr + PAGE_SIZE);
     }
 
-    PANIC("out of memory");
+    return area;
 }
 
 static bool is_mappable_paddr_range(paddr_t paddr, size_t num_pages) {
@@ -92,6 +414,10 @@ static bool is_mappable_paddr_range(paddr_t paddr, size_t num_pages) {
 /// non-mappable.
 error_t task_page_alloc(struct task *task, vaddr_t *vaddr, paddr_t *paddr,
                         size_t num_pages) {
+    if (task_page_quota_exceeded(task, num_pages)) {
+        return ERR_NO_MEMORY;
+    }
+
     if (*paddr) {
         if (!IS_ALIGNED(*paddr, PAGE_SIZE)) {
             WARN_DBG("%s: unaligned paddr %p", __func__, *paddr);
@@ -103,6 +429,13 @@ error_t task_page_alloc(struct task *task, vaddr_t *vaddr, paddr_t *paddr,
             return ERR_NOT_ACCEPTABLE;
         }
 
+        if (vaddr != NULL && !*vaddr) {
+            *vaddr = virt_page_alloc(task, num_pages);
+            if (!*vaddr) {
+                return ERR_NO_MEMORY;
+            }
+        }
+
         // Map the specified physical memory address.
         for (size_t i = 0; i < num_pages; i++) {
             offset_t off = i * PAGE_SIZE;
@@ -116,6 +449,9 @@ error_t task_page_alloc(struct task *task, vaddr_t *vaddr, paddr_t *paddr,
         page_incref(paddr2pfn(*paddr), num_pages);
     } else {
         *paddr = page_alloc(num_pages);
+        if (!*paddr) {
+            return ERR_NO_MEMORY;
+        }
     }
 
     if (vaddr != NULL && !*vaddr) {
@@ -125,20 +461,195 @@ error_t task_page_alloc(struct task *task, vaddr_t *vaddr, paddr_t *paddr,
         }
     }
 
-    struct page_area *area = malloc(sizeof(*area));
-    area->vaddr = (vaddr != NULL) ? *vaddr : 0;
-    area->paddr = *paddr;
-    area->num_pages = num_pages;
-    list_push_back(&task->page_areas, &area->next);
+    page_area_add(task, (vaddr != NULL) ? *vaddr : 0, *paddr, num_pages,
+                  false);
     return OK;
 }
 
-/// Allocates a virtual address space by so-called the bump pointer allocation
-/// algorithm. Unlike task_page_alloc(), it doesn't maps to a physical memory
-/// pages.
+/// Unmaps the pages at [vaddr, vaddr + len). If `large` is true, they're
+/// mapped with large pages except the tail shorter than a large page.
+static void unmap_pages(struct task *task, vaddr_t vaddr, size_t len,
+                        bool large) {
+    offset_t off = 0;
+    while (off < len) {
+        size_t size = (large && len - off >= LARGE_PAGE_SIZE) ? LARGE_PAGE_SIZE
+                                                              : PAGE_SIZE;
+        vm_unmap(task->tid, vaddr + off);
+        off += size;
+    }
+}
+
+/// Same as task_page_alloc() but maps the pages with large pages to reduce TLB
+/// misses: the physical pages and the virtual address are aligned to
+/// LARGE_PAGE_SIZE, and the tail shorter than a large page is mapped with
+/// normal pages. Unlike task_page_alloc(), the pages are mapped immediately.
+///
+/// Returns ERR_UNAVAILABLE if large pages can't be used (the area is smaller
+/// than a large page, `*paddr` is not aligned, there're no aligned continuous
+/// free pages, or the kernel doesn't support them) so that the caller falls
+/// back to task_page_alloc().
+error_t task_page_alloc_large(struct task *task, vaddr_t *vaddr,
+                              paddr_t *paddr, size_t num_pages) {
+    if (num_pages < LARGE_PAGE_SIZE / PAGE_SIZE
+        || !IS_ALIGNED(*paddr, LARGE_PAGE_SIZE)) {
+        return ERR_UNAVAILABLE;
+    }
+
+    if (task_page_quota_exceeded(task, num_pages)) {
+        return ERR_NO_MEMORY;
+    }
+
+    paddr_t base = *paddr;
+    if (base) {
+        if (!is_mappable_paddr_range(base, num_pages)) {
+            WARN_DBG("%s: invalid paddr %p", __func__, base);
+            return ERR_NOT_ACCEPTABLE;
+        }
+    } else {
+        // A block in the buddy allocator is aligned to its size: it's aligned
+        // to a large page as long as the pages base address is.
+        base = page_alloc(num_pages);
+        if (!base) {
+            return ERR_UNAVAILABLE;
+        }
+
+        if (!IS_ALIGNED(base, LARGE_PAGE_SIZE)) {
+            page_decref(paddr2pfn(base), num_pages);
+            return ERR_UNAVAILABLE;
+        }
+    }
+
+    vaddr_t vbase = virt_page_alloc_aligned(task, num_pages, LARGE_PAGE_SIZE);
+    if (!vbase) {
+        if (!*paddr) {
+            page_decref(paddr2pfn(base), num_pages);
+        }
+        return ERR_NO_MEMORY;
+    }
+
+    size_t len = num_pages * PAGE_SIZE;
+    offset_t off = 0;
+    while (off < len) {
+        bool large = len - off >= LARGE_PAGE_SIZE;
+        unsigned flags = MAP_TYPE_READWRITE | (large ? MAP_LARGE : 0);
+        error_t err = map_page(task, vbase + off, base + off, flags, false);
+        if (err != OK) {
+            WARN_DBG("%s: failed to map a large page: %s", task->name,
+                     err2str(err));
+            unmap_pages(task, vbase, off, true);
+            virt_page_free(task, vbase, num_pages);
+            if (!*paddr) {
+                page_decref(paddr2pfn(base), num_pages);
+            }
+            return ERR_UNAVAILABLE;
+        }
+
+        off += large ? LARGE_PAGE_SIZE : PAGE_SIZE;
+    }
+
+    if (*paddr) {
+        page_incref(paddr2pfn(base), num_pages);
+    }
+
+    struct page_area *area = page_area_add(task, vbase, base, num_pages, false);
+    area->large = true;
+    *vaddr = vbase;
+    *paddr = base;
+    return OK;
+}
+
+/// Allocates continuous physical memory pages for `vaddr` on a page fault
+/// (demand paging). Unlike task_page_alloc(), the page area can be merged with
+/// the adjacent ones.
+error_t task_page_alloc_demand(struct task *task, vaddr_t vaddr,
+                               size_t num_pages, paddr_t *paddr) {
+    if (task_page_quota_exceeded(task, num_pages)) {
+        return ERR_NO_MEMORY;
+    }
+
+    *paddr = page_alloc(num_pages);
+    if (!*paddr) {
+        return ERR_NO_MEMORY;
+    }
+
+    task_page_add_demand(task, vaddr, *paddr, num_pages);
+    return OK;
+}
+
+/// Same as task_page_alloc_demand() but uses the pages allocated by the caller
+/// (e.g. taken from the pre-zeroed page pool). The task takes over the
+/// caller's reference to the pages.
+void task_page_add_demand(struct task *task, vaddr_t vaddr, paddr_t paddr,
+                          size_t num_pages) {
+    DEBUG_ASSERT(IS_ALIGNED(vaddr, PAGE_SIZE));
+    page_area_add(task, vaddr, paddr, num_pages, true);
+}
+
+/// Maps physical memory pages shared with other tasks (e.g. pages in a page
+/// cache) at `vaddr`. The pages are mapped as read-only unless the caller sets
+/// `writable` of the returned area. If `cow` is true, they are copied when the
+/// task writes into them (copy-on-write).
+struct page_area *task_page_share(struct task *task, vaddr_t vaddr,
+                                  paddr_t paddr, size_t num_pages, bool cow) {
+    page_incref(paddr2pfn(paddr), num_pages);
+    struct page_area *area = page_area_add(task, vaddr, paddr, num_pages, false);
+    task_page_area_share(task, area, cow);
+    return area;
+}
+
+/// Marks the task's private page area as shared with other tasks.
+void task_page_area_share(struct task *task, struct page_area *area,
+                          bool cow) {
+    page_area_account(task, area, false);
+    area->mergeable = false;
+    area->shared = true;
+    area->cow = cow;
+    page_area_account(task, area, true);
+}
+
+/// Marks the shared page area as a shared memory area (shm.map). Its pages
+/// are accounted as `shm` instead of `shared`.
+void task_page_area_share_shm(struct task *task, struct page_area *area) {
+    DEBUG_ASSERT(area->shared && !area->cow);
+    page_area_account(task, area, false);
+    area->shm = true;
+    page_area_account(task, area, true);
+}
+
+static int compare_vaddr_range(struct avl_node *a, struct avl_node *b) {
+    vaddr_t x = AVL_CONTAINER(a, struct vaddr_range, node)->base;
+    vaddr_t y = AVL_CONTAINER(b, struct vaddr_range, node)->base;
+    return (x < y) ? -1 : (x > y);
+}
+
+/// Allocates a virtual address space. Unlike task_page_alloc(), it doesn't
+/// maps to a physical memory pages.
+///
+/// It reuses the first sufficiently large range freed by virt_page_free().
+/// If there's no such one, it allocates a new one by so-called the bump
+/// pointer allocation algorithm.
 vaddr_t virt_page_alloc(struct task *task, size_t num_pages) {
-    vaddr_t vaddr = task->free_vaddr;
     size_t size = num_pages * PAGE_SIZE;
+    for (struct avl_node *node = avl_first(&task->free_vaddr_ranges); node;
+         node = avl_next(node)) {
+        struct vaddr_range *range =
+            AVL_CONTAINER(node, struct vaddr_range, node);
+        if (range->num_pages >= num_pages) {
+            // Take the beginning of the range. Its order in the tree doesn't
+            // change since free ranges never overlap.
+            vaddr_t vaddr = range->base;
+            range->base += size;
+            range->num_pages -= num_pages;
+            if (!range->num_pages) {
+                avl_remove(&task->free_vaddr_ranges, &range->node);
+                free(range);
+            }
+
+            return vaddr;
+        }
+    }
+
+    vaddr_t vaddr = task->free_vaddr;
 
     if (vaddr + size >= (vaddr_t) __free_vaddr_end) {
         // Task's virtual memory space has been exhausted.
@@ -151,69 +662,354 @@ vaddr_t virt_page_alloc(struct task *task, size_t num_pages) {
     return vaddr;
 }
 
-static void free_page_area(struct page_area *area) {
+/// Same as virt_page_alloc() but the address is aligned to `align` bytes. The
+/// unused space before and after the aligned range is freed.
+vaddr_t virt_page_alloc_aligned(struct task *task, size_t num_pages,
+                                size_t align) {
+    size_t slack = align / PAGE_SIZE - 1;
+    vaddr_t base = virt_page_alloc(task, num_pages + slack);
+    if (!base) {
+        return 0;
+    }
+
+    vaddr_t vaddr = ALIGN_UP(base, align);
+    size_t head = (vaddr - base) / PAGE_SIZE;
+    if (head > 0) {
+        virt_page_free(task, base, head);
+    }
+
+    if (slack - head > 0) {
+        virt_page_free(task, vaddr + num_pages * PAGE_SIZE, slack - head);
+    }
+
+    return vaddr;
+}
+
+/// Frees a virtual address space allocated by virt_page_alloc(). It's merged
+/// with the adjacent free ranges.
+void virt_page_free(struct task *task, vaddr_t vaddr, size_t num_pages) {
+    size_t size = num_pages * PAGE_SIZE;
+
+    // Look for the free ranges right before and after the freed one.
+    struct vaddr_range *prev = NULL;
+    struct vaddr_range *next = NULL;
+    struct avl_node *node = task->free_vaddr_ranges.root;
+    while (node) {
+        struct vaddr_range *range =
+            AVL_CONTAINER(node, struct vaddr_range, node);
+        if (range->base < vaddr) {
+            prev = range;
+            node = node->right;
+        } else {
+            next = range;
+            node = node->left;
+        }
+    }
+
+    DEBUG_ASSERT(!prev || prev->base + prev->num_pages * PAGE_SIZE <= vaddr);
+    DEBUG_ASSERT(!next || vaddr + size <= next->base);
+
+    struct vaddr_range *range;
+    if (prev && prev->base + prev->num_pages * PAGE_SIZE == vaddr) {
+        range = prev;
+        range->num_pages += num_pages;
+        if (next && vaddr + size == next->base) {
+            range->num_pages += next->num_pages;
+            avl_remove(&task->free_vaddr_ranges, &next->node);
+            free(next);
+        }
+    } else if (next && vaddr + size == next->base) {
+        range = next;
+        range->base = vaddr;
+        range->num_pages += num_pages;
+    } else {
+        range = malloc(sizeof(*range));
+        range->base = vaddr;
+        range->num_pages = num_pages;
+        avl_insert(&task->free_vaddr_ranges, &range->node,
+                   compare_vaddr_range);
+    }
+
+    // Give the range back to the bump pointer if it's at the end.
+    if (range->base + range->num_pages * PAGE_SIZE == task->free_vaddr) {
+        task->free_vaddr = range->base;
+        avl_remove(&task->free_vaddr_ranges, &range->node);
+        free(range);
+    }
+}
+
+/// Frees a page area of the task and drops the references to its pages.
+void task_page_area_free(struct task *task, struct page_area *area) {
+    page_area_account(task, area, false);
     page_decref(paddr2pfn(area->paddr), area->num_pages);
     list_remove(&area->next);
+    if (area->vaddr) {
+        avl_remove(&task->page_areas_by_vaddr, &area->vaddr_node);
+    }
+    avl_remove(&task->page_areas_by_paddr, &area->paddr_node);
     free(area);
 }
 
+/// Looks for the page area which begins at `paddr`.
+struct page_area *page_area_lookup_by_paddr(struct task *task, paddr_t paddr) {
+    struct avl_node *node = task->page_areas_by_paddr.root;
+    while (node) {
+        struct page_area *area =
+            AVL_CONTAINER(node, struct page_area, paddr_node);
+        if (area->paddr == paddr) {
+            return area;
+        }
+
+        node = (paddr < area->paddr) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
 /// Frees the physical memory pages allocated for the task. `paddr` is the
 /// beginning of the allocated physical memory area.
 void task_page_free(struct task *task, paddr_t paddr) {
-    LIST_FOR_EACH (area, &task->page_areas, struct page_area, next) {
-        if (area->paddr == paddr) {
-            free_page_area(area);
-            return;
-        }
+    struct page_area *area = page_area_lookup_by_paddr(task, paddr);
+    if (area) {
+        task_page_area_free(task, area);
+        return;
     }
 
     OOPS("failed to free paddr=%p in %s (double free?)", paddr, task->name);
 }
 
+/// Unmaps and frees the memory pages allocated at `vaddr` (e.g. by
+/// vm.alloc_pages).
+error_t task_page_free_by_vaddr(struct task *task, vaddr_t vaddr) {
+    struct page_area *area = page_area_lookup(task, vaddr);
+    if (!area || area->vaddr != vaddr || area->mergeable || area->shared) {
+        return ERR_NOT_FOUND;
+    }
+
+    size_t num_pages = area->num_pages;
+    unmap_pages(task, vaddr, num_pages * PAGE_SIZE, area->large);
+    task_page_area_free(task, area);
+    virt_page_free(task, vaddr, num_pages);
+    return OK;
+}
+
 /// Frees all memory areas allocated for the task.
 void task_page_free_all(struct task *task) {
     LIST_FOR_EACH (area, &task->page_areas, struct page_area, next) {
-        free_page_area(area);
+        task_page_area_free(task, area);
+    }
+
+    struct avl_node *node;
+    while ((node = avl_first(&task->free_vaddr_ranges)) != NULL) {
+        avl_remove(&task->free_vaddr_ranges, node);
+        free(AVL_CONTAINER(node, struct vaddr_range, node));
     }
 }
 
+/// Returns a pointer to the physical memory page `paddr` through the direct
+/// map. RAM pages are mapped in direct_map_init(): a page which failed to be
+/// mapped there is mapped on the first access and stays mapped. Returns NULL
+/// if the page is not in the direct map (e.g. memory-mapped I/O area).
+void *direct_map(paddr_t paddr) {
+    if (!direct_map_base || paddr < PAGES_BASE_ADDR) {
+        return NULL;
+    }
+
+    pfn_t pfn = paddr2pfn(paddr);
+    if (pfn >= pages_len || !(pages[pfn].flags & PAGE_RAM)) {
+        return NULL;
+    }
+
+    vaddr_t vaddr = direct_map_base + pfn * PAGE_SIZE;
+    if (!(pages[pfn].flags & PAGE_DIRECT_MAPPED)) {
+        if (map_page(vm_task, vaddr, paddr, MAP_TYPE_READWRITE, false) != OK) {
+            return NULL;
+        }
+
+        pages[pfn].flags |= PAGE_DIRECT_MAPPED;
+    }
+
+    return (void *) vaddr;
+}
+
+/// Returns true if all of `num_pages` pages from `pfn` are RAM.
+static bool is_ram_range(pfn_t pfn, size_t num_pages) {
+    for (size_t i = 0; i < num_pages; i++) {
+        if (!(pages[pfn + i].flags & PAGE_RAM)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// Maps all RAM pages into the direct map: with large pages where a whole
+/// large page is RAM, and with normal pages (a vm_map call per MAP_MAX_PAGES
+/// pages) elsewhere or if the kernel doesn't support large pages.
+static void direct_map_ram(void) {
+    size_t large_len = LARGE_PAGE_SIZE / PAGE_SIZE;
+    bool large_supported = true;
+    size_t num_large = 0;
+    pfn_t pfn = 0;
+    while (pfn < pages_len) {
+        paddr_t paddr = PAGES_BASE_ADDR + pfn * PAGE_SIZE;
+        vaddr_t vaddr = direct_map_base + pfn * PAGE_SIZE;
+        if (large_supported && IS_ALIGNED(paddr, LARGE_PAGE_SIZE)
+            && pfn + large_len <= pages_len && is_ram_range(pfn, large_len)) {
+            error_t err = map_page(vm_task, vaddr, paddr,
+                                   MAP_TYPE_READWRITE | MAP_LARGE, false);
+            if (err == OK) {
+                for (size_t i = 0; i < large_len; i++) {
+                    pages[pfn + i].flags |= PAGE_DIRECT_MAPPED;
+                }
+
+                num_large++;
+                pfn += large_len;
+                continue;
+            }
+
+            // Fall back to normal pages.
+            large_supported = err != ERR_UNAVAILABLE;
+        }
+
+        // Normal pages up to the next large page boundary.
+        size_t n = (LARGE_PAGE_SIZE - paddr % LARGE_PAGE_SIZE) / PAGE_SIZE;
+        n = MIN(MIN(n, (size_t) MAP_MAX_PAGES), pages_len - pfn);
+        paddr_t paddrs[MAP_MAX_PAGES];
+        bool has_ram = false;
+        for (size_t i = 0; i < n; i++) {
+            bool ram = (pages[pfn + i].flags & PAGE_RAM) != 0;
+            paddrs[i] = ram ? paddr + i * PAGE_SIZE : 0;
+            has_ram |= ram;
+        }
+
+        if (has_ram
+            && map_pages(vm_task, vaddr, paddrs, n, MAP_TYPE_READWRITE) == OK) {
+            for (size_t i = 0; i < n; i++) {
+                if (paddrs[i]) {
+                    pages[pfn + i].flags |= PAGE_DIRECT_MAPPED;
+                }
+            }
+        }
+
+        pfn += n;
+    }
+
+    TRACE("direct map: mapped %d large pages", num_large);
+}
+
+/// Reserves the direct map window in vm and maps RAM pages into it. If vm's
+/// virtual address space is too small to cover all RAM pages, pages are
+/// accessed through temporary mappings instead.
+void direct_map_init(void) {
+    // Leave room to align the window so that its large pages map aligned
+    // large pages of physical memory.
+    size_t num_pages = pages_len + LARGE_PAGE_SIZE / PAGE_SIZE;
+    if (vm_task->free_vaddr + num_pages * PAGE_SIZE
+        >= (vaddr_t) __free_vaddr_end) {
+        TRACE("vm's virtual address space is too small for the direct map");
+        return;
+    }
+
+    vaddr_t base = virt_page_alloc_aligned(vm_task, num_pages, LARGE_PAGE_SIZE);
+    if (!base) {
+        return;
+    }
+
+    direct_map_base = base + PAGES_BASE_ADDR % LARGE_PAGE_SIZE;
+    direct_map_ram();
+}
+
 extern struct bootinfo __bootinfo;
 
 void page_alloc_init(void) {
-    struct bootinfo_memmap_entry *m =
+    struct bootinfo_memmap_entry *memmap =
         (struct bootinfo_memmap_entry *) &__bootinfo.memmap;
 
-    list_init(&regions);
-    for (int i = 0; i < NUM_BOOTINFO_MEMMAP_MAX; i++, m++) {
-        if (m->type != BOOTINFO_MEMMAP_TYPE_AVAILABLE) {
+    // Determine the number of pages to be managed. RAM above
+    // PAGES_BASE_ADDR_END is not managed: `pages` would be too large and
+    // such pages can't be mapped through vm.alloc_pages anyway.
+    for (int i = 0; i < NUM_BOOTINFO_MEMMAP_MAX; i++) {
+        struct bootinfo_memmap_entry *m = &memmap[i];
+        paddr_t end = MIN(ALIGN_DOWN(m->base + m->len, PAGE_SIZE),
+                          (paddr_t) PAGES_BASE_ADDR_END);
+        if (m->type != BOOTINFO_MEMMAP_TYPE_AVAILABLE
+            || end <= PAGES_BASE_ADDR) {
             continue;
         }
 
-        if (m->base + m->len < PAGES_BASE_ADDR) {
-            continue;
-        }
+        pages_len = MAX(pages_len, paddr2pfn(end));
+    }
 
-        struct available_ram_region *region = malloc(sizeof(*region));
-        if (m->base < PAGES_BASE_ADDR) {
-            region->base = PAGES_BASE_ADDR;
-            size_t len = m->len - (PAGES_BASE_ADDR - m->base);
-            region->num_pages = len / PAGE_SIZE;
-        } else {
-            region->base = m->base;
-            region->num_pages = m->len / PAGE_SIZE;
+    pages = malloc(sizeof(*pages) * pages_len);
+    bzero(pages, sizeof(*pages) * pages_len);
+    for (unsigned i = 0; i <= PAGE_ORDER_MAX; i++) {
+        list_init(&free_lists[i]);
+    }
+
+    // Fill the free lists with available RAM regions.
+    for (int i = 0; i < NUM_BOOTINFO_MEMMAP_MAX; i++) {
+        struct bootinfo_memmap_entry *m = &memmap[i];
+        paddr_t base = ALIGN_UP(MAX(m->base, PAGES_BASE_ADDR), PAGE_SIZE);
+        paddr_t end = MIN(ALIGN_DOWN(m->base + m->len, PAGE_SIZE),
+                          (paddr_t) PAGES_BASE_ADDR_END);
+        if (m->type != BOOTINFO_MEMMAP_TYPE_AVAILABLE || end <= base) {
+            continue;
         }
 
-        size_t size_kb = (region->num_pages * PAGE_SIZE) / 1024;
+        size_t num_pages = (end - base) / PAGE_SIZE;
+        size_t size_kb = (num_pages * PAGE_SIZE) / 1024;
         size_t size_mb = size_kb / 1024;
-        TRACE("available RAM region #%d: %p-%p (%d%s)", i, region->base,
-              region->base + region->num_pages * PAGE_SIZE,
+        TRACE("available RAM region #%d: %p-%p (%d%s)", i, base, end,
               (size_mb > 0) ? size_mb : size_kb, (size_mb > 0) ? "MiB" : "KiB");
 
-        list_push_back(&regions, &region->next);
+        pfn_t first = paddr2pfn(base);
+        for (size_t j = 0; j < num_pages; j++) {
+            pages[first + j].flags |= PAGE_RAM;
+        }
+
+        free_range(first, num_pages);
+    }
+}
+
+/// The number of allocations measured for each size in page_alloc_benchmark().
+#define PAGE_ALLOC_BENCHMARK_ITERS 256
+
+/// Measures the average cycles of page_alloc() and page_decref() of
+/// `num_pages` pages.
+static void measure_page_alloc(size_t num_pages, uint64_t *alloc_cycles,
+                               uint64_t *free_cycles) {
+    static paddr_t paddrs[PAGE_ALLOC_BENCHMARK_ITERS];
+    uint64_t total = 0;
+    int n = 0;
+    for (; n < PAGE_ALLOC_BENCHMARK_ITERS; n++) {
+        uint64_t start = cycle_counter();
+        paddrs[n] = page_alloc(num_pages);
+        uint64_t end = cycle_counter();
+        if (!paddrs[n]) {
+            break;
+        }
+
+        total += end - start;
     }
 
-    for (pfn_t i = 0; i < PAGES_MAX; i++) {
-        pages[i].ref_count = 0;
-        num_unused_pages++;
+    *alloc_cycles = n ? total / n : 0;
+
+    total = 0;
+    for (int i = 0; i < n; i++) {
+        uint64_t start = cycle_counter();
+        page_decref(paddr2pfn(paddrs[i]), num_pages);
+        total += cycle_counter() - start;
     }
+
+    *free_cycles = n ? total / n : 0;
+}
+
+/// Measures the physical page allocator without IPC and mapping overheads.
+/// The result is reported through vm.stats. It runs at boot only if
+/// CONFIG_VM_PAGE_ALLOC_BENCHMARK is enabled.
+void page_alloc_benchmark(void) {
+    struct page_alloc_benchmark *r = &page_alloc_benchmark_result;
+    measure_page_alloc(1, &r->alloc_cycles, &r->free_cycles);
+    measure_page_alloc(16, &r->alloc_16_cycles, &r->free_16_cycles);
 }
@@ -6,34 +6,83 @@
 
 /// Page Frame Number.
 typedef unsigned pfn_t;
-#define PAGES_MAX ((4ULL * 1024 * 1024 * 1024) / PAGE_SIZE)
+
+/// The maximum order of blocks in the buddy allocator: the largest free block
+/// is `(1 << PAGE_ORDER_MAX) * PAGE_SIZE` bytes (4GiB).
+#define PAGE_ORDER_MAX 20
+
+/// The page is the first page of a free block in the buddy allocator.
+#define PAGE_FREE (1 << 0)
+/// The page is in an available RAM region. Other pages (holes between regions)
+/// are never allocated.
+#define PAGE_RAM (1 << 1)
+/// The page is mapped in the direct map of vm.
+#define PAGE_DIRECT_MAPPED (1 << 2)
 
 struct page {
     unsigned ref_count;
-};
-
-struct available_ram_region {
+    /// The order of the free block (valid only if PAGE_FREE is set).
+    uint8_t order;
+    uint8_t flags;
+    /// A (intrusive) list element in the free list (valid only if PAGE_FREE is
+    /// set).
     list_elem_t next;
-    paddr_t base;
-    size_t num_pages;
 };
 
 extern char __straight_mapping[];
-#define PAGES_BASE_ADDR     ((paddr_t) __straight_mapping)
-#define PAGES_BASE_ADDR_END (PAGES_MAX * PAGE_SIZE)
+#define PAGES_BASE_ADDR ((paddr_t) __straight_mapping)
+/// The end of physical memory addresses mappable through vm.alloc_pages.
+#define PAGES_BASE_ADDR_END (4ULL * 1024 * 1024 * 1024)
+
+/// The average cycles of page_alloc() and page_decref() measured by
+/// page_alloc_benchmark().
+struct page_alloc_benchmark {
+    uint64_t alloc_cycles;
+    uint64_t free_cycles;
+    /// The same for 16 continuous pages.
+    uint64_t alloc_16_cycles;
+    uint64_t free_16_cycles;
+};
 
 extern size_t num_unused_pages;
+extern size_t num_alloc_failures;
+extern struct page_alloc_benchmark page_alloc_benchmark_result;
 
 pfn_t paddr2pfn(paddr_t paddr);
 void page_incref(pfn_t pfn, size_t num_pages);
 void page_decref(pfn_t pfn, size_t num_pages);
 paddr_t page_alloc(size_t num_pages);
+unsigned page_ref_count(paddr_t paddr);
 struct task;
 error_t task_page_alloc(struct task *task, vaddr_t *vaddr, paddr_t *paddr,
                         size_t num_pages);
+error_t task_page_alloc_large(struct task *task, vaddr_t *vaddr,
+                              paddr_t *paddr, size_t num_pages);
+error_t task_page_alloc_demand(struct task *task, vaddr_t vaddr,
+                               size_t num_pages, paddr_t *paddr);
+void task_page_add_demand(struct task *task, vaddr_t vaddr, paddr_t paddr,
+                          size_t num_pages);
+struct page_area *task_page_share(struct task *task, vaddr_t vaddr,
+                                  paddr_t paddr, size_t num_pages, bool cow);
+void task_page_area_share(struct task *task, struct page_area *area,
+                          bool cow);
+void task_page_area_share_shm(struct task *task, struct page_area *area);
+bool task_page_quota_exceeded(struct task *task, size_t num_pages);
+struct page_area *page_area_lookup(struct task *task, vaddr_t vaddr);
+struct page_area *page_area_lookup_by_paddr(struct task *task, paddr_t paddr);
+struct page_area *task_page_area_isolate(struct task *task, vaddr_t vaddr);
 vaddr_t virt_page_alloc(struct task *task, size_t num_pages);
+vaddr_t virt_page_alloc_aligned(struct task *task, size_t num_pages,
+                                size_t align);
+void virt_page_free(struct task *task, vaddr_t vaddr, size_t num_pages);
+struct page_area;
+void task_page_area_free(struct task *task, struct page_area *area);
 void task_page_free(struct task *task, paddr_t paddr);
+error_t task_page_free_by_vaddr(struct task *task, vaddr_t vaddr);
 void task_page_free_all(struct task *task);
+void *direct_map(paddr_t paddr);
+void direct_map_init(void);
 void page_alloc_init(void);
+void page_alloc_benchmark(void);
 
 #endif
@@ -2,6 +2,8 @@
 #include "bootfs.h"
 #include "page_alloc.h"
 #include "task.h"
+#include "zero_pool.h"
+#include <config.h>
 #include <elf/elf.h>
 #include <resea/ipc.h>
 #include <resea/malloc.h>
@@ -13,6 +15,8 @@ extern char __zeroed_pages[];
 extern char __zeroed_pages_end[];
 
 static vaddr_t tmp_page = 0;
+/// A temporary mapping of the source page in copy-on-write.
+static vaddr_t cow_src_page = 0;
 
 error_t map_page(struct task *task, vaddr_t vaddr, paddr_t paddr,
                  unsigned flags, bool overwrite) {
@@ -45,10 +49,366 @@ error_t map_page(struct task *task, vaddr_t vaddr, paddr_t paddr,
     }
 }
 
-/// Tries to fill a page at `vaddr` for the task. Returns the allocated physical
-/// memory address on success or 0 on failure.
-paddr_t handle_page_fault(struct task *task, vaddr_t vaddr, vaddr_t ip,
-                          unsigned fault) {
+/// Maps pages at `paddrs[i]` into `vaddr + i * PAGE_SIZE` with a vm_map call
+/// per MAP_MAX_PAGES pages. A 0 in `paddrs` skips the page. On failure, some
+/// of the pages might have been mapped.
+error_t map_pages(struct task *task, vaddr_t vaddr, const paddr_t *paddrs,
+                  size_t num_pages, unsigned flags) {
+    for (size_t i = 0; i < num_pages; i += MAP_MAX_PAGES) {
+        size_t n = MIN(num_pages - i, MAP_MAX_PAGES);
+        while (true) {
+            paddr_t kpage = 0;
+            error_t err = task_page_alloc(task, NULL, &kpage, 1);
+            if (err != OK) {
+                return err;
+            }
+
+            err = vm_map(task->tid, vaddr + i * PAGE_SIZE, (vaddr_t) &paddrs[i],
+                         kpage, flags | MAP_PAGES(n));
+            if (err == ERR_TRY_AGAIN) {
+                // The kpage is used for a page table: retry the whole array.
+                continue;
+            }
+
+            task_page_free(task, kpage);
+            if (err != OK) {
+                WARN_DBG("%s: failed to map pages: %s (vaddr=%p)", task->name,
+                         err2str(err), vaddr + i * PAGE_SIZE);
+                return err;
+            }
+
+            break;
+        }
+    }
+
+    return OK;
+}
+
+/// Returns a pointer to access the physical memory page `paddr` from vm. The
+/// page is accessed through the direct map if possible. Otherwise, it's
+/// temporarily mapped at `scratch` (a page reserved in vm). Returns NULL on
+/// failure.
+void *page_ptr(paddr_t paddr, vaddr_t scratch) {
+    void *ptr = direct_map(paddr);
+    if (ptr) {
+        return ptr;
+    }
+
+    if (map_page(vm_task, scratch, paddr, MAP_TYPE_READWRITE, false) != OK) {
+        return NULL;
+    }
+
+    return (void *) scratch;
+}
+
+/// Fills a page at `paddr` for `vaddr`: with zeros if `phdr` is NULL or with
+/// the file data of the ELF segment `phdr` otherwise.
+static error_t fill_page(struct task *task, vaddr_t vaddr, paddr_t paddr,
+                         struct elf64_phdr *phdr) {
+    void *ptr = page_ptr(paddr, tmp_page);
+    if (!ptr) {
+        return ERR_NO_MEMORY;
+    }
+
+    if (phdr) {
+        size_t offset_in_segment = (vaddr - phdr->p_vaddr) + phdr->p_offset;
+        read_file(task->file, offset_in_segment, ptr, PAGE_SIZE);
+    } else {
+        memset(ptr, 0, PAGE_SIZE);
+    }
+
+    return OK;
+}
+
+/// Returns true if the page at `vaddr` has not yet been filled.
+static bool is_unpopulated(struct task *task, vaddr_t vaddr) {
+    return vaddr != (vaddr_t) __cmdline && !page_area_lookup(task, vaddr);
+}
+
+/// Computes the fault-around window for `vaddr`: the aligned window of
+/// CONFIG_VM_FAULT_AROUND_PAGES pages clipped into [start, end).
+static void fault_around_window(vaddr_t vaddr, vaddr_t start, vaddr_t end,
+                                vaddr_t *base, vaddr_t *limit) {
+    size_t window = CONFIG_VM_FAULT_AROUND_PAGES * PAGE_SIZE;
+    vaddr_t window_base = vaddr - (vaddr % window);
+    *base = MAX(window_base, start);
+    *limit = MIN(window_base + window, end);
+}
+
+/// Allocates `num_pages` continuous pages for `vaddr`, fills them, and adds
+/// them to the task. Nothing is added on failure.
+static error_t alloc_filled_pages(struct task *task, vaddr_t vaddr,
+                                  size_t num_pages, struct elf64_phdr *phdr,
+                                  paddr_t *paddr) {
+    if (task_page_quota_exceeded(task, num_pages)) {
+        return ERR_NO_MEMORY;
+    }
+
+    *paddr = page_alloc(num_pages);
+    if (!*paddr) {
+        return ERR_NO_MEMORY;
+    }
+
+    for (size_t i = 0; i < num_pages; i++) {
+        offset_t off = i * PAGE_SIZE;
+        error_t err = fill_page(task, vaddr + off, *paddr + off, phdr);
+        if (err != OK) {
+            page_decref(paddr2pfn(*paddr), num_pages);
+            return err;
+        }
+    }
+
+    if (!phdr) {
+        zero_pool_misses += num_pages;
+    }
+
+    task_page_add_demand(task, vaddr, *paddr, num_pages);
+    return OK;
+}
+
+/// Takes a pre-zeroed page from the pool for a zero-filled page at `vaddr`.
+/// Returns 0 if it's not available.
+static paddr_t take_zeroed_page(struct task *task, vaddr_t vaddr,
+                                struct elf64_phdr *phdr) {
+    if (phdr || task_page_quota_exceeded(task, 1)) {
+        return 0;
+    }
+
+    paddr_t paddr = zero_pool_alloc();
+    if (paddr) {
+        task_page_add_demand(task, vaddr, paddr, 1);
+    }
+
+    return paddr;
+}
+
+/// Fills the faulted page at `vaddr` and its unpopulated neighbours in the
+/// fault-around window within [start, end). Each run of unpopulated pages is
+/// allocated at once as a single page area. The run containing the faulted
+/// page is left to the kernel (`mapping`) and other neighbours are mapped
+/// into the task here by a single vm_map call so that it won't fault on
+/// them. Only a failure on the faulted page is fatal: fault-around stops at
+/// the first neighbour which can't be filled. Returns the physical address of
+/// `mapping->vaddr` or 0 on failure.
+static paddr_t fill_pages_around(struct task *task, vaddr_t vaddr,
+                                 vaddr_t start, vaddr_t end,
+                                 struct elf64_phdr *phdr,
+                                 struct page_fault_mapping *mapping) {
+    vaddr_t base, limit;
+    fault_around_window(vaddr, start, end, &base, &limit);
+
+    paddr_t faulted_paddr = take_zeroed_page(task, vaddr, phdr);
+    if (!faulted_paddr) {
+        vaddr_t run_start = vaddr;
+        vaddr_t run_end = vaddr + PAGE_SIZE;
+        while (run_start > base && is_unpopulated(task, run_start - PAGE_SIZE)) {
+            run_start -= PAGE_SIZE;
+        }
+        while (run_end < limit && is_unpopulated(task, run_end)) {
+            run_end += PAGE_SIZE;
+        }
+
+        size_t num_pages = (run_end - run_start) / PAGE_SIZE;
+        error_t err =
+            alloc_filled_pages(task, run_start, num_pages, phdr, &faulted_paddr);
+        if (err != OK && num_pages > 1) {
+            // Out of memory or the task's limit: fall back to allocating only
+            // the faulted page.
+            run_start = vaddr;
+            num_pages = 1;
+            err = alloc_filled_pages(task, vaddr, 1, phdr, &faulted_paddr);
+        }
+
+        if (err != OK) {
+            return 0;
+        }
+
+        // The kernel maps the whole run containing the faulted page.
+        mapping->vaddr = run_start;
+        mapping->num_pages = num_pages;
+    }
+
+    // Fill the neighbours (0 if not filled).
+    paddr_t neighbours[CONFIG_VM_FAULT_AROUND_PAGES];
+    memset(neighbours, 0, sizeof(neighbours));
+    size_t num_neighbours = 0;
+    vaddr_t run_start = base;
+    while (run_start < limit) {
+        if (!is_unpopulated(task, run_start)) {
+            run_start += PAGE_SIZE;
+            continue;
+        }
+
+        size_t index = (run_start - base) / PAGE_SIZE;
+        paddr_t zeroed_paddr = take_zeroed_page(task, run_start, phdr);
+        if (zeroed_paddr) {
+            neighbours[index] = zeroed_paddr;
+            num_neighbours++;
+            run_start += PAGE_SIZE;
+            continue;
+        }
+
+        vaddr_t run_end = run_start + PAGE_SIZE;
+        while (run_end < limit && is_unpopulated(task, run_end)) {
+            run_end += PAGE_SIZE;
+        }
+
+        size_t num_pages = (run_end - run_start) / PAGE_SIZE;
+        paddr_t paddr;
+        if (alloc_filled_pages(task, run_start, num_pages, phdr, &paddr)
+            != OK) {
+            // Neighbours will be allocated when the task accesses them.
+            break;
+        }
+
+        for (size_t i = 0; i < num_pages; i++) {
+            neighbours[index + i] = paddr + i * PAGE_SIZE;
+        }
+
+        num_neighbours += num_pages;
+        run_start = run_end;
+    }
+
+    if (num_neighbours) {
+        // It's fine to fail here: the pages will be mapped in the page fault
+        // handler from the page areas when the task accesses them.
+        map_pages(task, base, neighbours, (limit - base) / PAGE_SIZE,
+                  MAP_TYPE_READWRITE);
+    }
+
+    return faulted_paddr;
+}
+
+/// Returns the physical page in the page cache which contains the file data
+/// at `offset`. On a cache miss, it allocates a page and fills it. The page
+/// cache keeps the reference to the page.
+paddr_t get_cached_file_page(struct bootfs_file *file, offset_t offset) {
+    paddr_t paddr = bootfs_cache_lookup(file, offset);
+    if (paddr) {
+        return paddr;
+    }
+
+    paddr = page_alloc(1);
+    if (!paddr) {
+        return 0;
+    }
+
+    void *ptr = page_ptr(paddr, tmp_page);
+    if (!ptr) {
+        page_decref(paddr2pfn(paddr), 1);
+        return 0;
+    }
+
+    read_file(file, offset, ptr, PAGE_SIZE);
+    bootfs_cache_insert(file, offset, paddr);
+    return paddr;
+}
+
+/// Looks for the program header of the segment which contains `vaddr`.
+static struct elf64_phdr *lookup_phdr(struct task *task, vaddr_t vaddr) {
+    if (!task->ehdr) {
+        return NULL;
+    }
+
+    for (unsigned i = 0; i < task->ehdr->e_phnum; i++) {
+        // Ignore GNU_STACK
+        if (!task->phdrs[i].p_vaddr) {
+            continue;
+        }
+
+        vaddr_t start = task->phdrs[i].p_vaddr;
+        vaddr_t end = start + task->phdrs[i].p_memsz;
+        if (start <= vaddr && vaddr <= end) {
+            return &task->phdrs[i];
+        }
+    }
+
+    return NULL;
+}
+
+/// Maps the faulted page at `vaddr` and its unpopulated neighbours in the
+/// fault-around window within [start, end) from the page cache of the ELF
+/// file. The pages are shared with other tasks spawned from the same file and
+/// mapped as read-only by a single vm_map call. If `cow` is true, they are
+/// copied on write. Fault-around stops at the first neighbour which can't be
+/// read. Returns the physical address of the faulted page or 0 on failure.
+static paddr_t share_file_pages_around(struct task *task, vaddr_t vaddr,
+                                       vaddr_t start, vaddr_t end,
+                                       struct elf64_phdr *phdr, bool cow) {
+    offset_t offset = (vaddr - phdr->p_vaddr) + phdr->p_offset;
+    paddr_t faulted_paddr = get_cached_file_page(task->file, offset);
+    if (!faulted_paddr) {
+        return 0;
+    }
+
+    // The kernel maps the faulted page.
+    task_page_share(task, vaddr, faulted_paddr, 1, cow);
+
+    vaddr_t base, limit;
+    fault_around_window(vaddr, start, end, &base, &limit);
+    paddr_t neighbours[CONFIG_VM_FAULT_AROUND_PAGES];
+    memset(neighbours, 0, sizeof(neighbours));
+    size_t num_neighbours = 0;
+    for (vaddr_t page_vaddr = base; page_vaddr < limit;
+         page_vaddr += PAGE_SIZE) {
+        if (!is_unpopulated(task, page_vaddr)) {
+            continue;
+        }
+
+        offset = (page_vaddr - phdr->p_vaddr) + phdr->p_offset;
+        paddr_t paddr = get_cached_file_page(task->file, offset);
+        if (!paddr) {
+            // It will be read when the task accesses it.
+            break;
+        }
+
+        task_page_share(task, page_vaddr, paddr, 1, cow);
+        neighbours[(page_vaddr - base) / PAGE_SIZE] = paddr;
+        num_neighbours++;
+    }
+
+    if (num_neighbours) {
+        // It's fine to fail here: the pages will be mapped in the page fault
+        // handler from the page areas when the task accesses them.
+        map_pages(task, base, neighbours, (limit - base) / PAGE_SIZE,
+                  MAP_TYPE_READONLY);
+    }
+
+    return faulted_paddr;
+}
+
+/// Replaces the shared page in `area` with a private copy of it. Returns the
+/// physical address of the copy or 0 on failure.
+static paddr_t copy_on_write(struct task *task, struct page_area *area) {
+    DEBUG_ASSERT(area->shared && area->cow && area->num_pages == 1);
+    vaddr_t vaddr = area->vaddr;
+    paddr_t shared_paddr = area->paddr;
+
+    // Keep the shared page alive until we copy it.
+    page_incref(paddr2pfn(shared_paddr), 1);
+    task_page_area_free(task, area);
+
+    paddr_t paddr;
+    error_t err = task_page_alloc_demand(task, vaddr, 1, &paddr);
+    if (err == OK) {
+        void *dst = page_ptr(paddr, tmp_page);
+        void *src = page_ptr(shared_paddr, cow_src_page);
+        err = (dst && src) ? OK : ERR_NO_MEMORY;
+        if (err == OK) {
+            // The kernel overwrites the read-only mapping.
+            memcpy(dst, src, PAGE_SIZE);
+        }
+    }
+
+    page_decref(paddr2pfn(shared_paddr), 1);
+    return (err == OK) ? paddr : 0;
+}
+
+/// Tries to fill a page at `vaddr` for the task. Returns the physical memory
+/// address for `mapping->vaddr` on success or 0 on failure.
+static paddr_t fill_faulted_page(struct task *task, vaddr_t vaddr, vaddr_t ip,
+                                 unsigned fault,
+                                 struct page_fault_mapping *mapping) {
     if (vaddr < PAGE_SIZE) {
         WARN("%s (%d): null pointer dereference at vaddr=%p, ip=%p", task->name,
              task->tid, vaddr, ip);
@@ -59,6 +419,12 @@ paddr_t handle_page_fault(struct task *task, vaddr_t vaddr, vaddr_t ip,
     vaddr = ALIGN_DOWN(vaddr, PAGE_SIZE);
 
     if (fault & EXP_PF_PRESENT) {
+        // A write into a copy-on-write page.
+        struct page_area *area = page_area_lookup(task, vaddr);
+        if ((fault & EXP_PF_WRITE) && area && area->cow) {
+            return copy_on_write(task, area);
+        }
+
         // Invalid access. For instance the user thread has tried to write to
         // readonly area.
         WARN("%s: invalid memory access at %p (IP=%p, perhaps segfault?)",
@@ -69,23 +435,25 @@ paddr_t handle_page_fault(struct task *task, vaddr_t vaddr, vaddr_t ip,
     // The `cmdline` for main().
     if (vaddr == (vaddr_t) __cmdline) {
         paddr_t paddr = 0;
-        if (task_page_alloc(task, &vaddr, &paddr, 1) != OK) {
+        if (task_page_alloc_demand(task, vaddr, 1, &paddr) != OK) {
             return 0;
         }
-        if (map_page(vm_task, tmp_page, paddr, MAP_TYPE_READWRITE, false)
-            != OK) {
+        void *ptr = page_ptr(paddr, tmp_page);
+        if (!ptr) {
             return 0;
         }
-        memset((void *) tmp_page, 0, PAGE_SIZE);
-        strncpy2((void *) tmp_page, task->cmdline, PAGE_SIZE);
+        memset(ptr, 0, PAGE_SIZE);
+        strncpy2(ptr, task->cmdline, PAGE_SIZE);
         return paddr;
     }
 
-    LIST_FOR_EACH (area, &task->page_areas, struct page_area, next) {
-        if (area->vaddr <= vaddr
-            && vaddr < area->vaddr + area->num_pages * PAGE_SIZE) {
-            return area->paddr + (vaddr - area->vaddr);
+    struct page_area *area = page_area_lookup(task, vaddr);
+    if (area) {
+        if (area->shared && !area->writable) {
+            mapping->map_type = MAP_TYPE_READONLY;
         }
+
+        return area->paddr + (vaddr - area->vaddr);
     }
 
     // Zeroed pages.
@@ -93,50 +461,33 @@ paddr_t handle_page_fault(struct task *task, vaddr_t vaddr, vaddr_t ip,
     vaddr_t zeroed_pages_end = (vaddr_t) __zeroed_pages_end;
     if (zeroed_pages_start <= vaddr && vaddr < zeroed_pages_end) {
         // The accessed page is zeroed one (.bss section, stack, or heap).
-        paddr_t paddr = 0;
-        if (task_page_alloc(task, &vaddr, &paddr, 1) != OK) {
-            return 0;
-        }
-        if (map_page(vm_task, tmp_page, paddr, MAP_TYPE_READWRITE, false)
-            != OK) {
-            return 0;
-        }
-        memset((void *) tmp_page, 0, PAGE_SIZE);
-        return paddr;
+        return fill_pages_around(task, vaddr, zeroed_pages_start,
+                                 zeroed_pages_end, NULL, mapping);
     }
 
     // Look for the associated program header.
-    struct elf64_phdr *phdr = NULL;
-    if (task->ehdr) {
-        for (unsigned i = 0; i < task->ehdr->e_phnum; i++) {
-            // Ignore GNU_STACK
-            if (!task->phdrs[i].p_vaddr) {
-                continue;
-            }
-
-            vaddr_t start = task->phdrs[i].p_vaddr;
-            vaddr_t end = start + task->phdrs[i].p_memsz;
-            if (start <= vaddr && vaddr <= end) {
-                phdr = &task->phdrs[i];
-                break;
-            }
+    struct elf64_phdr *phdr = lookup_phdr(task, vaddr);
+    if (phdr) {
+        vaddr_t start = ALIGN_DOWN(phdr->p_vaddr, PAGE_SIZE);
+        vaddr_t end = ALIGN_UP(phdr->p_vaddr + phdr->p_memsz, PAGE_SIZE);
+        end = MAX(end, vaddr + PAGE_SIZE);
+        bool writable = (phdr->p_flags & PF_W) != 0;
+        if (!writable && (fault & EXP_PF_WRITE)) {
+            WARN("%s: tried to write into a readonly segment at %p (IP=%p)",
+                 task->name, vaddr_original, ip);
+            return 0;
         }
 
-        if (phdr) {
-            // Allocate a page and fill it with the file data.
-            paddr_t paddr = 0;
-            if (task_page_alloc(task, &vaddr, &paddr, 1) != OK) {
-                return 0;
-            }
-            if (map_page(vm_task, tmp_page, paddr, MAP_TYPE_READWRITE, false)
-                != OK) {
-                return 0;
-            }
-            size_t offset_in_segment = (vaddr - phdr->p_vaddr) + phdr->p_offset;
-            read_file(task->file, offset_in_segment, (void *) tmp_page,
-                      PAGE_SIZE);
-            return paddr;
+        if (writable && (fault & EXP_PF_WRITE)) {
+            // The task is going to write into the page: allocate private
+            // pages and fill them with the file data.
+            return fill_pages_around(task, vaddr, start, end, phdr, mapping);
         }
+
+        // Map the pages in the page cache. Writable ones are copied on the
+        // first write.
+        mapping->map_type = MAP_TYPE_READONLY;
+        return share_file_pages_around(task, vaddr, start, end, phdr, writable);
     }
 
     WARN("invalid memory access (addr=%p, IP=%p), killing %s...",
@@ -144,6 +495,69 @@ paddr_t handle_page_fault(struct task *task, vaddr_t vaddr, vaddr_t ip,
     return 0;
 }
 
+/// Returns true if handling the page fault needs to read the file from bootfs
+/// (and decompress it), that is, it's not a zero-filled page, an already
+/// allocated page, nor a page in the page cache.
+bool page_fault_is_slow(struct task *task, vaddr_t vaddr, unsigned fault) {
+    vaddr = ALIGN_DOWN(vaddr, PAGE_SIZE);
+    if ((fault & EXP_PF_PRESENT) || vaddr < PAGE_SIZE
+        || vaddr == (vaddr_t) __cmdline || page_area_lookup(task, vaddr)) {
+        return false;
+    }
+
+    vaddr_t zeroed_pages_start = (vaddr_t) __zeroed_pages;
+    vaddr_t zeroed_pages_end = (vaddr_t) __zeroed_pages_end;
+    if (zeroed_pages_start <= vaddr && vaddr < zeroed_pages_end) {
+        return false;
+    }
+
+    struct elf64_phdr *phdr = lookup_phdr(task, vaddr);
+    if (!phdr) {
+        return false;
+    }
+
+    if ((phdr->p_flags & PF_W) && (fault & EXP_PF_WRITE)) {
+        // Private pages are always filled from the file.
+        return true;
+    }
+
+    offset_t offset = (vaddr - phdr->p_vaddr) + phdr->p_offset;
+    return bootfs_cache_lookup(task->file, offset) == 0;
+}
+
+/// Returns true if the page at `vaddr` is filled with the file data at
+/// `offset` from the page cache on a page fault, that is, the page can be
+/// unmapped and refetched later.
+bool page_fault_refetchable(struct task *task, vaddr_t vaddr,
+                            struct bootfs_file *file, offset_t offset) {
+    if (task->file != file) {
+        return false;
+    }
+
+    vaddr_t zeroed_pages_start = (vaddr_t) __zeroed_pages;
+    vaddr_t zeroed_pages_end = (vaddr_t) __zeroed_pages_end;
+    if ((zeroed_pages_start <= vaddr && vaddr < zeroed_pages_end)
+        || vaddr == (vaddr_t) __cmdline) {
+        return false;
+    }
+
+    struct elf64_phdr *phdr = lookup_phdr(task, vaddr);
+    return phdr && (vaddr - phdr->p_vaddr) + phdr->p_offset == offset;
+}
+
+/// Handles a page fault in the task. On success, it fills `mapping` with the
+/// run of pages which the kernel maps on the reply (including the faulted
+/// page) and returns true.
+bool handle_page_fault(struct task *task, vaddr_t vaddr, vaddr_t ip,
+                       unsigned fault, struct page_fault_mapping *mapping) {
+    mapping->vaddr = ALIGN_DOWN(vaddr, PAGE_SIZE);
+    mapping->num_pages = 1;
+    mapping->map_type = MAP_TYPE_READWRITE;
+    mapping->paddr = fill_faulted_page(task, vaddr, ip, fault, mapping);
+    return mapping->paddr != 0;
+}
+
 void page_fault_init(void) {
     tmp_page = virt_page_alloc(vm_task, 1);
+    cow_src_page = virt_page_alloc(vm_task, 1);
 }
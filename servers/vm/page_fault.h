@@ -3,11 +3,27 @@
 
 #include <types.h>
 
+/// A run of pages mapped by the kernel on the reply to a page fault.
+struct page_fault_mapping {
+    vaddr_t vaddr;
+    paddr_t paddr;
+    size_t num_pages;
+    unsigned map_type;
+};
+
 struct task;
+struct bootfs_file;
 error_t map_page(struct task *task, vaddr_t vaddr, paddr_t paddr,
                  unsigned flags, bool overwrite);
-paddr_t handle_page_fault(struct task *task, vaddr_t vaddr, vaddr_t ip,
-                          unsigned fault);
+error_t map_pages(struct task *task, vaddr_t vaddr, const paddr_t *paddrs,
+                  size_t num_pages, unsigned flags);
+void *page_ptr(paddr_t paddr, vaddr_t scratch);
+paddr_t get_cached_file_page(struct bootfs_file *file, offset_t offset);
+bool handle_page_fault(struct task *task, vaddr_t vaddr, vaddr_t ip,
+                       unsigned fault, struct page_fault_mapping *mapping);
+bool page_fault_refetchable(struct task *task, vaddr_t vaddr,
+                            struct bootfs_file *file, offset_t offset);
+bool page_fault_is_slow(struct task *task, vaddr_t vaddr, unsigned fault);
 void page_fault_init(void);
 
 #endif
@@ -1,69 +1,230 @@
 #include "shm.h"
 #include "page_alloc.h"
 #include "page_fault.h"
+#include <resea/malloc.h>
+#include <resea/printf.h>
+#include <resea/task.h>
 #include <string.h>
 
-static struct shm shared_mems[NUM_SHARED_MEMS_MAX];
+/// Shared memory areas indexed by `shm_id`.
+static struct avl_tree shms = {.root = NULL};
+static int next_shm_id = 1;
 
-int shm_check_available(void) {
-    int i;
-    for (i = 0; i < NUM_SHARED_MEMS_MAX && shared_mems[i].inuse; i++);
-    
-    if (i == NUM_SHARED_MEMS_MAX) {
-        return -1;
+static int compare_shm_id(struct avl_node *a, struct avl_node *b) {
+    int x = AVL_CONTAINER(a, struct shm, node)->shm_id;
+    int y = AVL_CONTAINER(b, struct shm, node)->shm_id;
+    return (x < y) ? -1 : (x > y);
+}
+
+/// Allocates a shared memory area of `size` bytes. If `name` is not NULL,
+/// other tasks can look for it by the name.
+error_t shm_create(struct task *task, size_t size, const char *name,
+                   int *shm_id) {
+    size_t num_pages = ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE;
+    if (!num_pages) {
+        return ERR_INVALID_ARG;
     }
 
-    return i;
-}
+    if (name && shm_lookup_by_name(name)) {
+        return ERR_ALREADY_EXISTS;
+    }
 
-error_t shm_create(struct task *task, size_t size, int *slot) {
-    *slot = shm_check_available();
-    if (*slot < 0) {
+    if (next_shm_id < 0) {
+        // The shm_id has wrapped around.
         return ERR_UNAVAILABLE;
     }
 
-    paddr_t paddr = 0;
-    vaddr_t vaddr;
-    error_t err = task_page_alloc(task, &vaddr, &paddr, size);
-    if (err != OK) {
-        return err;
+    // The pages are charged to the creator until the area is destroyed.
+    if (task_page_quota_exceeded(task, num_pages)) {
+        return ERR_NO_MEMORY;
     }
 
-    shared_mems[*slot].inuse = true;
-    shared_mems[*slot].shm_id = *slot;
-    shared_mems[*slot].len = size;
-    shared_mems[*slot].paddr = paddr;
+    paddr_t paddr = page_alloc(num_pages);
+    if (!paddr) {
+        return ERR_NO_MEMORY;
+    }
+
+    task->mem.shm_created += num_pages;
+
+    struct shm *shm = malloc(sizeof(*shm));
+    shm->shm_id = next_shm_id++;
+    strncpy2(shm->name, name ? name : "", sizeof(shm->name));
+    shm->creator = task;
+    shm->paddr = paddr;
+    shm->num_pages = num_pages;
+    avl_insert(&shms, &shm->node, compare_shm_id);
+
+    *shm_id = shm->shm_id;
     return OK;
 }
 
+struct shm *shm_lookup(int shm_id) {
+    struct avl_node *node = shms.root;
+    while (node) {
+        struct shm *shm = AVL_CONTAINER(node, struct shm, node);
+        if (shm->shm_id == shm_id) {
+            return shm;
+        }
+
+        node = (shm_id < shm->shm_id) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/// Looks for a named shared memory area. It's not in the fast path: shared
+/// memory areas are looked up by name only when tasks set up them.
+struct shm *shm_lookup_by_name(const char *name) {
+    if (!name[0]) {
+        return NULL;
+    }
+
+    for (struct avl_node *node = avl_first(&shms); node;
+         node = avl_next(node)) {
+        struct shm *shm = AVL_CONTAINER(node, struct shm, node);
+        if (!strncmp(shm->name, name, sizeof(shm->name))) {
+            return shm;
+        }
+    }
+
+    return NULL;
+}
+
+static struct shm_mapping *lookup_mapping(struct task *task, int shm_id) {
+    LIST_FOR_EACH (mapping, &task->shm_mappings, struct shm_mapping, next) {
+        if (mapping->shm_id == shm_id) {
+            return mapping;
+        }
+    }
+
+    return NULL;
+}
+
+/// Maps all pages of the shared memory area into the task. If the task has
+/// already mapped it, it returns the same address.
 error_t shm_map(struct task *task, int shm_id, bool writable, vaddr_t *vaddr) {
-    struct shm* shm = shm_lookup(shm_id);
+    struct shm *shm = shm_lookup(shm_id);
     if (shm == NULL) {
         return ERR_NOT_FOUND;
     }
 
-    *vaddr = virt_page_alloc(task, shm->len);
-    int flag = (writable) ? MAP_TYPE_READWRITE : MAP_TYPE_READONLY;
-    error_t err = map_page(task, *vaddr, shm->paddr, flag, true);
-    return err;
+    struct shm_mapping *mapping = lookup_mapping(task, shm_id);
+    if (mapping) {
+        mapping->ref_count++;
+        *vaddr = mapping->vaddr;
+        return OK;
+    }
+
+    *vaddr = virt_page_alloc(task, shm->num_pages);
+    if (!*vaddr) {
+        return ERR_NO_MEMORY;
+    }
+
+    // The page fault handler maps the pages from this area if map_pages()
+    // below fails.
+    struct page_area *area =
+        task_page_share(task, *vaddr, shm->paddr, shm->num_pages, false);
+    area->writable = writable;
+    task_page_area_share_shm(task, area);
+
+    // Map the whole run at once: a vm_map call per MAP_MAX_PAGES pages.
+    paddr_t paddrs[MAP_MAX_PAGES];
+    int flags = (writable) ? MAP_TYPE_READWRITE : MAP_TYPE_READONLY;
+    for (size_t i = 0; i < shm->num_pages; i += MAP_MAX_PAGES) {
+        size_t n = MIN(shm->num_pages - i, MAP_MAX_PAGES);
+        for (size_t j = 0; j < n; j++) {
+            paddrs[j] = shm->paddr + (i + j) * PAGE_SIZE;
+        }
+
+        error_t err = map_pages(task, *vaddr + i * PAGE_SIZE, paddrs, n, flags);
+        if (err != OK) {
+            WARN_DBG("%s: failed to map shm pages: %s", task->name,
+                     err2str(err));
+            break;
+        }
+    }
+
+    mapping = malloc(sizeof(*mapping));
+    mapping->shm_id = shm_id;
+    mapping->vaddr = *vaddr;
+    mapping->num_pages = shm->num_pages;
+    mapping->ref_count = 1;
+    list_push_back(&task->shm_mappings, &mapping->next);
+    return OK;
+}
+
+static void unmap_mapping(struct task *task, struct shm_mapping *mapping) {
+    for (size_t i = 0; i < mapping->num_pages; i++) {
+        vm_unmap(task->tid, mapping->vaddr + i * PAGE_SIZE);
+    }
+
+    struct page_area *area = page_area_lookup(task, mapping->vaddr);
+    DEBUG_ASSERT(area && area->vaddr == mapping->vaddr);
+    task_page_area_free(task, area);
+    virt_page_free(task, mapping->vaddr, mapping->num_pages);
+    list_remove(&mapping->next);
+    free(mapping);
+}
+
+/// Drops a reference to the shared memory area mapped in the task. It is
+/// unmapped once all shm.map calls are paired with shm.unmap.
+error_t shm_unmap(struct task *task, int shm_id) {
+    struct shm_mapping *mapping = lookup_mapping(task, shm_id);
+    if (!mapping) {
+        return ERR_NOT_FOUND;
+    }
+
+    mapping->ref_count--;
+    if (!mapping->ref_count) {
+        unmap_mapping(task, mapping);
+    }
+
+    return OK;
+}
+
+static void destroy_shm(struct shm *shm) {
+    DEBUG_ASSERT(shm->creator->mem.shm_created >= shm->num_pages);
+    shm->creator->mem.shm_created -= shm->num_pages;
+    avl_remove(&shms, &shm->node);
+    page_decref(paddr2pfn(shm->paddr), shm->num_pages);
+    free(shm);
 }
 
-void shm_close(int shm_id) {
-    struct shm* shm = shm_lookup(shm_id);
-    if (shm != NULL) {
-        shm->inuse = false;
+/// Destroys the shared memory area created by the task. It can no longer be
+/// mapped. It's unmapped from the task but other tasks can keep using their
+/// mappings: the pages are freed when all of them have been unmapped.
+error_t shm_close(struct task *task, int shm_id) {
+    struct shm *shm = shm_lookup(shm_id);
+    if (shm == NULL) {
+        return ERR_NOT_FOUND;
+    }
+
+    if (shm->creator != task) {
+        return ERR_NOT_PERMITTED;
+    }
+
+    struct shm_mapping *mapping = lookup_mapping(task, shm_id);
+    if (mapping) {
+        unmap_mapping(task, mapping);
     }
+
+    destroy_shm(shm);
+    return OK;
 }
 
-struct shm* shm_lookup(int shm_id) {
-    int i;
-    for (i = 0; i < NUM_SHARED_MEMS_MAX; i++) {
-        if (shared_mems[i].shm_id == shm_id) {
-            if (shared_mems[i].inuse == false) {
-                return NULL;
-            }
-            return &shared_mems[i];
+/// Unmaps all shared memory areas mapped in the exiting task and destroys ones
+/// created by the task.
+void shm_task_exit(struct task *task) {
+    LIST_FOR_EACH (mapping, &task->shm_mappings, struct shm_mapping, next) {
+        unmap_mapping(task, mapping);
+    }
+
+    struct avl_node *node = avl_first(&shms);
+    while (node) {
+        struct shm *shm = AVL_CONTAINER(node, struct shm, node);
+        node = avl_next(node);
+        if (shm->creator == task) {
+            destroy_shm(shm);
         }
     }
-    return NULL;
 }
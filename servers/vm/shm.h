@@ -2,19 +2,44 @@
 #define __SHM_H__
 
 #include "task.h"
+#include <avl.h>
+#include <list.h>
 #include <types.h>
 
+#define SHM_NAME_LEN 32
+
+/// A shared memory area.
 struct shm {
-    bool inuse;
+    /// A node in the tree of shared memory areas indexed by `shm_id`.
+    struct avl_node node;
     int shm_id;
+    /// The name to look for it (empty if it's anonymous).
+    char name[SHM_NAME_LEN];
+    /// The task which has created it. Only the task can close it.
+    struct task *creator;
     paddr_t paddr;
-    size_t len;
+    size_t num_pages;
 };
 
-#define NUM_SHARED_MEMS_MAX 32
-int shm_check_available(void);
-error_t shm_create(struct task* task, size_t size, int* slot);
-error_t shm_map(struct task* task, int shm_id, bool writable, vaddr_t* vaddr);
-void shm_close(int shm_id);
-struct shm* shm_lookup(int shm_id);
+/// A shared memory area mapped in a task.
+struct shm_mapping {
+    /// A list element in `task->shm_mappings`.
+    list_elem_t next;
+    int shm_id;
+    vaddr_t vaddr;
+    size_t num_pages;
+    /// The number of shm.map calls for the area in the task. The area is
+    /// unmapped when it reaches zero.
+    unsigned ref_count;
+};
+
+error_t shm_create(struct task *task, size_t size, const char *name,
+                   int *shm_id);
+struct shm *shm_lookup(int shm_id);
+struct shm *shm_lookup_by_name(const char *name);
+error_t shm_map(struct task *task, int shm_id, bool writable, vaddr_t *vaddr);
+error_t shm_unmap(struct task *task, int shm_id);
+error_t shm_close(struct task *task, int shm_id);
+void shm_task_exit(struct task *task);
+
 #endif
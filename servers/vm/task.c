@@ -1,6 +1,11 @@
 #include "task.h"
+#include "boot.h"
 #include "bootfs.h"
+#include "deferred.h"
 #include "page_alloc.h"
+#include "page_fault.h"
+#include "shm.h"
+#include <arch/cycles.h>
 #include <elf/elf.h>
 #include <message.h>
 #include <resea/async.h>
@@ -12,7 +17,9 @@
 extern char __free_vaddr[];
 
 static struct task tasks[CONFIG_NUM_TASKS];
-static list_t services;
+/// Registered services hashed by their names.
+static list_t services[SERVICE_HASH_SIZE];
+static int next_service_id = 1;
 
 /// Look for the task in the our task table.
 struct task *task_lookup(task_t tid) {
@@ -25,6 +32,31 @@ struct task *task_lookup(task_t tid) {
     return task;
 }
 
+/// Look for the task in the our task table. Unlike task_lookup(), it returns
+/// NULL if the task ID is invalid or not in use.
+struct task *task_find(task_t tid) {
+    if (tid <= 0 || tid > CONFIG_NUM_TASKS || !tasks[tid - 1].in_use) {
+        return NULL;
+    }
+
+    return &tasks[tid - 1];
+}
+
+/// Returns the size of the task's OoL receive buffers in pages.
+size_t task_ool_buf_pages(struct task *task) {
+    size_t len = 0;
+    for (unsigned i = 0; i < task->num_ool_bufs; i++) {
+        unsigned index = (task->ool_bufs_head + i) % CONFIG_OOL_NUM_BUFS;
+        len += task->ool_bufs[index].len;
+    }
+
+    for (unsigned i = 0; i < task->num_received_ools; i++) {
+        len += task->received_ools[i].len;
+    }
+
+    return ALIGN_UP(len, PAGE_SIZE) / PAGE_SIZE;
+}
+
 /// Allocates a task ID.
 struct task *task_alloc(task_t pager) {
     // Look for an unused task ID.
@@ -34,6 +66,8 @@ struct task *task_alloc(task_t pager) {
             task = &tasks[i];
             task->in_use = true;
             task->pager = pager;
+            task->owner = task;
+            task->endpoint = false;
             return task;
         }
     }
@@ -59,20 +93,67 @@ static void init_task_struct(struct task *task, const char *name,
     }
 
     task->pager = vm_task->tid;
+    task->owner = task;
+    task->endpoint = false;
     task->in_use = true;
     task->free_vaddr = (vaddr_t) __free_vaddr;
-    task->ool_buf = 0;
-    task->ool_len = 0;
-    task->received_ool_buf = 0;
-    task->received_ool_len = 0;
-    task->received_ool_from = 0;
+    avl_init(&task->free_vaddr_ranges);
+    list_init(&task->shm_mappings);
+    task->ool_bufs_head = 0;
+    task->num_ool_bufs = 0;
+    task->num_received_ools = 0;
     list_init(&task->ool_sender_queue);
     list_nullify(&task->ool_sender_next);
     strncpy2(task->name, name, sizeof(task->name));
     strncpy2(task->cmdline, cmdline, sizeof(task->cmdline));
     strncpy2(task->waiting_for, "", sizeof(task->waiting_for));
+    task->watch_service = false;
     list_init(&task->page_areas);
+    avl_init(&task->page_areas_by_vaddr);
+    avl_init(&task->page_areas_by_paddr);
+    bzero(&task->mem, sizeof(task->mem));
     list_init(&task->watchers);
+    task->spawned_at = 0;
+    task->served_at = 0;
+}
+
+/// Allocates a task ID for a thread of `owner`. The caller creates the thread
+/// by itself using the `TASK_THREAD` flag.
+struct task *thread_alloc(struct task *owner) {
+    struct task *thread = task_alloc(owner->pager);
+    if (!thread) {
+        return NULL;
+    }
+
+    init_task_struct(thread, owner->name, NULL, NULL, NULL, "");
+    // Page faults and memory allocations are handled in the owner's address
+    // space.
+    thread->pager = owner->pager;
+    thread->owner = owner;
+    return thread;
+}
+
+/// Creates an endpoint owned by `owner`. It's destroyed when the owner exits.
+struct task *endpoint_alloc(struct task *owner) {
+    struct task *ep = task_alloc(vm_task->tid);
+    if (!ep) {
+        return NULL;
+    }
+
+    init_task_struct(ep, owner->name, NULL, NULL, NULL, "");
+    ep->owner = owner;
+    ep->endpoint = true;
+
+    // The kernel allows only the owner (and its threads) to receive from it.
+    error_t err =
+        task_create(ep->tid, owner->name, 0, owner->tid, TASK_AS_ENDPOINT);
+    if (err != OK) {
+        WARN_DBG("failed to create an endpoint: %s", err2str(err));
+        task_free(ep);
+        return NULL;
+    }
+
+    return ep;
 }
 
 /// Execute a ELF file. Returns an task ID on success or an error on failure.
@@ -98,6 +179,7 @@ task_t task_spawn(struct bootfs_file *file, const char *cmdline) {
     }
 
     init_task_struct(task, file->name, file, file_header, ehdr, cmdline);
+    task->spawned_at = cycle_counter();
 
     // Create a new task for the server.
     error_t err = task_create(task->tid, file->name, ehdr->e_entry, task_self(),
@@ -131,15 +213,24 @@ task_t task_spawn_by_cmdline(const char *name_with_cmdline) {
         }
     }
 
-    if (!file) {
-        return ERR_NOT_FOUND;
-    }
-
+    // `cmdline` points into `name`: free it after task_spawn() has copied it.
+    task_t task = file ? task_spawn(file, cmdline) : ERR_NOT_FOUND;
     free(name);
-    return task_spawn(file, cmdline);
+    return task;
 }
 
 void task_kill(struct task *task) {
+    if (task->owner == task) {
+        // Threads use the address space: kill them (and endpoints owned by
+        // the task) first.
+        for (int i = 0; i < CONFIG_NUM_TASKS; i++) {
+            struct task *child = &tasks[i];
+            if (child->in_use && child != task && child->owner == task) {
+                task_kill(child);
+            }
+        }
+    }
+
     LIST_FOR_EACH (w, &task->watchers, struct task_watcher, next) {
         struct message m;
         bzero(&m, sizeof(m));
@@ -149,14 +240,28 @@ void task_kill(struct task *task) {
         free(w);
     }
 
-    LIST_FOR_EACH (service, &services, struct service, next) {
-        if (service->task == task->tid) {
-            list_remove(&service->next);
-            free(service);
+    for (int i = 0; i < SERVICE_HASH_SIZE; i++) {
+        LIST_FOR_EACH (service, &services[i], struct service, next) {
+            if (service->task == task->tid) {
+                service->task = 0;
+            }
+        }
+    }
+
+    // Drop watches by the task: its task ID will be reused.
+    for (int i = 0; i < CONFIG_NUM_TASKS; i++) {
+        struct task *watched = &tasks[i];
+        if (watched->in_use && watched != task) {
+            task_unwatch(task, watched);
         }
     }
 
-    task_page_free_all(task);
+    deferred_task_exit(task);
+    shm_task_exit(task);
+    if (task->owner == task) {
+        task_page_free_all(task);
+    }
+
     task_destroy(task->tid);
     task->in_use = false;
     if (task->file_header) {
@@ -165,6 +270,12 @@ void task_kill(struct task *task) {
 }
 
 void task_watch(struct task *watcher, struct task *task) {
+    LIST_FOR_EACH (w, &task->watchers, struct task_watcher, next) {
+        if (w->watcher == watcher) {
+            return;
+        }
+    }
+
     struct task_watcher *w = malloc(sizeof(*w));
     w->watcher = watcher;
     list_push_back(&task->watchers, &w->next);
@@ -180,41 +291,179 @@ void task_unwatch(struct task *watcher, struct task *task) {
     }
 }
 
-void service_register(struct task *task, const char *name) {
-    // Add the server into the service list.
-    struct service *service = malloc(sizeof(*service));
+/// Returns the task's page area which maps the page cache page `paddr` and is
+/// refetched on a page fault, or NULL if there's no such one.
+static struct page_area *file_page_area(struct task *task,
+                                        struct bootfs_file *file,
+                                        offset_t offset, paddr_t paddr) {
+    struct page_area *area = page_area_lookup_by_paddr(task, paddr);
+    if (!area || !area->vaddr || !area->shared || area->writable
+        || area->num_pages != 1
+        || !page_fault_refetchable(task, area->vaddr, file, offset)) {
+        return NULL;
+    }
+
+    return area;
+}
+
+/// Returns true if a task has accessed the page cache page `paddr` (the file
+/// data at `offset`) since the last call. The accessed bits in the page tables
+/// of all tasks mapping the page are cleared.
+bool task_page_cache_accessed(struct bootfs_file *file, offset_t offset,
+                              paddr_t paddr) {
+    bool accessed = false;
+    for (int i = 0; i < CONFIG_NUM_TASKS; i++) {
+        struct task *task = &tasks[i];
+        if (!task->in_use || task->owner != task) {
+            continue;
+        }
+
+        struct page_area *area = file_page_area(task, file, offset, paddr);
+        if (area) {
+            // Don't stop here: clear the bits in other tasks as well. If we
+            // can't tell it, assume that it's accessed.
+            int ret = vm_accessed(task->tid, area->vaddr);
+            if (ret != 0 && ret != ERR_NOT_FOUND) {
+                accessed = true;
+            }
+        }
+    }
+
+    return accessed;
+}
+
+/// Unmaps the page cache page `paddr` (the file data at `offset`) from all
+/// tasks so that it can be freed. It fails without unmapping anything if
+/// someone else references the page (e.g. remapped as an OoL payload): they
+/// can't refetch it from the file.
+bool task_page_cache_unmap(struct bootfs_file *file, offset_t offset,
+                           paddr_t paddr) {
+    // The page cache holds a reference.
+    unsigned num_refs = 1;
+    for (int i = 0; i < CONFIG_NUM_TASKS; i++) {
+        struct task *task = &tasks[i];
+        if (task->in_use && task->owner == task
+            && file_page_area(task, file, offset, paddr)) {
+            num_refs++;
+        }
+    }
+
+    if (page_ref_count(paddr) != num_refs) {
+        return false;
+    }
+
+    for (int i = 0; i < CONFIG_NUM_TASKS; i++) {
+        struct task *task = &tasks[i];
+        if (!task->in_use || task->owner != task) {
+            continue;
+        }
+
+        struct page_area *area = file_page_area(task, file, offset, paddr);
+        if (area) {
+            vm_unmap(task->tid, area->vaddr);
+            task_page_area_free(task, area);
+        }
+    }
+
+    return true;
+}
+
+/// Computes the hash of a service name (FNV-1a).
+static unsigned service_hash(const char *name) {
+    uint32_t hash = 2166136261;
+    while (*name) {
+        hash = (hash ^ (uint8_t) *name++) * 16777619;
+    }
+
+    return hash % SERVICE_HASH_SIZE;
+}
+
+static struct service *service_lookup(const char *name) {
+    LIST_FOR_EACH (s, &services[service_hash(name)], struct service, next) {
+        if (!strcmp(s->name, name)) {
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+/// Watches the server on behalf of the client so that the client drops its
+/// cached lookup result (see `ipc_lookup()`) when the server exits. Only
+/// clients which consume `task.exited` ask for it: otherwise the messages
+/// would pile up in our async message queue.
+static void service_watch(struct task *client, struct task *server) {
+    if (client != server) {
+        task_watch(client, server);
+    }
+}
+
+/// Registers the service and returns its ID.
+int service_register(struct task *task, const char *name) {
+    struct service *service = service_lookup(name);
+    if (!service) {
+        service = malloc(sizeof(*service));
+        service->id = next_service_id++;
+        strncpy2(service->name, name, sizeof(service->name));
+        list_nullify(&service->next);
+        list_push_back(&services[service_hash(service->name)], &service->next);
+    }
+
     service->task = task->tid;
-    strncpy2(service->name, name, sizeof(service->name));
-    list_nullify(&service->next);
-    list_push_back(&services, &service->next);
+
+    if (!task->served_at) {
+        task->served_at = cycle_counter();
+        TRACE("%s: served '%s' %llu cycles after spawn", task->name,
+              service->name, task->served_at - task->spawned_at);
+    }
 
     // Look for tasks waiting for the service...
     for (int i = 0; i < CONFIG_NUM_TASKS; i++) {
-        struct task *task = &tasks[i];
-        if (!strcmp(task->waiting_for, name)) {
+        struct task *waiter = &tasks[i];
+        if (!strcmp(waiter->waiting_for, service->name)) {
             struct message m;
             bzero(&m, sizeof(m));
 
             m.type = DISCOVERY_LOOKUP_REPLY_MSG;
             m.discovery_lookup_reply.task = service->task;
-            ipc_reply(task->tid, &m);
+            m.discovery_lookup_reply.service = service->id;
+            ipc_reply(waiter->tid, &m);
+            if (waiter->watch_service) {
+                service_watch(waiter, task);
+            }
 
             // The task no longer wait for the service. Clear the field.
-            strncpy2(task->waiting_for, "", sizeof(task->waiting_for));
+            strncpy2(waiter->waiting_for, "", sizeof(waiter->waiting_for));
         }
     }
+
+    // Start servers which have been waiting for the service.
+    boot_service_registered();
+    return service->id;
 }
 
-task_t service_wait(struct task *task, const char *name) {
-    LIST_FOR_EACH (s, &services, struct service, next) {
-        if (!strcmp(s->name, name)) {
-            return s->task;
+/// Returns true if the service is registered and its server is running.
+bool service_available(const char *name) {
+    struct service *s = service_lookup(name);
+    return s && s->task;
+}
+
+task_t service_wait(struct task *task, const char *name, bool watch,
+                    int *id) {
+    struct service *s = service_lookup(name);
+    if (s && s->task) {
+        *id = s->id;
+        if (watch) {
+            service_watch(task, task_lookup(s->task));
         }
+
+        return s->task;
     }
 
     // The service is not yet available. Block the caller task until the
     // server is registered by `ipc_serve()`.
     strncpy2(task->waiting_for, name, sizeof(task->waiting_for));
+    task->watch_service = watch;
     return ERR_WOULD_BLOCK;
 }
 
@@ -241,5 +490,7 @@ void task_init(void) {
     // Initialize a task struct for myself.
     vm_task = &tasks[INIT_TASK - 1];
     init_task_struct(vm_task, "vm", NULL, NULL, NULL, "");
-    list_init(&services);
+    for (int i = 0; i < SERVICE_HASH_SIZE; i++) {
+        list_init(&services[i]);
+    }
 }
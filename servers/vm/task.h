@@ -1,19 +1,77 @@
 #ifndef __TASK_H__
 #define __TASK_H__
 
+#include <avl.h>
+#include <config.h>
 #include <list.h>
 #include <message.h>
 #include <types.h>
 
 #define SERVICE_NAME_LEN 32
+#define SERVICE_HASH_SIZE 32
 
-/// A page area allocated for a task. It is mainly used to free memory pages
-/// when the task exit.
+/// A page area allocated for a task. It is used to resolve page faults and to
+/// free memory pages when the task exit.
 struct page_area {
     list_elem_t next;
+    /// A node in `task->page_areas_by_vaddr` (only if `vaddr` is not zero).
+    struct avl_node vaddr_node;
+    /// A node in `task->page_areas_by_paddr`.
+    struct avl_node paddr_node;
     vaddr_t vaddr;
     paddr_t paddr;
     size_t num_pages;
+    /// True if the area is filled by the page fault handler. Such areas are
+    /// merged with adjacent ones to keep the number of areas small.
+    bool mergeable;
+    /// True if the pages are shared with other tasks (e.g. cached file pages).
+    /// They are mapped as read-only.
+    bool shared;
+    /// True if the shared pages are copied when the task writes into them.
+    bool cow;
+    /// True if the shared pages are mapped as writable (shared memory).
+    bool writable;
+    /// True if the pages are a shared memory area (shm.map). Such areas are
+    /// unmapped as a whole and thus never split.
+    bool shm;
+    /// True if the pages are mapped with large pages (except the tail shorter
+    /// than LARGE_PAGE_SIZE). Such areas are never split.
+    bool large;
+};
+
+/// A free virtual address range in a task which can be reused by
+/// virt_page_alloc().
+struct vaddr_range {
+    /// A node in `task->free_vaddr_ranges`.
+    struct avl_node node;
+    vaddr_t base;
+    size_t num_pages;
+};
+
+/// A receive buffer for OoL payloads.
+struct ool_buf {
+    vaddr_t addr;
+    size_t len;
+    /// The sender (valid only if the buffer has been filled).
+    task_t from;
+};
+
+/// The memory usage of a task (in pages).
+struct task_mem {
+    /// Private pages (demand paging, vm.alloc_pages, etc.).
+    size_t resident;
+    /// Pages shared with other tasks (page cache and OoL remap).
+    size_t shared;
+    /// Pages used for page table structures (kpage).
+    size_t page_tables;
+    /// Pages of shared memory mapped in the task (not included in `shared`).
+    size_t shm;
+    /// Pages of shared memory areas created by the task.
+    size_t shm_created;
+    /// The maximum number of pages charged to the task (`resident`,
+    /// `page_tables`, and `shm_created`). Allocations beyond it fail. 0 means
+    /// unlimited.
+    size_t max_pages;
 };
 
 /// Task Control Block (TCB).
@@ -21,29 +79,59 @@ struct task {
     bool in_use;
     task_t tid;
     task_t pager;
+    /// The task which owns the address space (or the endpoint). It points to
+    /// the task itself unless it's a thread or an endpoint.
+    struct task *owner;
+    /// True if it's an endpoint.
+    bool endpoint;
     char name[32];
     char cmdline[512];
     struct bootfs_file *file;
     void *file_header;
     struct elf64_ehdr *ehdr;
     struct elf64_phdr *phdrs;
+    /// The beginning of the virtual address space which has never been
+    /// allocated.
     vaddr_t free_vaddr;
+    /// Freed virtual address ranges below `free_vaddr` sorted by the address.
+    struct avl_tree free_vaddr_ranges;
+    /// Shared memory areas mapped in the task (`struct shm_mapping`).
+    list_t shm_mappings;
     list_t page_areas;
-    vaddr_t ool_buf;
-    size_t ool_len;
-    task_t received_ool_from;
-    vaddr_t received_ool_buf;
-    size_t received_ool_len;
+    /// Page areas indexed by the virtual address.
+    struct avl_tree page_areas_by_vaddr;
+    /// Page areas indexed by the physical address.
+    struct avl_tree page_areas_by_paddr;
+    /// The memory usage. Threads and endpoints use the owner's one.
+    struct task_mem mem;
+    /// Receive buffers for OoL payloads (a ring buffer). Senders fill them
+    /// from `ool_bufs[ool_bufs_head]`.
+    struct ool_buf ool_bufs[CONFIG_OOL_NUM_BUFS];
+    unsigned ool_bufs_head;
+    unsigned num_ool_bufs;
+    /// Receive buffers filled by senders. They're released by ool.verify.
+    struct ool_buf received_ools[CONFIG_OOL_NUM_BUFS];
+    unsigned num_received_ools;
     list_t ool_sender_queue;
     list_elem_t ool_sender_next;
     struct message ool_sender_m;
     char waiting_for[SERVICE_NAME_LEN];
+    /// True if the task watches the server of `waiting_for` once it appears.
+    bool watch_service;
     list_t watchers;
+    /// The cycle counter when the task is spawned and when it registered its
+    /// first service (0 if not yet).
+    uint64_t spawned_at;
+    uint64_t served_at;
 };
 
+/// A registered service. It is kept after its server exits so that the
+/// restarted server gets the same ID.
 struct service {
     list_elem_t next;
     char name[SERVICE_NAME_LEN];
+    int id;
+    /// The server task or 0 if the server has exited.
     task_t task;
 };
 
@@ -55,15 +143,24 @@ struct task_watcher {
 extern struct task *vm_task;
 
 struct task *task_alloc(task_t pager);
+struct task *thread_alloc(struct task *owner);
+struct task *endpoint_alloc(struct task *owner);
 void task_free(struct task *task);
 task_t task_spawn(struct bootfs_file *file, const char *cmdline);
 task_t task_spawn_by_cmdline(const char *name_with_cmdline);
 struct task *task_lookup(task_t tid);
+struct task *task_find(task_t tid);
+size_t task_ool_buf_pages(struct task *task);
 void task_kill(struct task *task);
+bool task_page_cache_accessed(struct bootfs_file *file, offset_t offset,
+                              paddr_t paddr);
+bool task_page_cache_unmap(struct bootfs_file *file, offset_t offset,
+                           paddr_t paddr);
 void task_watch(struct task *watcher, struct task *task);
 void task_unwatch(struct task *watcher, struct task *task);
-void service_register(struct task *task, const char *name);
-task_t service_wait(struct task *task, const char *name);
+int service_register(struct task *task, const char *name);
+task_t service_wait(struct task *task, const char *name, bool watch, int *id);
+bool service_available(const char *name);
 void service_warn_deadlocked_tasks(void);
 void task_init(void);
 
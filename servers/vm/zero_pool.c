@@ -0,0 +1,57 @@
+#include "zero_pool.h"
+#include "page_alloc.h"
+#include "page_fault.h"
+#include "task.h"
+#include <config.h>
+#include <resea/printf.h>
+#include <string.h>
+
+size_t zero_pool_hits = 0;
+size_t zero_pool_misses = 0;
+/// Pre-zeroed physical memory pages. The pool holds a reference to each page.
+static paddr_t pool[CONFIG_VM_ZERO_POOL_PAGES];
+static size_t pool_len = 0;
+/// A temporary mapping to fill pages with zeros.
+static vaddr_t zeroing_page = 0;
+
+/// Takes a pre-zeroed page from the pool. Returns 0 if the pool is empty. The
+/// caller takes over the reference to the page.
+paddr_t zero_pool_alloc(void) {
+    if (!pool_len) {
+        return 0;
+    }
+
+    zero_pool_hits++;
+    return pool[--pool_len];
+}
+
+/// Returns true if the pool is not full and there's enough free memory to
+/// refill it.
+bool zero_pool_should_refill(void) {
+    return pool_len < CONFIG_VM_ZERO_POOL_PAGES
+           && num_unused_pages > CONFIG_VM_ZERO_POOL_PAGES;
+}
+
+/// Fills up to `max_pages` pages into the pool. Called when the vm server is
+/// idle so that zero-filled page faults don't need to wait for memset.
+void zero_pool_refill(size_t max_pages) {
+    while (max_pages-- > 0 && zero_pool_should_refill()) {
+        paddr_t paddr = page_alloc(1);
+        if (!paddr) {
+            return;
+        }
+
+        void *ptr = page_ptr(paddr, zeroing_page);
+        if (!ptr) {
+            page_decref(paddr2pfn(paddr), 1);
+            return;
+        }
+
+        memset(ptr, 0, PAGE_SIZE);
+        pool[pool_len++] = paddr;
+    }
+}
+
+void zero_pool_init(void) {
+    zeroing_page = virt_page_alloc(vm_task, 1);
+}
@@ -0,0 +1,17 @@
+#ifndef __ZERO_POOL_H__
+#define __ZERO_POOL_H__
+
+#include <types.h>
+
+/// The number of pages taken from the pool.
+extern size_t zero_pool_hits;
+/// The number of pages zero-filled synchronously because the pool was empty
+/// (counted by the caller of zero_pool_alloc).
+extern size_t zero_pool_misses;
+
+paddr_t zero_pool_alloc(void);
+bool zero_pool_should_refill(void);
+void zero_pool_refill(size_t max_pages);
+void zero_pool_init(void);
+
+#endif
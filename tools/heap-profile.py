@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+import argparse
+import json
+import os
+import subprocess
+import sys
+
+
+def parse_log(log_file):
+    """Returns snapshots (printed by malloc_profile_dump()) per program."""
+    programs = {}
+    for line in open(log_file, errors="replace").readlines():
+        start = line.find("{")
+        if start < 0:
+            continue
+        try:
+            data = json.loads(line[start:])
+        except json.JSONDecodeError:
+            continue
+
+        snapshots = programs.setdefault(data.get("program"), [])
+        if data.get("type") == "malloc_profile":
+            # The program may have been restarted and its snapshot IDs may
+            # be reused: keep them in order of appearance.
+            snapshots.append({"profile": data, "sites": {}})
+        elif data.get("type") == "malloc_site":
+            if len(snapshots) == 0 \
+                    or snapshots[-1]["profile"]["snapshot"] != data["snapshot"]:
+                continue
+            snapshots[-1]["sites"][int(data["addr"], 16)] = data
+
+    return {name: snapshots for name, snapshots in programs.items()
+            if len(snapshots) > 0}
+
+
+def symbolize(args, program, addrs):
+    """Maps return addresses to "function (file:line)"."""
+    names = {addr: f"0x{addr:x}" for addr in addrs}
+    names[0] = "(other call sites)"
+    elf = None
+    for path in [f"{program}.debug.elf", f"{program}.elf"]:
+        if os.path.exists(os.path.join(args.build_dir, path)):
+            elf = os.path.join(args.build_dir, path)
+            break
+
+    addrs = [addr for addr in addrs if addr != 0]
+    if elf is None or len(addrs) == 0:
+        return names
+
+    # A return address points to the instruction next to the call.
+    stdout = subprocess.check_output(
+        [args.addr2line, "-f", "-C", "-e", elf]
+        + [f"0x{addr - 1:x}" for addr in addrs]).decode("utf-8")
+    lines = stdout.splitlines()
+    for i, addr in enumerate(addrs):
+        func, loc = lines[i * 2], lines[i * 2 + 1]
+        if func != "??":
+            names[addr] = f"{func} ({os.path.relpath(loc)})"
+    return names
+
+
+def print_snapshot(args, program, snapshot):
+    profile = snapshot["profile"]
+    print(f"{program} (snapshot #{profile['snapshot']}): "
+          f"live={profile['live_bytes']} bytes, "
+          f"peak={profile['peak_bytes']} bytes, "
+          f"allocs={profile['num_allocs']}, frees={profile['num_frees']}")
+
+    histogram = profile["histogram"]
+    for i, count in enumerate(histogram):
+        if i < len(histogram) - 1:
+            label = f"<= {16 << i}"
+        else:
+            label = f"> {16 << (i - 1)}"
+        print(f"  {label:>10} bytes: {count}")
+
+    sites = sorted(snapshot["sites"].values(),
+                   key=lambda site: site["live_bytes"], reverse=True)
+    names = symbolize(args, program, [int(s["addr"], 16) for s in sites])
+    print(f"  {'live':>10} {'peak':>10} {'allocs':>8} {'frees':>8}  call site")
+    for site in sites[:args.limit]:
+        print(f"  {site['live_bytes']:>10} {site['peak_bytes']:>10} "
+              f"{site['num_allocs']:>8} {site['num_frees']:>8}  "
+              f"{names[int(site['addr'], 16)]}")
+
+
+def print_diff(args, program, base, target):
+    base_id = base["profile"]["snapshot"]
+    target_id = target["profile"]["snapshot"]
+    live_diff = target["profile"]["live_bytes"] - base["profile"]["live_bytes"]
+    print(f"{program} (snapshot #{base_id} -> #{target_id}): "
+          f"live={live_diff:+} bytes")
+
+    diffs = []
+    for addr in set(base["sites"]) | set(target["sites"]):
+        empty = {"live_bytes": 0, "num_allocs": 0, "num_frees": 0}
+        old = base["sites"].get(addr, empty)
+        new = target["sites"].get(addr, empty)
+        live = new["live_bytes"] - old["live_bytes"]
+        allocs = new["num_allocs"] - old["num_allocs"]
+        frees = new["num_frees"] - old["num_frees"]
+        if live != 0 or allocs != 0:
+            diffs.append((addr, live, allocs, frees))
+
+    diffs.sort(key=lambda diff: diff[1], reverse=True)
+    names = symbolize(args, program, [diff[0] for diff in diffs])
+    print(f"  {'live':>10} {'allocs':>8} {'frees':>8}  call site")
+    for addr, live, allocs, frees in diffs[:args.limit]:
+        print(f"  {live:>+10} {allocs:>+8} {frees:>+8}  {names[addr]}")
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Symbolizes and compares heap profiles (CONFIG_MALLOC_PROFILE) in the log.")
+    parser.add_argument("--program", help="Show only the program.")
+    parser.add_argument("--diff", action="store_true",
+                        help="Compare two snapshots instead of showing one.")
+    parser.add_argument("--base", type=int, default=-2,
+                        help="The index of the base snapshot (--diff).")
+    parser.add_argument("--target", type=int, default=-1,
+                        help="The index of the snapshot to show or compare.")
+    parser.add_argument("--limit", type=int, default=20,
+                        help="The maximum number of call sites to show.")
+    parser.add_argument("--build-dir", default="build",
+                        help="The directory containing executables.")
+    parser.add_argument("--addr2line", default="addr2line", help="addr2line")
+    parser.add_argument("log_file")
+    args = parser.parse_args()
+
+    programs = parse_log(args.log_file)
+    if args.program:
+        programs = {args.program: programs.get(args.program, [])}
+
+    for program, snapshots in programs.items():
+        try:
+            target = snapshots[args.target]
+            base = snapshots[args.base] if args.diff else None
+        except IndexError:
+            sys.stderr.write(f"{program}: no such snapshot\n")
+            continue
+
+        if args.diff:
+            print_diff(args, program, base, target)
+        else:
+            print_snapshot(args, program, target)
+
+
+if __name__ == "__main__":
+    main()
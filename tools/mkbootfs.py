@@ -9,20 +9,98 @@ PAGE_SIZE = 4096
 JUMP_CODE_SIZE = 16
 FILE_ENTRY_SIZE = 64
 BOOTFS_MAX_SIZE = 64 * 1024 * 1024
+# Keep in sync with servers/vm/bootfs.h.
+BOOTFS_COMPRESSED = 1 << 0
+BOOTFS_BLOCK_SIZE = 16 * 1024
 
 
 def align_up(value, align):
     return (value + align - 1) & ~(align - 1)
 
 
+def lz4_write_len(out, length):
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def lz4_write_sequence(out, literals, offset=0, match_len=0):
+    lit_len = len(literals)
+    token = min(lit_len, 15) << 4
+    if offset:
+        token |= min(match_len - 4, 15)
+    out.append(token)
+    if lit_len >= 15:
+        lz4_write_len(out, lit_len - 15)
+    out += literals
+    if offset:
+        out += struct.pack("<H", offset)
+        if match_len - 4 >= 15:
+            lz4_write_len(out, match_len - 4 - 15)
+
+
+def lz4_compress(data):
+    """Compresses data into the LZ4 block format (greedy matching)."""
+    out = bytearray()
+    table = {}
+    anchor = 0
+    i = 0
+    # The last match must start at least 12 bytes before the end and the last
+    # 5 bytes must be literals.
+    limit = len(data) - 12
+    while i < limit:
+        seq = data[i:i + 4]
+        candidate = table.get(seq)
+        table[seq] = i
+        if candidate is None or i - candidate > 0xffff:
+            i += 1
+            continue
+
+        match_len = 4
+        max_match_len = len(data) - 5 - i
+        while match_len < max_match_len \
+                and data[candidate + match_len] == data[i + match_len]:
+            match_len += 1
+
+        lz4_write_sequence(out, data[anchor:i], i - candidate, match_len)
+        i += match_len
+        anchor = i
+
+    lz4_write_sequence(out, data[anchor:])
+    return bytes(out)
+
+
+def compress_file(data):
+    """Compresses each block of the file independently. The compressed file
+    begins with the table of block offsets (relative to the beginning of the
+    file) followed by the blocks. A block is stored uncompressed if it does
+    not shrink."""
+    blocks = []
+    for off in range(0, len(data), BOOTFS_BLOCK_SIZE):
+        block = data[off:off + BOOTFS_BLOCK_SIZE]
+        compressed = lz4_compress(block)
+        blocks.append(compressed if len(compressed) < len(block) else block)
+
+    table_len = 4 * (len(blocks) + 1)
+    offsets = [table_len]
+    for block in blocks:
+        offsets.append(offsets[-1] + len(block))
+
+    return struct.pack(f"{len(offsets)}I", *offsets) + b"".join(blocks)
+
+
 def main():
     parser = argparse.ArgumentParser(description="Builds a bootfs.")
     parser.add_argument("-o", dest="output", help="The output file.")
+    parser.add_argument("--compress", action="store_true",
+                        help="Compress files.")
     parser.add_argument("files", nargs="*", help="Files.")
     args = parser.parse_args()
 
     # Write the boot binary and the file system header.
-    bootfs = struct.pack("IIII", VERSION, 16, len(args.files), 0)
+    flags = BOOTFS_COMPRESSED if args.compress else 0
+    bootfs = struct.pack("IIII", VERSION, 16, len(args.files), flags)
 
     # Append files.
     file_contents = bytes()
@@ -34,13 +112,17 @@ def main():
             sys.exit(f"too long file name: {name}")
 
         data = open(path, "rb").read()
-        file_contents += data
+        stored = compress_file(data) if args.compress else data
+        file_contents += stored
         bootfs += struct.pack("48sII8x",
                               name.encode("ascii"), file_off, len(data))
 
-        padding = align_up(len(file_contents), PAGE_SIZE) - len(file_contents)
+        # Compressed files are not mapped directly: align only to the block
+        # offset table entry.
+        align = 4 if args.compress else PAGE_SIZE
+        padding = align_up(len(file_contents), align) - len(file_contents)
         file_contents += struct.pack(f"{padding}x")
-        file_off += len(data) + padding
+        file_off += len(stored) + padding
 
     padding = align_up(len(bootfs), PAGE_SIZE) - len(bootfs)
     bootfs += struct.pack(f"{padding}x")